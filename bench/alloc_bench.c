@@ -0,0 +1,490 @@
+/*
+ * alloc_bench - standard allocator workloads against the backends of
+ * malloc_count, called directly (no interposer), for a repeatable baseline
+ * of changes to ltalloc and scalloc.
+ *
+ *   alloc_bench [-b backend,...] [-l library] [-t threads,...]
+ *               [-w workload,...] [-s scale] [-H]
+ *
+ *   -b  allocators, default glibc,ltalloc,scalloc
+ *   -l  library of the (single) allocator given with -b
+ *   -t  thread counts to sweep, default 1,2,4,8
+ *   -w  workloads, default all (see below)
+ *   -s  multiplies the work of every run, default 1
+ *   -H  no CSV header line
+ *
+ * Workloads; every thread does the same amount of work, so ideal scaling
+ * keeps ns_per_op flat as threads grow:
+ *   churn         random sizes replaced at random in a per-thread working set
+ *   threadtest    allocate a batch of small objects, free them all, repeat
+ *   larson        like churn, but the working sets are handed to new threads
+ *                 each round, so most frees hit blocks of another thread
+ *   xmalloc       threads/2 (at least one) producer/consumer pairs: one
+ *                 allocates, the other frees
+ *   cache-scratch each thread frees a block the main thread allocated, then
+ *                 allocates, writes and frees small blocks (false sharing)
+ *   realloc       grow a block from 16 bytes to 1 MiB with realloc
+ *
+ * Every run is a child process of its own, so that peak RSS and faults are
+ * its own. Prints one CSV line per run:
+ *   workload,backend,threads,ops,seconds,ops_per_s,ns_per_op,peak_rss_kb,
+ *   minor_faults
+ * ops counts allocator calls, ns_per_op is thread time per call
+ * (seconds * threads / ops). An allocator whose library does not load is
+ * reported once and skipped.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "alloc_backend.h"
+
+#define MAX_THREADS     256
+#define MAX_LIST        16
+
+struct result {
+        uint64_t ops;
+        double seconds;
+        long peak_rss_kb;
+        long minor_faults;
+};
+
+static double scale = 1;
+
+static double now_s(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t rnd(uint64_t *s)
+{
+        /* xorshift64 */
+        *s ^= *s << 13;
+        *s ^= *s >> 7;
+        *s ^= *s << 17;
+        return *s;
+}
+
+/* mostly small sizes, like the simulation: 8..512, 1 in 16 up to 4 KiB */
+static inline size_t rnd_size(uint64_t *s)
+{
+        uint64_t r = rnd(s);
+        return (r & 0xf0000) ? 8 + (r & 511) : 8 + (r & 4095);
+}
+
+static uint64_t iters(uint64_t n)
+{
+        uint64_t k = (uint64_t)(n * scale);
+        return k ? k : 1;
+}
+
+/* runs fn(arg + i * size) on n threads and returns the sum of the ops */
+static uint64_t run_threads(int n, void *(*fn)(void *), void *arg,
+                            size_t size)
+{
+        pthread_t tid[MAX_THREADS];
+        uint64_t ops = 0;
+        void *r;
+        int i;
+
+        for (i = 0; i < n; ++i)
+                if (pthread_create(&tid[i], NULL, fn,
+                                   (char *)arg + i * size) != 0) {
+                        perror("pthread_create");
+                        exit(EXIT_FAILURE);
+                }
+        for (i = 0; i < n; ++i) {
+                pthread_join(tid[i], &r);
+                ops += (uintptr_t)r;
+        }
+        return ops;
+}
+
+/* churn */
+#define CHURN_SLOTS     1024
+
+static void *churn_thread(void *arg)
+{
+        uint64_t s = 0x9E3779B97F4A7C15ULL ^ (uintptr_t)arg, i, n;
+        char *slot[CHURN_SLOTS] = { NULL };
+
+        n = iters(2000000);
+        for (i = 0; i < n; ++i) {
+                size_t k = rnd(&s) % CHURN_SLOTS, size = rnd_size(&s);
+                a_free(slot[k]);
+                slot[k] = a_malloc(size);
+                slot[k][0] = 1;
+        }
+        for (i = 0; i < CHURN_SLOTS; ++i)
+                a_free(slot[i]);
+        return (void *)(uintptr_t)(2 * n + CHURN_SLOTS);
+}
+
+static uint64_t churn(int threads)
+{
+        return run_threads(threads, churn_thread, NULL, 1);
+}
+
+/* threadtest */
+#define TT_OBJECTS      10000
+#define TT_SIZE         64
+
+static void *threadtest_thread(void *arg)
+{
+        char **obj = malloc(TT_OBJECTS * sizeof(*obj));
+        uint64_t r, n = iters(100), i;
+
+        (void)arg;
+        for (r = 0; r < n; ++r) {
+                for (i = 0; i < TT_OBJECTS; ++i) {
+                        obj[i] = a_malloc(TT_SIZE);
+                        obj[i][0] = 1;
+                }
+                for (i = 0; i < TT_OBJECTS; ++i)
+                        a_free(obj[i]);
+        }
+        free(obj);
+        return (void *)(uintptr_t)(2 * n * TT_OBJECTS);
+}
+
+static uint64_t threadtest(int threads)
+{
+        return run_threads(threads, threadtest_thread, NULL, 1);
+}
+
+/* larson */
+#define LARSON_SLOTS    1000
+#define LARSON_ROUNDS   20
+
+struct larson {
+        char *slot[LARSON_SLOTS];
+        uint64_t seed;
+};
+
+static void *larson_thread(void *arg)
+{
+        struct larson *l = arg;
+        uint64_t i, n = iters(100000);
+
+        for (i = 0; i < n; ++i) {
+                size_t k = rnd(&l->seed) % LARSON_SLOTS;
+                a_free(l->slot[k]);
+                l->slot[k] = a_malloc(16 + rnd(&l->seed) % 1009);
+                l->slot[k][0] = 1;
+        }
+        return (void *)(uintptr_t)(2 * n);
+}
+
+static uint64_t larson(int threads)
+{
+        struct larson *l = calloc(threads, sizeof(*l)), tmp;
+        uint64_t ops = 0;
+        int r, t, i;
+
+        for (t = 0; t < threads; ++t) {
+                l[t].seed = 0x9E3779B97F4A7C15ULL * (t + 1);
+                for (i = 0; i < LARSON_SLOTS; ++i)
+                        l[t].slot[i] = a_malloc(16 + rnd(&l[t].seed) % 1009);
+        }
+        for (r = 0; r < LARSON_ROUNDS; ++r) {
+                ops += run_threads(threads, larson_thread, l, sizeof(*l));
+                /* the next round's threads get another thread's set */
+                tmp = l[0];
+                memmove(l, l + 1, (threads - 1) * sizeof(*l));
+                l[threads - 1] = tmp;
+        }
+        for (t = 0; t < threads; ++t)
+                for (i = 0; i < LARSON_SLOTS; ++i)
+                        a_free(l[t].slot[i]);
+        free(l);
+        return ops + 2 * threads * LARSON_SLOTS;
+}
+
+/* xmalloc: a producer hands its blocks to a consumer through a ring */
+#define XM_RING         1024
+
+struct xmalloc_pair {
+        char *ring[XM_RING];
+        uint64_t head __attribute__((aligned(64)));
+        uint64_t tail __attribute__((aligned(64)));
+        uint64_t n;
+        int consumer;
+} __attribute__((aligned(64)));
+
+static void *xmalloc_thread(void *arg)
+{
+        struct xmalloc_pair *p = *(struct xmalloc_pair **)arg;
+        uint64_t s = 0x9E3779B97F4A7C15ULL ^ (uintptr_t)p, i, pos;
+        int consumer = __atomic_fetch_add(&p->consumer, 1, __ATOMIC_RELAXED);
+
+        for (i = 0; i < p->n; ++i) {
+                if (consumer) {
+                        while ((pos = __atomic_load_n(&p->head,
+                                                      __ATOMIC_ACQUIRE)) ==
+                               p->tail)
+                                sched_yield();
+                        a_free(p->ring[p->tail % XM_RING]);
+                        __atomic_store_n(&p->tail, p->tail + 1,
+                                         __ATOMIC_RELEASE);
+                } else {
+                        char *b = a_malloc(16 + rnd(&s) % 241);
+                        b[0] = 1;
+                        while (p->head - __atomic_load_n(&p->tail,
+                                                         __ATOMIC_ACQUIRE) ==
+                               XM_RING)
+                                sched_yield();
+                        p->ring[p->head % XM_RING] = b;
+                        __atomic_store_n(&p->head, p->head + 1,
+                                         __ATOMIC_RELEASE);
+                }
+        }
+        return (void *)(uintptr_t)p->n;
+}
+
+static uint64_t xmalloc(int threads)
+{
+        int pairs = threads / 2 ? threads / 2 : 1, i;
+        struct xmalloc_pair *p;
+        struct xmalloc_pair **arg = malloc(2 * pairs * sizeof(*arg));
+        uint64_t ops;
+
+        if (posix_memalign((void **)&p, 64, pairs * sizeof(*p)) != 0) {
+                perror("posix_memalign");
+                exit(EXIT_FAILURE);
+        }
+        memset(p, 0, pairs * sizeof(*p));
+        for (i = 0; i < pairs; ++i) {
+                p[i].n = iters(1000000);
+                arg[2 * i] = arg[2 * i + 1] = &p[i];
+        }
+        ops = run_threads(2 * pairs, xmalloc_thread, arg, sizeof(*arg));
+        free(arg);
+        free(p);
+        return ops;
+}
+
+/* cache-scratch */
+#define CS_SIZE         8
+#define CS_WRITES       100
+
+static void *cache_scratch_thread(void *arg)
+{
+        volatile char *b = *(char **)arg;
+        uint64_t i, n = iters(200000);
+        int k;
+
+        a_free((void *)b);
+        for (i = 0; i < n; ++i) {
+                b = a_malloc(CS_SIZE);
+                for (k = 0; k < CS_WRITES; ++k)
+                        b[k % CS_SIZE]++;
+                a_free((void *)b);
+        }
+        return (void *)(uintptr_t)(2 * n + 1);
+}
+
+static uint64_t cache_scratch(int threads)
+{
+        char *b[MAX_THREADS];
+        int i;
+
+        /* allocated together, so likely on shared cache lines */
+        for (i = 0; i < threads; ++i)
+                b[i] = a_malloc(CS_SIZE);
+        return threads + run_threads(threads, cache_scratch_thread, b,
+                                     sizeof(*b));
+}
+
+/* realloc */
+#define RA_MAX          (1 << 20)
+
+static void *realloc_thread(void *arg)
+{
+        uint64_t r, n = iters(500), ops = 0;
+        size_t size;
+        char *b;
+
+        (void)arg;
+        for (r = 0; r < n; ++r) {
+                b = NULL;
+                for (size = 16; size <= RA_MAX; size += size / 4 + 16) {
+                        b = a_realloc(b, size);
+                        b[size - 1] = 1;
+                        ++ops;
+                }
+                a_free(b);
+                ++ops;
+        }
+        return (void *)(uintptr_t)ops;
+}
+
+static uint64_t realloc_growth(int threads)
+{
+        return run_threads(threads, realloc_thread, NULL, 1);
+}
+
+static const struct workload {
+        const char *name;
+        uint64_t (*run)(int threads);
+} workloads[] = {
+        { "churn", churn },
+        { "threadtest", threadtest },
+        { "larson", larson },
+        { "xmalloc", xmalloc },
+        { "cache-scratch", cache_scratch },
+        { "realloc", realloc_growth },
+};
+
+#define NUM_WORKLOADS   (sizeof(workloads) / sizeof(workloads[0]))
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-b backend,...] [-l library] "
+                "[-t threads,...] [-w workload,...] [-s scale] [-H]\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+/* splits a comma separated list in place */
+static int split(char *list, char **item)
+{
+        int n = 0;
+        for (list = strtok(list, ","); list && n < MAX_LIST;
+             list = strtok(NULL, ","))
+                item[n++] = list;
+        return n;
+}
+
+/* one run in a child process; 0 if the allocator could not be loaded */
+static int run(const struct workload *w, const char *backend,
+               const char *lib, int threads, struct result *res)
+{
+        int fd[2], status, got;
+        pid_t pid;
+
+        if (pipe(fd) != 0) {
+                perror("pipe");
+                exit(EXIT_FAILURE);
+        }
+        fflush(stdout);
+        if ((pid = fork()) < 0) {
+                perror("fork");
+                exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+                struct rusage ru0, ru1;
+                double t0;
+
+                close(fd[0]);
+                if (!load_alloc_backend(backend, lib))
+                        _exit(2);
+                getrusage(RUSAGE_SELF, &ru0);
+                t0 = now_s();
+                res->ops = w->run(threads);
+                res->seconds = now_s() - t0;
+                getrusage(RUSAGE_SELF, &ru1);
+                res->peak_rss_kb = ru1.ru_maxrss;
+                res->minor_faults = ru1.ru_minflt - ru0.ru_minflt;
+                if (write(fd[1], res, sizeof(*res)) != sizeof(*res))
+                        _exit(1);
+                _exit(0);
+        }
+        close(fd[1]);
+        got = read(fd[0], res, sizeof(*res)) == sizeof(*res);
+        close(fd[0]);
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) == 1 || (WEXITSTATUS(status) == 0 && !got)) {
+                fprintf(stderr, "%s on %s with %d threads failed\n", w->name,
+                        backend, threads);
+                res->ops = 0;
+                return 1;
+        }
+        return WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv)
+{
+        char default_backends[] = "glibc,ltalloc,scalloc";
+        char default_threads[] = "1,2,4,8";
+        char *backend[MAX_LIST], *thread_list[MAX_LIST], *work[MAX_LIST];
+        char *backend_list = default_backends, *threads_arg = default_threads;
+        char *work_list = NULL;
+        const char *lib = NULL;
+        int nbackends, nthreads, nwork = 0, header = 1, opt, b, t, i;
+        int threads[MAX_LIST];
+        const struct workload *sel[MAX_LIST];
+        struct result res;
+
+        while ((opt = getopt(argc, argv, "b:l:t:w:s:H")) != -1) {
+                switch (opt) {
+                case 'b': backend_list = optarg; break;
+                case 'l': lib = optarg; break;
+                case 't': threads_arg = optarg; break;
+                case 'w': work_list = optarg; break;
+                case 's': scale = atof(optarg); break;
+                case 'H': header = 0; break;
+                default: usage(argv[0]);
+                }
+        }
+        nbackends = split(backend_list, backend);
+        nthreads = split(threads_arg, thread_list);
+        if (lib && nbackends != 1)
+                usage(argv[0]);
+        for (t = 0; t < nthreads; ++t) {
+                threads[t] = atoi(thread_list[t]);
+                if (threads[t] < 1 || threads[t] > MAX_THREADS)
+                        usage(argv[0]);
+        }
+        if (work_list) {
+                nwork = split(work_list, work);
+                for (i = 0; i < nwork; ++i) {
+                        size_t k;
+                        for (k = 0; k < NUM_WORKLOADS; ++k)
+                                if (strcmp(work[i], workloads[k].name) == 0)
+                                        break;
+                        if (k == NUM_WORKLOADS) {
+                                fprintf(stderr, "unknown workload %s\n",
+                                        work[i]);
+                                return EXIT_FAILURE;
+                        }
+                        sel[i] = &workloads[k];
+                }
+        } else {
+                for (i = 0; i < (int)NUM_WORKLOADS; ++i)
+                        sel[nwork++] = &workloads[i];
+        }
+
+        if (header)
+                printf("workload,backend,threads,ops,seconds,ops_per_s,"
+                       "ns_per_op,peak_rss_kb,minor_faults\n");
+        for (b = 0; b < nbackends; ++b) {
+                for (i = 0; i < nwork; ++i) {
+                        for (t = 0; t < nthreads; ++t) {
+                                if (!run(sel[i], backend[b], lib, threads[t],
+                                         &res))
+                                        goto next_backend;
+                                if (!res.ops)
+                                        continue;
+                                printf("%s,%s,%d,%llu,%.4f,%.0f,%.2f,%ld,"
+                                       "%ld\n", sel[i]->name, backend[b],
+                                       threads[t],
+                                       (unsigned long long)res.ops,
+                                       res.seconds, res.ops / res.seconds,
+                                       res.seconds * 1e9 * threads[t] /
+                                       res.ops, res.peak_rss_kb,
+                                       res.minor_faults);
+                        }
+                }
+next_backend:
+                ;
+        }
+        return EXIT_SUCCESS;
+}
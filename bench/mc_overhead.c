@@ -0,0 +1,468 @@
+/*
+ * mc_overhead - what malloc_count costs per allocator call, measured
+ * against the same backend called directly.
+ *
+ *   mc_overhead [-b backend,...] [-c config,...] [-t threads] [-n ops]
+ *               [-k repeats] [-C previous.csv] [-r tolerance] [-H] [-v]
+ *
+ *   -b  allocators, default glibc,ltalloc,scalloc
+ *   -c  configurations, default raw,norecord,record,callback:
+ *         raw       the backend's own functions, the baseline
+ *         norecord  through malloc_count after malloc_count_record_stop()
+ *         record    through malloc_count, logging to heap.log
+ *         callback  as record, with a malloc_count_set_callback() callback
+ *   -t  threads running the workload, default 1
+ *   -n  allocator calls per thread, default 4M
+ *   -k  runs of each row; the fastest is reported, default 3
+ *   -C  compare with the CSV of an earlier run and exit with 1 if the
+ *       overhead of a row grew by more than the tolerance (-r, default
+ *       0.25) and 2 ns
+ *   -H  no CSV header line
+ *   -v  show the output of the runs
+ *
+ * The workload replaces random blocks of 16 to 512 bytes in a working set
+ * of 256, calling malloc and free through function pointers in every
+ * configuration. Each run is a process of its own: raw runs are children of
+ * this program, the others run mc_overhead_worker, the same source linked
+ * with the interposer objects of the current build (so make proprietary=1,
+ * loginterval=1 or static=1 give those builds) in a scratch directory for
+ * its heap.log. Prints one CSV line per row:
+ *   build,backend,config,threads,ops,ns_per_op,overhead_ns,
+ *   cache_misses_per_op,extra_misses_per_op
+ * overhead_ns and extra_misses_per_op are relative to the raw row of the
+ * same backend, empty without one. Cache misses come from perf events and
+ * are -1 where those are not available.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+#include "ringbuffer.h"
+#ifdef MC_OVERHEAD_WORKER
+#include "malloc_count.h"
+#else
+#include "alloc_backend.h"
+#endif
+
+#define WORKING_SET     256
+#define MAX_THREADS     256
+#define MAX_LIST        16
+#define MAX_ROWS        256
+#define NOISE_NS        2.0     /* smaller changes are never regressions */
+
+#if PROPRIETARY_LOGGING
+#define BUILD "proprietary"
+#elif MALLOC_COUNT_LOG_INTERVAL
+#define BUILD "interval"
+#elif MALLOC_COUNT_STATIC_BACKEND
+#define BUILD "static"
+#else
+#define BUILD "default"
+#endif
+
+struct result {
+        uint64_t ops;
+        double ns_per_op;               /* thread time */
+        double misses_per_op;           /* -1: not measured */
+};
+
+struct worker {
+        void *(*m)(size_t);
+        void (*f)(void *);
+        uint64_t n;
+        double seconds;
+        long long misses;
+};
+
+static const size_t sizes[8] = { 16, 32, 48, 64, 96, 128, 256, 512 };
+
+static double now_s(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* user space cache misses of the calling thread, -1 if unavailable */
+static int open_misses(void)
+{
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void churn(struct worker *w, uint64_t n, char **slot, uint64_t *s)
+{
+        uint64_t i;
+
+        for (i = 0; i < n; i += 2) {
+                size_t k;
+                *s ^= *s << 13;
+                *s ^= *s >> 7;
+                *s ^= *s << 17;
+                k = *s % WORKING_SET;
+                w->f(slot[k]);
+                slot[k] = w->m(sizes[(*s >> 32) & 7]);
+                slot[k][0] = 1;
+        }
+}
+
+static void *workload(void *arg)
+{
+        struct worker *w = arg;
+        char *slot[WORKING_SET] = { NULL };
+        uint64_t s = 0x9E3779B97F4A7C15ULL ^ (uintptr_t)w;
+        long long misses = -1;
+        int fd = open_misses(), k;
+        double t0;
+
+        /* warm up the thread cache and the interposer's shard */
+        churn(w, w->n / 8, slot, &s);
+        if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        t0 = now_s();
+        churn(w, w->n, slot, &s);
+        w->seconds = now_s() - t0;
+        if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+                        misses = -1;
+                close(fd);
+        }
+        w->misses = misses;
+        for (k = 0; k < WORKING_SET; ++k)
+                w->f(slot[k]);
+        return NULL;
+}
+
+/* runs the workload on threads threads with m and f */
+static void measure(void *(*m)(size_t), void (*f)(void *), int threads,
+                    uint64_t n, struct result *res)
+{
+        struct worker w[MAX_THREADS];
+        pthread_t tid[MAX_THREADS];
+        double seconds = 0;
+        long long misses = 0;
+        int i;
+
+        for (i = 0; i < threads; ++i) {
+                w[i].m = m;
+                w[i].f = f;
+                w[i].n = n;
+                pthread_create(&tid[i], NULL, workload, &w[i]);
+        }
+        for (i = 0; i < threads; ++i) {
+                pthread_join(tid[i], NULL);
+                seconds += w[i].seconds;
+                if (w[i].misses < 0 || misses < 0)
+                        misses = -1;
+                else
+                        misses += w[i].misses;
+        }
+        res->ops = n * threads;
+        res->ns_per_op = seconds * 1e9 / res->ops;
+        res->misses_per_op = misses < 0 ? -1 : (double)misses / res->ops;
+}
+
+#ifdef MC_OVERHEAD_WORKER
+
+static volatile size_t callback_peak;
+
+static void callback(void *cookie, size_t current)
+{
+        (void)cookie;
+        if (current > callback_peak)
+                callback_peak = current;
+}
+
+/* mc_overhead_worker config threads ops fd: measures through malloc_count
+ * and writes the struct result to fd */
+int main(int argc, char **argv)
+{
+        void *(*volatile m)(size_t) = malloc;
+        void (*volatile f)(void *) = free;
+        struct result res;
+        int fd;
+
+        if (argc != 5) {
+                fprintf(stderr, "usage: %s config threads ops fd\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+        if (strcmp(argv[1], "norecord") == 0)
+                malloc_count_record_stop();
+        else if (strcmp(argv[1], "callback") == 0)
+                malloc_count_set_callback(callback, NULL);
+        else if (strcmp(argv[1], "record") != 0) {
+                fprintf(stderr, "unknown configuration %s\n", argv[1]);
+                return EXIT_FAILURE;
+        }
+        measure(m, f, atoi(argv[2]), strtoull(argv[3], NULL, 10), &res);
+        fd = atoi(argv[4]);
+        if (write(fd, &res, sizeof(res)) != sizeof(res))
+                return EXIT_FAILURE;
+        return EXIT_SUCCESS;
+}
+
+#else /* !MC_OVERHEAD_WORKER */
+
+struct row {
+        char key[128];                  /* build,backend,config,threads */
+        double overhead;
+};
+
+static char scratch[] = "/tmp/mc_overhead.XXXXXX";
+static int verbose;
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-b backend,...] [-c config,...] "
+                "[-t threads] [-n ops] [-k repeats] [-C previous.csv] "
+                "[-r tolerance] [-H] [-v]\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+static int split(char *list, char **item)
+{
+        int n = 0;
+        for (list = strtok(list, ","); list && n < MAX_LIST;
+             list = strtok(NULL, ","))
+                item[n++] = list;
+        return n;
+}
+
+static void clean_scratch(void)
+{
+        char path[sizeof(scratch) + 256];
+        struct dirent *e;
+        DIR *d = opendir(scratch);
+
+        if (!d)
+                return;
+        while ((e = readdir(d)) != NULL) {
+                if (e->d_name[0] == '.')
+                        continue;
+                snprintf(path, sizeof(path), "%s/%s", scratch, e->d_name);
+                unlink(path);
+        }
+        closedir(d);
+}
+
+/* one run in a child process: raw in a fork of this one, the others in the
+ * worker. 0 if it failed. */
+static int run(const char *backend, const char *lib, const char *config,
+               int threads, uint64_t n, struct result *res)
+{
+        char worker[4096], fd_arg[16], threads_arg[16], ops_arg[32];
+        int fd[2], status, got, raw = strcmp(config, "raw") == 0;
+        pid_t pid;
+        ssize_t len;
+
+        if (pipe(fd) != 0) {
+                perror("pipe");
+                exit(EXIT_FAILURE);
+        }
+        fflush(stdout);
+        if ((pid = fork()) < 0) {
+                perror("fork");
+                exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+                close(fd[0]);
+                if (raw) {
+                        if (!load_alloc_backend(backend, lib))
+                                _exit(EXIT_FAILURE);
+                        measure(a_malloc, a_free, threads, n, res);
+                        _exit(write(fd[1], res, sizeof(*res)) ==
+                              sizeof(*res) ? EXIT_SUCCESS : EXIT_FAILURE);
+                }
+                len = readlink("/proc/self/exe", worker,
+                               sizeof(worker) - sizeof("_worker"));
+                worker[len > 0 ? len : 0] = 0;
+                strcat(worker, "_worker");
+                snprintf(fd_arg, sizeof(fd_arg), "%d", fd[1]);
+                snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+                snprintf(ops_arg, sizeof(ops_arg), "%llu",
+                         (unsigned long long)n);
+                setenv("MALLOC_COUNT_BACKEND", backend, 1);
+                if (lib)
+                        setenv("MALLOC_COUNT_BACKEND_LIB", lib, 1);
+                else
+                        unsetenv("MALLOC_COUNT_BACKEND_LIB");
+                if (chdir(scratch) != 0)
+                        _exit(EXIT_FAILURE);
+                if (!verbose) {
+                        int null = open("/dev/null", O_WRONLY);
+                        dup2(null, STDOUT_FILENO);
+                        dup2(null, STDERR_FILENO);
+                }
+                execl(worker, worker, config, threads_arg, ops_arg, fd_arg,
+                      (char *)NULL);
+                perror(worker);
+                _exit(EXIT_FAILURE);
+        }
+        close(fd[1]);
+        got = read(fd[0], res, sizeof(*res)) == sizeof(*res);
+        close(fd[0]);
+        waitpid(pid, &status, 0);
+        clean_scratch();
+        if (!got || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "%s %s with %d threads failed\n", backend,
+                        config, threads);
+                return 0;
+        }
+        return 1;
+}
+
+/* rows of an earlier run with an overhead */
+static int read_previous(const char *name, struct row *rows)
+{
+        char line[512], *f[9];
+        int n = 0, k;
+        FILE *in = fopen(name, "r");
+
+        if (!in) {
+                perror(name);
+                exit(EXIT_FAILURE);
+        }
+        while (n < MAX_ROWS && fgets(line, sizeof(line), in)) {
+                char *p = line;
+                line[strcspn(line, "\n")] = 0;
+                for (k = 0; k < 9 && p; ++k) {
+                        f[k] = p;
+                        if ((p = strchr(p, ',')) != NULL)
+                                *p++ = 0;
+                }
+                if (k < 9 || !*f[6] || strcmp(f[0], "build") == 0)
+                        continue;
+                snprintf(rows[n].key, sizeof(rows[n].key), "%s,%s,%s,%s",
+                         f[0], f[1], f[2], f[3]);
+                rows[n++].overhead = atof(f[6]);
+        }
+        fclose(in);
+        return n;
+}
+
+int main(int argc, char **argv)
+{
+        char default_backends[] = "glibc,ltalloc,scalloc";
+        char default_configs[] = "raw,norecord,record,callback";
+        char *backend_list = default_backends, *config_list = default_configs;
+        char *backend[MAX_LIST], *config[MAX_LIST], key[128];
+        const char *previous = NULL;
+        struct row prev[MAX_ROWS];
+        double tolerance = 0.25;
+        uint64_t n = 4000000;
+        int threads = 1, repeats = 3, header = 1, nprev = 0, regressions = 0;
+        int nbackends, nconfigs, opt, b, c, k, i;
+
+        while ((opt = getopt(argc, argv, "b:c:t:n:k:C:r:Hv")) != -1) {
+                switch (opt) {
+                case 'b': backend_list = optarg; break;
+                case 'c': config_list = optarg; break;
+                case 't': threads = atoi(optarg); break;
+                case 'n': n = strtoull(optarg, NULL, 10); break;
+                case 'k': repeats = atoi(optarg); break;
+                case 'C': previous = optarg; break;
+                case 'r': tolerance = atof(optarg); break;
+                case 'H': header = 0; break;
+                case 'v': verbose = 1; break;
+                default: usage(argv[0]);
+                }
+        }
+        if (threads < 1 || threads > MAX_THREADS || !n || repeats < 1)
+                usage(argv[0]);
+        nbackends = split(backend_list, backend);
+        nconfigs = split(config_list, config);
+        if (previous)
+                nprev = read_previous(previous, prev);
+        if (!mkdtemp(scratch)) {
+                perror(scratch);
+                return EXIT_FAILURE;
+        }
+
+        if (header)
+                printf("build,backend,config,threads,ops,ns_per_op,"
+                       "overhead_ns,cache_misses_per_op,"
+                       "extra_misses_per_op\n");
+        for (b = 0; b < nbackends; ++b) {
+                const struct alloc_backend *ab = find_alloc_backend(backend[b]);
+                const char *lib = ab ? alloc_backend_lib(ab) : NULL;
+                struct result raw = { 0, -1, -1 };
+
+                if (!ab)
+                        continue;
+                if (lib && access(lib, R_OK) != 0) {
+                        fprintf(stderr, "%s: %s not built, skipped\n",
+                                backend[b], lib);
+                        continue;
+                }
+                for (c = 0; c < nconfigs; ++c) {
+                        struct result best = { 0, -1, -1 }, res;
+                        double overhead = 0;
+
+                        for (k = 0; k < repeats; ++k)
+                                if (run(backend[b], lib, config[c], threads,
+                                        n, &res) &&
+                                    (best.ns_per_op < 0 ||
+                                     res.ns_per_op < best.ns_per_op))
+                                        best = res;
+                        if (best.ns_per_op < 0)
+                                continue;
+                        if (strcmp(config[c], "raw") == 0)
+                                raw = best;
+                        printf(BUILD ",%s,%s,%d,%llu,%.2f,", backend[b],
+                               config[c], threads,
+                               (unsigned long long)best.ops, best.ns_per_op);
+                        if (raw.ns_per_op >= 0) {
+                                overhead = best.ns_per_op - raw.ns_per_op;
+                                printf("%.2f", overhead);
+                        }
+                        printf(",%.4f,", best.misses_per_op);
+                        if (raw.misses_per_op >= 0 && best.misses_per_op >= 0)
+                                printf("%.4f", best.misses_per_op -
+                                       raw.misses_per_op);
+                        printf("\n");
+                        fflush(stdout);
+
+                        if (raw.ns_per_op < 0)
+                                continue;
+                        snprintf(key, sizeof(key), BUILD ",%s,%s,%d",
+                                 backend[b], config[c], threads);
+                        for (i = 0; i < nprev; ++i)
+                                if (strcmp(prev[i].key, key) == 0 &&
+                                    overhead > prev[i].overhead *
+                                    (1 + tolerance) &&
+                                    overhead - prev[i].overhead > NOISE_NS) {
+                                        fprintf(stderr, "regression: %s "
+                                                "overhead %.2f ns, was "
+                                                "%.2f ns\n", key, overhead,
+                                                prev[i].overhead);
+                                        ++regressions;
+                                }
+                }
+        }
+        clean_scratch();
+        rmdir(scratch);
+        return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif /* MC_OVERHEAD_WORKER */
@@ -0,0 +1,524 @@
+/*
+ * rb_bench - throughput, latency and integrity of the heap log rings.
+ *
+ *   rb_bench [-t producers,...] [-o policy,...] [-c cells,...] [-n records]
+ *            [-H] [-v]
+ *
+ *   -t  producer threads, default 1,2,4,8
+ *   -o  ring overflow policies (MALLOC_COUNT_RING_OVERFLOW), default
+ *       block,drop,overwrite,sample
+ *   -c  cells per ring (MALLOC_COUNT_RING_CELLS), default 65536,1024
+ *   -n  records put by each producer, default 1M
+ *   -H  no CSV header line
+ *   -v  show the output of the runs
+ *
+ * Each row runs in a process of its own, in a scratch directory for its
+ * heap.log: the producers call rb_put() as fast as they can while a reader
+ * thread drains the rings with rb_write_log() and rb_wait() the way the one
+ * in malloc_count.cpp does. A record carries its producer in alloc_size and
+ * its sequence number in curr_heap_size. Once everything is written the log
+ * is read back (raw or MALLOC_COUNT_LOG_FORMAT=compact) and every producer's
+ * sequence checked: the numbers skipped before a record must be those its
+ * lost field and sampled weight account for, and all records put must show
+ * up as a record, a loss or weight. Prints one CSV line per row:
+ *   producers,overflow,cells,records,seconds,records_per_s,put_mean_ns,
+ *   put_p50_ns,put_p99_ns,put_p999_ns,put_max_ns,full_puts,blocked_ms,
+ *   written,lost,sampled,missing,corrupt,out_of_order
+ * seconds runs from the start of the producers until the log is closed.
+ * full_puts counts the puts that found their ring full and blocked_ms the
+ * time spent in them. missing are records put that the log does not account
+ * for, corrupt records with a bad producer, a sequence number that went
+ * backwards or a gap that does not match, out_of_order records with an
+ * earlier timestamp than the one before. Exits with 1 if any of these is
+ * not 0, or if the block policy lost records.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "ringbuffer.h"
+#include "heaplog.h"
+#include "latency_hist.h"
+#include "tsc.h"
+
+#define MAX_PRODUCERS   (RB_MAX_RINGS - 1)      /* ring 0 is shared */
+#define MAX_LIST        16
+#define READER_SPINS    1000    /* as in malloc_count.cpp */
+#define READER_WAIT_MS  10
+
+static const char *const policies[] = { "block", "drop", "overwrite",
+                                        "sample" };
+
+struct result {
+        double seconds;
+        double put_mean_ns, put_p50_ns, put_p99_ns, put_p999_ns, put_max_ns;
+        uint64_t full_puts;
+        double blocked_ms;
+        uint64_t written;               /* records in the log */
+        uint64_t lost;                  /* sum of their lost fields */
+        uint64_t sampled;               /* weight above 1 per record */
+        int64_t missing;
+        uint64_t corrupt;
+        uint64_t out_of_order;
+};
+
+struct producer {
+        uint32_t id;
+        uint32_t n;
+        struct latency_hist hist;       /* ticks per rb_put() */
+        uint64_t full_puts;
+        uint64_t blocked_ticks;
+};
+
+static struct ringbuffer rb;
+static pthread_barrier_t start;
+
+static double now_s(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the loop of reader_thread() in malloc_count.cpp */
+static void *reader(void *arg)
+{
+        unsigned idle = 0;
+
+        (void)arg;
+        while (!(reader_end_flag && rb_empty(&rb))) {
+                if (rb_write_log(&rb))
+                        idle = 0;
+                else if (++idle < READER_SPINS)
+                        __asm__ __volatile__("pause" ::: "memory");
+                else
+                        rb_wait(&rb, READER_WAIT_MS);
+        }
+        return NULL;
+}
+
+/* the ring p's first record went to: a fresh ring, so that record is in
+ * cell 0. NULL if p shares ring 0. */
+static struct rb_thread_ring *own_ring(struct producer *p)
+{
+        uint32_t i, n = __atomic_load_n(&rb.num_rings, __ATOMIC_ACQUIRE);
+
+        for (i = 1; i < n; ++i)
+                if (__atomic_load_n(&rb.ring[i]->in_use, __ATOMIC_RELAXED) &&
+                    rb.ring[i]->cell[0].alloc_size == p->id + 1)
+                        return rb.ring[i];
+        return NULL;
+}
+
+static void *produce(void *arg)
+{
+        struct producer *p = arg;
+        struct rb_thread_ring *r = NULL;
+        struct ringbuff_cell c;
+        uint32_t i;
+
+        memset(&c, 0, sizeof(c));
+        c.alloc_size = p->id + 1;
+        c.weight = 1;
+        pthread_barrier_wait(&start);
+        for (i = 0; i < p->n; ++i) {
+                uint64_t t0, t1;
+                int full = r && r->head -
+                        __atomic_load_n(&r->tail, __ATOMIC_RELAXED) >=
+                        rb.cells;
+
+                c.curr_heap_size = i;
+                t0 = tsc_begin();
+                rb_put(&rb, &c);
+                t1 = tsc_end();
+                t1 = t1 - t0 > tsc_overhead ? t1 - t0 - tsc_overhead : 0;
+                latency_record(&p->hist, t1);
+                if (full) {
+                        ++p->full_puts;
+                        p->blocked_ticks += t1;
+                }
+                if (i == 0)
+                        r = own_ring(p);
+        }
+        return NULL;
+}
+
+static int field_offset(const struct heaplog_header *h, const char *name,
+                        uint16_t type)
+{
+        uint32_t f;
+
+        for (f = 0; f < h->num_fields && f < HEAPLOG_MAX_FIELDS; ++f)
+                if (strncmp(h->fields[f].name, name, HEAPLOG_NAME_LEN) == 0 &&
+                    h->fields[f].type == type)
+                        return h->fields[f].offset;
+        fprintf(stderr, "%s: no field %s\n", FILE_NAME, name);
+        return -1;
+}
+
+struct check {
+        const struct heaplog_header *h;
+        int seq_off, id_off, weight_off, lost_off, time_off;
+        uint32_t producers;
+        uint32_t *next;                 /* expected sequence per producer */
+        double last_time;
+        double weight;                  /* sum of all records */
+        struct result *res;
+};
+
+static void check_record(struct check *k, const char *rec)
+{
+        uint32_t seq, id, lost, skipped;
+        float weight;
+        double time;
+
+        memcpy(&seq, rec + k->seq_off, sizeof(seq));
+        memcpy(&id, rec + k->id_off, sizeof(id));
+        memcpy(&weight, rec + k->weight_off, sizeof(weight));
+        memcpy(&lost, rec + k->lost_off, sizeof(lost));
+        memcpy(&time, rec + k->time_off, sizeof(time));
+
+        ++k->res->written;
+        k->res->lost += lost;
+        k->weight += weight;
+        if (time < k->last_time)
+                ++k->res->out_of_order;
+        k->last_time = time;
+        if (id == 0)                    /* losses at the end, rb_deinit() */
+                return;
+        if (id > k->producers || weight < 1) {
+                ++k->res->corrupt;
+                return;
+        }
+        k->res->sampled += (uint64_t)weight - 1;
+        skipped = seq - k->next[id - 1];
+        if ((int32_t)skipped < 0 ||
+            skipped != lost + (uint32_t)weight - 1)
+                ++k->res->corrupt;
+        k->next[id - 1] = seq + 1;
+}
+
+/* reads heap.log back and checks the records of producers producers of n
+ * records each */
+static int check_log(uint32_t producers, uint32_t n, struct result *res)
+{
+        struct heaplog_header h;
+        struct check k;
+        struct stat st;
+        const char *map, *p, *end;
+        char *out = NULL;
+        int fd = open(FILE_NAME, O_RDONLY);
+
+        if (fd < 0 || fstat(fd, &st) != 0) {
+                perror(FILE_NAME);
+                return 0;
+        }
+        if ((size_t)st.st_size < sizeof(h) ||
+            (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+            MAP_FAILED) {
+                fprintf(stderr, "%s: no log\n", FILE_NAME);
+                close(fd);
+                return 0;
+        }
+        close(fd);
+        memcpy(&h, map, sizeof(h));
+        if (memcmp(h.magic, HEAPLOG_MAGIC, sizeof(h.magic)) ||
+            h.version != HEAPLOG_VERSION || h.record_size == 0) {
+                fprintf(stderr, "%s: not a version %d heap log\n", FILE_NAME,
+                        HEAPLOG_VERSION);
+                munmap((void *)map, st.st_size);
+                return 0;
+        }
+        memset(&k, 0, sizeof(k));
+        k.h = &h;
+        k.seq_off = field_offset(&h, "curr_heap_size", HEAPLOG_U32);
+        k.id_off = field_offset(&h, "alloc_size", HEAPLOG_U32);
+        k.weight_off = field_offset(&h, "weight", HEAPLOG_F32);
+        k.lost_off = field_offset(&h, "lost", HEAPLOG_U32);
+        k.time_off = field_offset(&h, HEAPLOG_TIMESTAMP, HEAPLOG_F64);
+        if (k.seq_off < 0 || k.id_off < 0 || k.weight_off < 0 ||
+            k.lost_off < 0 || k.time_off < 0) {
+                munmap((void *)map, st.st_size);
+                return 0;
+        }
+        k.producers = producers;
+        k.next = calloc(producers, sizeof(*k.next));
+        k.res = res;
+
+        p = map + h.header_size;
+        end = map + st.st_size;
+        if (h.encoding == HEAPLOG_ENC_BLOCKS) {
+                uint32_t max = h.block_size;    /* records, at most */
+                out = malloc((size_t)max * h.record_size);
+                for (; p + h.block_size <= end; p += h.block_size) {
+                        int i, got = heaplog_decode_block(&h, p, h.block_size,
+                                                          out, max);
+                        if (got < 0) {
+                                fprintf(stderr, "%s: bad block at %zu\n",
+                                        FILE_NAME, (size_t)(p - map));
+                                ++res->corrupt;
+                                continue;
+                        }
+                        for (i = 0; i < got; ++i)
+                                check_record(&k, out + (size_t)i *
+                                             h.record_size);
+                }
+        } else {
+                for (; p + h.record_size <= end; p += h.record_size)
+                        check_record(&k, p);
+        }
+        if (p != end)
+                ++res->corrupt;         /* partial record or block */
+        res->missing = (int64_t)producers * n -
+                       (int64_t)(k.weight + (double)res->lost + 0.5);
+        free(out);
+        free(k.next);
+        munmap((void *)map, st.st_size);
+        return 1;
+}
+
+/* the run in the child: producers threads of n records each, then the
+ * check of the log */
+static int measure(uint32_t producers, uint32_t n, struct result *res)
+{
+        struct producer *p = calloc(producers, sizeof(*p));
+        struct latency_hist *all = calloc(1, sizeof(*all));
+        pthread_t tid[MAX_PRODUCERS], reader_id;
+        uint64_t blocked = 0;
+        double t0;
+        uint32_t i;
+
+        tsc_calibrate();
+        rb_init(&rb, "rb_bench");
+        pthread_barrier_init(&start, NULL, producers + 1);
+        pthread_create(&reader_id, NULL, reader, NULL);
+        for (i = 0; i < producers; ++i) {
+                p[i].id = i;
+                p[i].n = n;
+                pthread_create(&tid[i], NULL, produce, &p[i]);
+        }
+        t0 = now_s();
+        pthread_barrier_wait(&start);
+        for (i = 0; i < producers; ++i)
+                pthread_join(tid[i], NULL);
+        reader_end_flag = true;
+        rb_wake(&rb);
+        pthread_join(reader_id, NULL);
+        rb_deinit(&rb);
+        res->seconds = now_s() - t0;
+
+        for (i = 0; i < producers; ++i) {
+                latency_merge(all, &p[i].hist);
+                res->full_puts += p[i].full_puts;
+                blocked += p[i].blocked_ticks;
+        }
+        res->put_mean_ns = all->total / tsc_ticks_per_ns /
+                           ((double)producers * n);
+        res->put_p50_ns = latency_percentile(all, (uint64_t)producers * n,
+                                             0.5) / tsc_ticks_per_ns;
+        res->put_p99_ns = latency_percentile(all, (uint64_t)producers * n,
+                                             0.99) / tsc_ticks_per_ns;
+        res->put_p999_ns = latency_percentile(all, (uint64_t)producers * n,
+                                              0.999) / tsc_ticks_per_ns;
+        res->put_max_ns = all->max / tsc_ticks_per_ns;
+        res->blocked_ms = blocked / tsc_ticks_per_ns / 1e6;
+        free(all);
+        free(p);
+        if (!check_log(producers, n, res))
+                return 0;
+        if (res->written != rb.written) {
+                fprintf(stderr, "%llu records in the log, %llu written\n",
+                        (unsigned long long)res->written,
+                        (unsigned long long)rb.written);
+                ++res->corrupt;
+        }
+        return 1;
+}
+
+static char scratch[] = "/tmp/rb_bench.XXXXXX";
+static int verbose;
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-t producers,...] [-o policy,...] "
+                "[-c cells,...] [-n records] [-H] [-v]\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+static int split(char *list, char **item)
+{
+        int n = 0;
+        for (list = strtok(list, ","); list && n < MAX_LIST;
+             list = strtok(NULL, ","))
+                item[n++] = list;
+        return n;
+}
+
+static void clean_scratch(void)
+{
+        char path[sizeof(scratch) + 256];
+        struct dirent *e;
+        DIR *d = opendir(scratch);
+
+        if (!d)
+                return;
+        while ((e = readdir(d)) != NULL) {
+                if (e->d_name[0] == '.')
+                        continue;
+                snprintf(path, sizeof(path), "%s/%s", scratch, e->d_name);
+                unlink(path);
+        }
+        closedir(d);
+}
+
+/* one row in a child process, as the rings and the log are set up once per
+ * process. 0 if it failed. */
+static int run(int producers, const char *policy, const char *cells,
+               uint32_t n, struct result *res)
+{
+        int fd[2], status, got;
+        pid_t pid;
+
+        if (pipe(fd) != 0) {
+                perror("pipe");
+                exit(EXIT_FAILURE);
+        }
+        fflush(stdout);
+        if ((pid = fork()) < 0) {
+                perror("fork");
+                exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+                close(fd[0]);
+                setenv("MALLOC_COUNT_RING_OVERFLOW", policy, 1);
+                setenv("MALLOC_COUNT_RING_CELLS", cells, 1);
+                /* the check reads a single heap.log */
+                unsetenv("MALLOC_COUNT_LOG_SHM");
+                unsetenv("MALLOC_COUNT_LOG_SEGMENT_MB");
+                if (chdir(scratch) != 0)
+                        _exit(EXIT_FAILURE);
+                if (!verbose) {
+                        int null = open("/dev/null", O_WRONLY);
+                        dup2(null, STDOUT_FILENO);
+                }
+                memset(res, 0, sizeof(*res));
+                if (!measure(producers, n, res))
+                        _exit(EXIT_FAILURE);
+                _exit(write(fd[1], res, sizeof(*res)) == sizeof(*res) ?
+                      EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        close(fd[1]);
+        got = read(fd[0], res, sizeof(*res)) == sizeof(*res);
+        close(fd[0]);
+        waitpid(pid, &status, 0);
+        clean_scratch();
+        if (!got || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "%d producers, %s, %s cells failed\n",
+                        producers, policy, cells);
+                return 0;
+        }
+        return 1;
+}
+
+int main(int argc, char **argv)
+{
+        char default_producers[] = "1,2,4,8";
+        char default_policies[] = "block,drop,overwrite,sample";
+        char default_cells[] = "65536,1024";
+        char *producer_list = default_producers;
+        char *policy_list = default_policies, *cells_list = default_cells;
+        char *producer[MAX_LIST], *policy[MAX_LIST], *cells[MAX_LIST];
+        uint32_t n = 1000000;
+        int header = 1, failures = 0, nproducers, npolicies, ncells;
+        int opt, t, o, c;
+        size_t i;
+
+        while ((opt = getopt(argc, argv, "t:o:c:n:Hv")) != -1) {
+                switch (opt) {
+                case 't': producer_list = optarg; break;
+                case 'o': policy_list = optarg; break;
+                case 'c': cells_list = optarg; break;
+                case 'n': n = strtoul(optarg, NULL, 10); break;
+                case 'H': header = 0; break;
+                case 'v': verbose = 1; break;
+                default: usage(argv[0]);
+                }
+        }
+        nproducers = split(producer_list, producer);
+        npolicies = split(policy_list, policy);
+        ncells = split(cells_list, cells);
+        if (!n || n > INT32_MAX)
+                usage(argv[0]);
+        for (t = 0; t < nproducers; ++t)
+                if (atoi(producer[t]) < 1 || atoi(producer[t]) > MAX_PRODUCERS)
+                        usage(argv[0]);
+        for (o = 0; o < npolicies; ++o) {
+                for (i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i)
+                        if (strcmp(policy[o], policies[i]) == 0)
+                                break;
+                if (i == sizeof(policies) / sizeof(policies[0])) {
+                        fprintf(stderr, "unknown overflow policy %s\n",
+                                policy[o]);
+                        usage(argv[0]);
+                }
+        }
+        if (!mkdtemp(scratch)) {
+                perror(scratch);
+                return EXIT_FAILURE;
+        }
+
+        if (header)
+                printf("producers,overflow,cells,records,seconds,"
+                       "records_per_s,put_mean_ns,put_p50_ns,put_p99_ns,"
+                       "put_p999_ns,put_max_ns,full_puts,blocked_ms,written,"
+                       "lost,sampled,missing,corrupt,out_of_order\n");
+        for (c = 0; c < ncells; ++c)
+                for (o = 0; o < npolicies; ++o)
+                        for (t = 0; t < nproducers; ++t) {
+                                int threads = atoi(producer[t]);
+                                uint64_t records = (uint64_t)threads * n;
+                                struct result r;
+
+                                if (!run(threads, policy[o], cells[c], n, &r)) {
+                                        ++failures;
+                                        continue;
+                                }
+                                printf("%d,%s,%s,%llu,%.3f,%.0f,%.1f,%.1f,"
+                                       "%.1f,%.1f,%.1f,%llu,%.3f,%llu,%llu,"
+                                       "%llu,%lld,%llu,%llu\n", threads,
+                                       policy[o], cells[c],
+                                       (unsigned long long)records, r.seconds,
+                                       records / r.seconds, r.put_mean_ns,
+                                       r.put_p50_ns, r.put_p99_ns,
+                                       r.put_p999_ns, r.put_max_ns,
+                                       (unsigned long long)r.full_puts,
+                                       r.blocked_ms,
+                                       (unsigned long long)r.written,
+                                       (unsigned long long)r.lost,
+                                       (unsigned long long)r.sampled,
+                                       (long long)r.missing,
+                                       (unsigned long long)r.corrupt,
+                                       (unsigned long long)r.out_of_order);
+                                fflush(stdout);
+                                if (r.missing || r.corrupt || r.out_of_order ||
+                                    (strcmp(policy[o], "block") == 0 &&
+                                     r.lost)) {
+                                        fprintf(stderr, "%d producers, %s, "
+                                                "%s cells: records lost or "
+                                                "damaged\n", threads,
+                                                policy[o], cells[c]);
+                                        ++failures;
+                                }
+                        }
+        rmdir(scratch);
+        return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,63 @@
+#ifndef __ALLOCTRACE_H__
+#define __ALLOCTRACE_H__
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" { /* for inclusion from C++ */
+#endif
+
+/*
+ * Allocation trace, written with MALLOC_COUNT_TRACE=file and replayed by
+ * tools/alloc_replay
+ *
+ * The file starts with one struct alloctrace_header, followed by chunks in
+ * the byte order of the writing host. A chunk is a struct alloctrace_chunk
+ * and count events of one thread, in the order that thread made them; the
+ * chunks of different threads are interleaved in no particular order.
+ * Threads are numbered from 0 in the order of their first traced call.
+ *
+ * tsc is taken after the allocator returned a block and before a block is
+ * handed back to it, so across threads the release of an address always
+ * has a lower tsc than its next allocation. A realloc() releases arg at
+ * tsc - release and returns addr at tsc.
+ */
+
+#define ALLOCTRACE_MAGIC        "ALLOCTR"       /* 8 bytes including NUL */
+#define ALLOCTRACE_VERSION      1
+
+enum alloctrace_op {
+        ALLOCTRACE_MALLOC = 1,
+        ALLOCTRACE_CALLOC = 2,
+        ALLOCTRACE_MEMALIGN = 3,        /* arg: alignment */
+        ALLOCTRACE_REALLOC = 4,         /* arg: old block, 0 for none */
+        ALLOCTRACE_FREE = 5,
+};
+
+struct alloctrace_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;           /* sizeof(struct alloctrace_header) */
+        uint32_t event_size;            /* sizeof(struct alloctrace_event) */
+        uint32_t reserved;
+        double ticks_per_ns;            /* of tsc */
+        char backend[16];               /* allocator of the traced run */
+};
+
+struct alloctrace_chunk {
+        uint32_t thread;
+        uint32_t count;                 /* events that follow */
+};
+
+struct alloctrace_event {
+        uint64_t tsc;
+        uint64_t addr;                  /* block returned or freed */
+        uint64_t size;                  /* bytes requested */
+        uint64_t arg;
+        uint32_t op;                    /* enum alloctrace_op */
+        uint32_t release;               /* realloc: ticks, see above */
+};
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+#endif /* __ALLOCTRACE_H__ */
@@ -0,0 +1,82 @@
+/******************************************************************************
+ * heap_profile.h
+ *
+ * Sampling heap profiler used by malloc_count. Every allocation is charged to
+ * a per-thread byte counter; when the counter runs out (on average every
+ * MALLOC_COUNT_HEAPPROF bytes) the call stack of the allocation is captured by
+ * walking frame pointers and charged to an allocation site. Sampled objects
+ * are remembered until they are freed, so live and total bytes per site can
+ * be reported.
+ *
+ * Output is written as a legacy pprof heap profile (<prefix>.prof, use
+ * `pprof --text rocket-sim-exe heap.prof`) and as folded stacks
+ * (<prefix>.folded, for flamegraph.pl).
+ *
+ * Capturing useful stacks needs frame pointers: build with `make heapprof=1`.
+ *****************************************************************************/
+
+#ifndef _HEAP_PROFILE_H_
+#define _HEAP_PROFILE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" { /* for inclusion from C++ */
+#endif
+
+/* mean sample interval in bytes, 0 if the profiler is disabled */
+extern size_t heapprof_rate;
+
+/* number of sampled objects which have not been freed yet */
+extern long heapprof_live_objects;
+
+/* bytes this thread may still allocate before the next sample */
+extern __thread long long heapprof_bytes_until_sample;
+
+/* one counter per hash bucket of sampled addresses, lets free() skip the
+ * sampled object table for almost all pointers */
+#define HEAPPROF_FILTER_BITS 16
+extern unsigned char heapprof_filter[1 << HEAPPROF_FILTER_BITS];
+
+static inline unsigned heapprof_filter_idx(const void* p)
+{
+    uint64_t h = (uint64_t)(uintptr_t)p * 0x9E3779B97F4A7C15ULL;
+    return (unsigned)(h >> (64 - HEAPPROF_FILTER_BITS));
+}
+
+/* reads MALLOC_COUNT_HEAPPROF and MALLOC_COUNT_HEAPPROF_PREFIX */
+void heapprof_init(void);
+
+/* slow paths of the hooks below */
+void heapprof_sample(void* ptr, size_t size);
+void heapprof_forget(void* ptr);
+
+/* to be called by malloc() for every successful allocation */
+static inline void heapprof_malloc_hook(void* ptr, size_t size)
+{
+    if (__builtin_expect(heapprof_rate != 0, 0) &&
+        (heapprof_bytes_until_sample -= size) < 0)
+        heapprof_sample(ptr, size);
+}
+
+/* to be called by free() before the block is released, and by realloc()
+ * once it succeeded: a failed realloc() leaves the old block live */
+static inline void heapprof_free_hook(void* ptr)
+{
+    if (__builtin_expect(heapprof_live_objects != 0, 0) &&
+        heapprof_filter[heapprof_filter_idx(ptr)])
+        heapprof_forget(ptr);
+}
+
+/* writes <prefix>.prof and <prefix>.folded; prefix NULL uses the configured
+ * one. Returns 0 on success. */
+int heapprof_dump(const char* prefix);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _HEAP_PROFILE_H_ */
+
+/*****************************************************************************/
@@ -0,0 +1,274 @@
+#ifndef __HEAPLOG_H__
+#define __HEAPLOG_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" { /* for inclusion from C++ */
+#endif
+
+/*
+ * On-disk format of heap.log
+ *
+ * The file starts with one struct heaplog_header followed by records of
+ * header.record_size bytes each, in the byte order of the writing host.
+ * Each record is a raw struct ringbuff_cell; the header lists its fields so
+ * that readers do not depend on the compile-time layout (PROPRIETARY_LOGGING
+ * adds fields, and padding may differ between builds).
+ *
+ * With encoding HEAPLOG_ENC_BLOCKS (MALLOC_COUNT_LOG_FORMAT=compact) the
+ * header is followed by blocks of block_size bytes instead, see
+ * struct heaplog_block. Version 1 headers end before the encoding field and
+ * are always raw.
+ *
+ * Timestamps are seconds since base_tsc, converted from the time stamp
+ * counter by the writer with a rate it keeps calibrating against
+ * CLOCK_MONOTONIC (clock "tsc_s"). ticks_per_ns is the rate over the whole
+ * run, written when the log is closed, so a tick count t can be converted
+ * offline as (t - base_tsc) / ticks_per_ns nanoseconds, or to
+ * CLOCK_MONOTONIC by adding base_monotonic_ns.
+ */
+
+#define HEAPLOG_MAGIC           "HEAPLOG"       /* 8 bytes including NUL */
+#define HEAPLOG_VERSION         2
+#define HEAPLOG_MAX_FIELDS      16
+#define HEAPLOG_NAME_LEN        16
+
+enum heaplog_type {
+        HEAPLOG_U32 = 1,
+        HEAPLOG_U64 = 2,
+        HEAPLOG_F32 = 3,
+        HEAPLOG_F64 = 4,
+};
+
+struct heaplog_field {
+        char name[HEAPLOG_NAME_LEN];
+        uint16_t offset;                /* byte offset inside a record */
+        uint16_t type;                  /* enum heaplog_type */
+};
+
+struct heaplog_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;           /* sizeof(struct heaplog_header) */
+        uint32_t record_size;
+        uint32_t num_fields;
+        char backend[HEAPLOG_NAME_LEN]; /* ltalloc, scalloc, glibc */
+        char clock[HEAPLOG_NAME_LEN];   /* source of the timestamp field */
+        struct heaplog_field fields[HEAPLOG_MAX_FIELDS];
+        /* version 2 */
+        uint32_t encoding;              /* enum heaplog_encoding */
+        uint32_t block_size;            /* bytes per block, HEAPLOG_ENC_BLOCKS */
+        double ticks_per_ns;            /* TSC rate over the whole run */
+        uint64_t base_tsc;              /* TSC at timestamp 0 */
+        int64_t base_monotonic_ns;      /* CLOCK_MONOTONIC at timestamp 0 */
+};
+
+#define HEAPLOG_V1_HEADER_SIZE  offsetof(struct heaplog_header, encoding)
+
+enum heaplog_encoding {
+        HEAPLOG_ENC_RAW = 0,
+        HEAPLOG_ENC_BLOCKS = 1,
+};
+
+/*
+ * Compact blocks
+ *
+ * Each block is a struct heaplog_block followed by bytes of encoded values
+ * and zero padding up to block_size. A block decodes on its own: every value
+ * is stored as the difference to the same field of the previous record of
+ * the block, the first one as the difference to 0. Fields that do not change
+ * within the block (bit f of const_mask for field f) are stored once, before
+ * the records: the first record's values of those fields, in field order.
+ * The records then hold only the other fields. A block holds at most
+ * block_size records.
+ *   - the field named "timestamp": ticks since the start of the run as a
+ *     zig-zag varint delta; divide by ticks_per_ns for nanoseconds
+ *   - U32 and U64 fields: zig-zag varint delta
+ *   - F32 and F64 fields: varint of the bits XOR the previous bits, so an
+ *     unchanged value takes one byte
+ * Varints are little endian base 128, 7 bits per byte, high bit set on all
+ * but the last byte.
+ */
+#define HEAPLOG_BLOCK_MAGIC     "HLBK"
+#define HEAPLOG_BLOCK_SIZE      (64 * 1024)
+#define HEAPLOG_TIMESTAMP       "timestamp"
+#define HEAPLOG_VARINT_MAX      10      /* bytes of a 64 bit varint */
+
+struct heaplog_block {
+        char magic[4];
+        uint32_t bytes;                 /* of encoded records after this */
+        uint32_t num_records;
+        uint32_t const_mask;            /* fields stored once, see above */
+};
+
+static inline uint8_t *heaplog_put_varint(uint8_t *p, uint64_t v)
+{
+        while (v >= 0x80) {
+                *p++ = (uint8_t)v | 0x80;
+                v >>= 7;
+        }
+        *p++ = (uint8_t)v;
+        return p;
+}
+
+/* NULL if the varint runs past end */
+static inline const uint8_t *heaplog_get_varint(const uint8_t *p,
+                                                const uint8_t *end,
+                                                uint64_t *v)
+{
+        uint64_t x = 0;
+        int shift;
+        for (shift = 0; p < end && shift < 64; shift += 7) {
+                x |= (uint64_t)(*p & 0x7f) << shift;
+                if (!(*p++ & 0x80)) {
+                        *v = x;
+                        return p;
+                }
+        }
+        return NULL;
+}
+
+static inline uint64_t heaplog_zigzag(int64_t v)
+{
+        return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t heaplog_unzigzag(uint64_t v)
+{
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* Decodes one block into raw records of h->record_size bytes at out, which
+ * has room for max records. Returns the number of records, -1 if the block
+ * is damaged. */
+static inline int heaplog_decode_block(const struct heaplog_header *h,
+                                       const void *block, size_t block_len,
+                                       char *out, uint32_t max)
+{
+        const struct heaplog_block *b = (const struct heaplog_block *)block;
+        const uint8_t *p = (const uint8_t *)(b + 1), *end;
+        uint64_t prev[HEAPLOG_MAX_FIELDS] = { 0 };
+        uint64_t first[HEAPLOG_MAX_FIELDS];     /* of the constant fields */
+        uint32_t i, f;
+
+        if (block_len < sizeof(*b) || memcmp(b->magic, HEAPLOG_BLOCK_MAGIC, 4) ||
+            b->bytes > block_len - sizeof(*b) || b->num_records > max ||
+            h->num_fields > HEAPLOG_MAX_FIELDS ||
+            b->const_mask >> h->num_fields)
+                return -1;
+        end = p + b->bytes;
+        for (f = 0; f < h->num_fields; ++f)
+                if ((b->const_mask >> f & 1) &&
+                    !(p = heaplog_get_varint(p, end, &first[f])))
+                        return -1;
+        memset(out, 0, (size_t)b->num_records * h->record_size);
+        for (i = 0; i < b->num_records; ++i) {
+                char *rec = out + (size_t)i * h->record_size;
+                for (f = 0; f < h->num_fields; ++f) {
+                        const struct heaplog_field *fd = &h->fields[f];
+                        uint64_t v;
+                        uint32_t u32;
+                        double d;
+
+                        if (b->const_mask >> f & 1)
+                                v = i ? 0 : first[f];   /* no change */
+                        else if (!(p = heaplog_get_varint(p, end, &v)))
+                                return -1;
+                        if (strncmp(fd->name, HEAPLOG_TIMESTAMP,
+                                    HEAPLOG_NAME_LEN) == 0) {
+                                prev[f] += heaplog_unzigzag(v);
+                                d = (double)(int64_t)prev[f] / h->ticks_per_ns
+                                    / 1e9;
+                                memcpy(rec + fd->offset, &d, sizeof(d));
+                                continue;
+                        }
+                        switch (fd->type) {
+                        case HEAPLOG_U32:
+                        case HEAPLOG_U64:
+                                prev[f] += heaplog_unzigzag(v);
+                                break;
+                        default:
+                                prev[f] ^= v;
+                        }
+                        if (fd->type == HEAPLOG_U32 || fd->type == HEAPLOG_F32) {
+                                u32 = (uint32_t)prev[f];
+                                memcpy(rec + fd->offset, &u32, sizeof(u32));
+                        } else {
+                                memcpy(rec + fd->offset, &prev[f], 8);
+                        }
+                }
+        }
+        return (int)b->num_records;
+}
+
+/*
+ * Segmented heap log
+ *
+ * With MALLOC_COUNT_LOG_SEGMENT_MB=n the log goes to the segments
+ * heap.log.000000, heap.log.000001, ... of at most n MiB each instead of
+ * heap.log. Every segment is a complete log with its own header. A segment
+ * is finished once a higher one exists, and can then be compressed or moved.
+ *
+ * heap.log.idx lists where to start reading for a point in time: a struct
+ * heaplog_index_header followed by entries of entry_size bytes, in the order
+ * of the records. There is an entry at the start of every segment and then
+ * one every HEAPLOG_INDEX_RECORDS records or so, always at the start of a
+ * record or block. Record numbers count from the start of the run.
+ */
+#define HEAPLOG_INDEX_MAGIC     "HEAPIDX"       /* 8 bytes including NUL */
+#define HEAPLOG_INDEX_VERSION   1
+#define HEAPLOG_INDEX_RECORDS   (64 * 1024)
+#define HEAPLOG_INDEX_SUFFIX    ".idx"
+#define HEAPLOG_SEGMENT_FORMAT  "%s.%06u"       /* log name, segment */
+
+struct heaplog_index_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t entry_size;            /* sizeof(struct heaplog_index_entry) */
+};
+
+struct heaplog_index_entry {
+        uint32_t segment;
+        uint32_t reserved;
+        uint64_t offset;                /* bytes from the start of the segment */
+        uint64_t first_record;          /* number of the record there */
+        double first_time;              /* its timestamp */
+};
+
+/*
+ * Shared-memory heap log
+ *
+ * With MALLOC_COUNT_LOG_SHM=name the records go to the POSIX shared memory
+ * segment /name (/dev/shm/name on Linux) instead of heap.log. The segment
+ * starts with one struct heaplog_shm, followed at header_size by a ring of
+ * capacity records of log.record_size bytes; record number i (counted from
+ * the start of the run) is at index i % capacity.
+ *
+ * There is one writer and any number of readers, which map the segment read
+ * only and are never waited for. The writer sets write_begin to the number
+ * of records it will have written, stores the records, then sets write_end.
+ * A reader copies records [pos, write_end) and then reads write_begin again:
+ * records below write_begin - capacity were overwritten while being copied
+ * and must be discarded. closed is set once the writer has finished. The
+ * segment stays until the next run replaces it.
+ */
+#define HEAPLOG_SHM_MAGIC       "HEAPSHM"       /* 8 bytes including NUL */
+#define HEAPLOG_SHM_VERSION     1
+
+struct heaplog_shm {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;           /* offset of the first record */
+        uint64_t capacity;              /* records, a power of two */
+        uint64_t write_begin __attribute__((aligned(64)));
+        uint64_t write_end;
+        uint32_t closed;
+        struct heaplog_header log __attribute__((aligned(64)));
+};
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+#endif /* __HEAPLOG_H__ */
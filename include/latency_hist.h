@@ -0,0 +1,123 @@
+#ifndef __LATENCY_HIST_H__
+#define __LATENCY_HIST_H__
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" { /* for inclusion from C++ */
+#endif
+
+/*
+ * Log-linear (HDR style) latency histogram. Values below 2^LATENCY_SUB_BITS
+ * get a bucket each; above, every power of two is split into
+ * 2^LATENCY_SUB_BITS linear sub-buckets, so any recorded value is known to
+ * within 1/2^LATENCY_SUB_BITS (about 3%). Values are clamped to
+ * 2^LATENCY_MAX_BITS - 1 ticks.
+ */
+#define LATENCY_SUB_BITS        5
+#define LATENCY_MAX_BITS        40
+#define LATENCY_BUCKETS \
+        ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+struct latency_hist {
+        uint64_t count[LATENCY_BUCKETS];
+        uint64_t total;         /* sum of recorded values */
+        uint64_t max;
+};
+
+static inline unsigned int latency_bucket(uint64_t v)
+{
+        unsigned int shift;
+
+        if (v < (1u << LATENCY_SUB_BITS))
+                return (unsigned int)v;
+        if (v >= (1ULL << LATENCY_MAX_BITS))
+                v = (1ULL << LATENCY_MAX_BITS) - 1;
+        shift = (63 - __builtin_clzll(v)) - LATENCY_SUB_BITS;
+        return ((shift + 1) << LATENCY_SUB_BITS) +
+               (unsigned int)((v >> shift) & ((1u << LATENCY_SUB_BITS) - 1));
+}
+
+/* smallest value that falls into bucket b */
+static inline uint64_t latency_bucket_value(unsigned int b)
+{
+        unsigned int shift;
+
+        if (b < (1u << LATENCY_SUB_BITS))
+                return b;
+        shift = (b >> LATENCY_SUB_BITS) - 1;
+        return (uint64_t)((b & ((1u << LATENCY_SUB_BITS) - 1)) |
+                          (1u << LATENCY_SUB_BITS)) << shift;
+}
+
+/* single writer update, readers may run concurrently */
+static inline void latency_record(struct latency_hist *h, uint64_t v)
+{
+        unsigned int b = latency_bucket(v);
+        __atomic_store_n(&h->count[b], h->count[b] + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->total, h->total + v, __ATOMIC_RELAXED);
+        if (v > h->max)
+                __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+/* multi writer update */
+static inline void latency_record_atomic(struct latency_hist *h, uint64_t v)
+{
+        uint64_t m = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+        __sync_add_and_fetch(&h->count[latency_bucket(v)], 1);
+        __sync_add_and_fetch(&h->total, v);
+        while (v > m && !__atomic_compare_exchange_n(&h->max, &m, v, 1,
+                                                     __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED))
+                ;
+}
+
+/* dst += src */
+static inline void latency_merge(struct latency_hist *dst,
+                                 const struct latency_hist *src)
+{
+        unsigned int b;
+        for (b = 0; b < LATENCY_BUCKETS; ++b)
+                dst->count[b] += __atomic_load_n(&src->count[b],
+                                                 __ATOMIC_RELAXED);
+        dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+        if (src->max > dst->max)
+                dst->max = src->max;
+}
+
+/* dst += src while other threads may record into dst */
+static inline void latency_merge_atomic(struct latency_hist *dst,
+                                        const struct latency_hist *src)
+{
+        uint64_t m = __atomic_load_n(&dst->max, __ATOMIC_RELAXED);
+        unsigned int b;
+        for (b = 0; b < LATENCY_BUCKETS; ++b)
+                if (src->count[b])
+                        __sync_add_and_fetch(&dst->count[b], src->count[b]);
+        __sync_add_and_fetch(&dst->total, src->total);
+        while (src->max > m &&
+               !__atomic_compare_exchange_n(&dst->max, &m, src->max, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                ;
+}
+
+/* value below which the fraction q of all recorded values lies */
+static inline uint64_t latency_percentile(const struct latency_hist *h,
+                                          uint64_t n, double q)
+{
+        uint64_t rank = (uint64_t)(q * (double)n), seen = 0;
+        unsigned int b;
+
+        for (b = 0; b < LATENCY_BUCKETS; ++b) {
+                seen += h->count[b];
+                if (seen > rank)
+                        return latency_bucket_value(b);
+        }
+        return h->max;
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+#endif /* __LATENCY_HIST_H__ */
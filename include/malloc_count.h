@@ -47,6 +47,42 @@ extern void malloc_count_reset_peak(void);
 /* returns the total number of allocations */
 extern size_t malloc_count_num_allocs(void);
 
+/* counter values returned by malloc_count_snapshot() */
+struct malloc_count_stats {
+    long long current;      /* change of the current allocation */
+    size_t total;           /* bytes allocated */
+    size_t num_allocs;      /* number of allocations */
+    size_t num_frees;       /* number of frees */
+    size_t peak;            /* peak allocation (absolute, not a delta) */
+};
+
+/* returns the counter changes since the previous call (or program start).
+ * Cheap enough to be called once per simulation step. */
+extern void malloc_count_snapshot(struct malloc_count_stats* delta);
+
+/* backend calls whose latency is measured */
+enum {
+    MALLOC_COUNT_OP_MALLOC = 0,
+    MALLOC_COUNT_OP_FREE,
+    MALLOC_COUNT_OP_REALLOC,
+    MALLOC_COUNT_NUM_OPS
+};
+
+/* latency summary of one backend call */
+struct malloc_count_latency {
+    size_t count;
+    double mean_ns;
+    double p50_ns;
+    double p99_ns;
+    double p999_ns;
+    double max_ns;
+};
+
+/* fills report[MALLOC_COUNT_NUM_OPS] with the latencies of the backend's
+ * malloc/free/realloc, timed with the cycle counter. Measuring is enabled by
+ * the environment variable MALLOC_COUNT_LATENCY=1; returns -1 if it is off. */
+extern int malloc_count_latency_report(struct malloc_count_latency* report);
+
 /* typedef of callback function */
 typedef void (*malloc_count_callback_type)(void* cookie, size_t current);
 
@@ -59,12 +95,63 @@ extern void malloc_count_set_callback(malloc_count_callback_type cb,
 /* user function which prints current and peak allocation to stderr */
 extern void malloc_count_print_status(void);
 
+/* writes the sampled heap profile (enabled by the environment variable
+ * MALLOC_COUNT_HEAPPROF=<bytes per sample>) to <prefix>.prof in pprof format
+ * and to <prefix>.folded / <prefix>.alloc.folded as folded stacks of live and
+ * total bytes. prefix NULL uses MALLOC_COUNT_HEAPPROF_PREFIX or "heap".
+ * Returns 0 on success. */
+extern int malloc_count_dump_heap_profile(const char* prefix);
+
 /* Record operation API*/
 void malloc_count_record_start(void);
 void malloc_count_record_stop(void);
 
+/* ends the heap log interval of every thread, e.g. once per simulation step.
+ * Only has an effect in builds with make loginterval=1. */
+extern void malloc_count_log_step(void);
+
+/* Region API: malloc_count_region_push("guidance") charges the calling
+ * thread's allocations and frees to the region "guidance" until the matching
+ * malloc_count_region_pop(). Regions nest (up to 32 deep per thread), the
+ * innermost one is charged. A block freed outside the region that allocated
+ * it is charged to the freeing region, so current is the net allocation of
+ * the code inside the region. Up to 63 distinct names, further ones are not
+ * tracked. Returns the region index, 0 if the name was not tracked. */
+extern int malloc_count_region_push(const char* name);
+extern void malloc_count_region_pop(void);
+
+/* counters of one region */
+struct malloc_count_region {
+    const char* name;
+    long long current;      /* bytes allocated minus bytes freed */
+    size_t total;           /* bytes allocated */
+    size_t num_allocs;
+    size_t num_frees;
+    size_t peak;            /* peak of current */
+    double alloc_ns;        /* time spent in the backend's functions */
+};
+
+/* fills report[] with up to max regions, in order of their first push.
+ * Returns the number of regions filled. */
+extern int malloc_count_region_report(struct malloc_count_region* report,
+                                      int max);
+
 #ifdef __cplusplus
 } /* extern "C" */
+
+/* region for the lifetime of a scope:
+ *   { malloc_count_region_scope r("aerodynamics"); ... } */
+class malloc_count_region_scope
+{
+public:
+    explicit malloc_count_region_scope(const char* name)
+    { malloc_count_region_push(name); }
+    ~malloc_count_region_scope()
+    { malloc_count_region_pop(); }
+private:
+    malloc_count_region_scope(const malloc_count_region_scope&);
+    malloc_count_region_scope& operator=(const malloc_count_region_scope&);
+};
 #endif
 
 #endif /* _MALLOC_COUNT_H_ */
@@ -4,48 +4,134 @@
 #include <time.h>
 #include <stdbool.h>
 
-#ifdef __MACH__
-#include <mach/clock.h>
-#include <mach/mach.h>
-#include <mach/kern_return.h>
-#endif
-
 #ifdef __cplusplus
 extern "C" { /* for inclusion from C++ */
 #endif
 
-#define NUM_OF_CELL                     (0x1000000) //must power of 2
-#define RB_CELL_IDX(idx)      ((idx) & (NUM_OF_CELL - 1)) //mod NUM_OF_CELL
+#define RB_THREAD_CELLS                 (0x10000) //default cells per thread ring
+#define RB_MIN_CELLS                    (0x10)
+#define RB_MAX_CELLS                    (0x10000000)
+#define RB_CELL_IDX(rb, idx)  ((idx) & (rb)->mask) //mod cells of a ring
+#define RB_MAX_RINGS                    256 //thread rings, ring 0 is shared
+#define RB_WAKE_FILL(rb)      ((rb)->cells / 4) //fill that wakes a parked reader
 #define FILE_NAME                       "heap.log"
+#define RB_LOG_BATCH                    (0x10000) //max cells per log write
 #define BILLION 1000000000L
-#define INLINE                        __attribute__((always_inline))
-#define PROPRIETARY_LOGGING 0
+#ifndef PROPRIETARY_LOGGING
+#define PROPRIETARY_LOGGING 0           /* make proprietary=1 */
+#endif
+#ifndef MALLOC_COUNT_LOG_INTERVAL
+#define MALLOC_COUNT_LOG_INTERVAL 0     /* make loginterval=1 */
+#endif
+#if PROPRIETARY_LOGGING && MALLOC_COUNT_LOG_INTERVAL
+#error "PROPRIETARY_LOGGING and MALLOC_COUNT_LOG_INTERVAL exclude each other"
+#endif
 extern bool reader_end_flag;
 struct ringbuff_cell {
         uint32_t curr_heap_size;
+        uint32_t alloc_size;
         double timestamp;
+        float weight;           /* allocations this record stands for */
+        uint32_t lost;          /* records of this thread lost just before */
 #if PROPRIETARY_LOGGING
         double curr_frag_size;
         double alloc_time;
         double time_interval;
 #endif /* PROPRIETARY_LOGGING */
+#if MALLOC_COUNT_LOG_INTERVAL
+        /* one record per thread and interval: curr_heap_size is the heap
+         * size at its last operation, weight the number of allocations,
+         * alloc_size 0 */
+        uint32_t heap_min;      /* lowest curr_heap_size in the interval */
+        uint32_t heap_max;      /* highest */
+        uint32_t frees;
+        float alloc_us;         /* time spent in the allocator */
+        uint64_t alloc_bytes;
+        uint64_t free_bytes;
+#endif /* MALLOC_COUNT_LOG_INTERVAL */
+};
+
+#define RB_CACHE_LINE                   64
+
+/*
+ * Heap log rings.
+ *
+ * A thread gets its own single-producer ring on its first record, so putting
+ * a record only writes cache lines of that ring. Threads which find no free
+ * ring share ring 0 under a mutex. When a thread exits its ring goes back
+ * to the pool; the reader keeps draining it and the next thread to take it
+ * continues where the last one ended.
+ *
+ * Each record is keyed with the TSC value taken when it was put. The reader
+ * merges the rings by key into a single log ordered by time. A ring whose
+ * producer is between taking the key and publishing the record is marked
+ * busy; its next key is no smaller than its last published one. Otherwise
+ * its next key is later than the reader's clock. So a record is written once
+ * its key is not above the minimum of these bounds over all rings.
+ *
+ * The reader parks in rb_wait() when there is nothing to write. Producers
+ * only wake it when their ring passes RB_WAKE_FILL() records, so otherwise it
+ * sleeps out its timeout and then writes what has piled up in one batch.
+ *
+ * Rings are mapped when first needed, with the size from
+ * MALLOC_COUNT_RING_CELLS rounded up to a power of two (default
+ * RB_THREAD_CELLS). MALLOC_COUNT_RING_HUGEPAGES=1 backs them with huge pages
+ * and MALLOC_COUNT_RING_PREFAULT=1 faults them in when they are mapped.
+ *
+ * MALLOC_COUNT_RING_OVERFLOW picks what a producer does with a full ring:
+ *   block      wait for the reader (default)
+ *   drop       drop the new record
+ *   overwrite  drop the oldest record of the ring
+ *   sample     from half full on keep only every 2nd, 4th, ... record, adding
+ *              the weight of the skipped ones to the next kept one; a full
+ *              ring keeps only the weight
+ * Dropped records are counted in the lost field of the next record of the
+ * same ring that is written, so tools can show the gap.
+ */
+enum rb_overflow { RB_BLOCK, RB_DROP, RB_OVERWRITE, RB_SAMPLE };
+
+struct rb_thread_ring
+{
+        /* producer side */
+        uint32_t head __attribute__((aligned(RB_CACHE_LINE))); /* records put */
+        uint32_t busy;
+        uint32_t lost;          /* records dropped since the last one put */
+        uint32_t sample_count;  /* records seen while sampling */
+        float pending_weight;   /* of records skipped while sampling */
+        /* reader side; the producer advances tail too when overwriting */
+        uint32_t tail __attribute__((aligned(RB_CACHE_LINE))); /* records taken */
+        uint32_t expect;        /* position after the last record taken */
+        uint64_t last_key;      /* key of the last record taken */
+        /* ownership */
+        int in_use __attribute__((aligned(RB_CACHE_LINE)));
+        int waiting;            /* a producer sleeps on tail, ring full */
+        /* arrays of ringbuffer::cells entries, in the same mapping */
+        uint64_t *key;
+        struct ringbuff_cell *cell;
 };
 
 struct ringbuffer
 {
-        volatile uint32_t writer_idx;
-        volatile uint32_t reader_idx;
-        volatile uint32_t cell_nums;
-        struct ringbuff_cell cell[NUM_OF_CELL]; 
+        int reader_parked __attribute__((aligned(RB_CACHE_LINE)));
+        uint32_t num_rings __attribute__((aligned(RB_CACHE_LINE)));
+        uint32_t cells;         /* per ring, a power of two */
+        uint32_t mask;
+        bool hugepages;
+        bool prefault;
+        int overflow;           /* enum rb_overflow */
+        struct rb_thread_ring *ring[RB_MAX_RINGS];
+        uint64_t written;       /* records written to the log */
+        uint64_t lost;          /* sum of their lost fields */
 };
 
-void rb_init(struct ringbuffer *rb);
+void rb_init(struct ringbuffer *rb, const char *backend);
 void rb_deinit(struct ringbuffer *rb);
 void rb_put(struct ringbuffer *rb, void *value);
-void rb_get(struct ringbuffer *rb, void *value);
-
-void clock_get_hw_time(struct timespec *ts);
-INLINE double get_curr_time(void);
+uint32_t rb_write_log(struct ringbuffer *rb);
+void rb_wait(struct ringbuffer *rb, unsigned timeout_ms);
+void rb_wake(struct ringbuffer *rb);
+bool rb_empty(struct ringbuffer *rb);
+uint64_t rb_records_put(struct ringbuffer *rb);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,51 @@
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+#ifdef __cplusplus
+extern "C" { /* for inclusion from C++ */
+#endif
+
+/*
+ * Byte-interval sampling as done by tcmalloc: the distance in bytes between
+ * two samples is drawn from an exponential distribution with the given mean,
+ * so every allocated byte has the same chance to be sampled and an allocation
+ * of size s is picked with probability 1 - exp(-s/mean). The hot path only
+ * subtracts the allocation size from a per-thread counter.
+ */
+
+/* xorshift64* generator, state must not be 0 */
+static inline uint64_t sampler_rand(uint64_t *state)
+{
+        uint64_t x = *state;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        *state = x;
+        return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* draws the number of bytes until the next sample */
+static inline long long sampler_next_interval(uint64_t *state, size_t mean)
+{
+        /* 53 random bits -> uniform in (0, 1] */
+        double u = (double)((sampler_rand(state) >> 11) + 1) *
+                   (1.0 / 9007199254740992.0);
+        double interval = -log(u) * (double)mean;
+        return interval < 1.0 ? 1 : (long long)interval;
+}
+
+/* weight of a sampled allocation of size bytes, i.e. how many allocations of
+ * that size it stands for */
+static inline double sampler_weight(size_t size, size_t mean)
+{
+        if (mean <= 1) return 1.0;
+        return 1.0 / (1.0 - exp(-(double)size / (double)mean));
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+#endif /* __SAMPLER_H__ */
@@ -0,0 +1,87 @@
+#ifndef __TSC_H__
+#define __TSC_H__
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" { /* for inclusion from C++ */
+#endif
+
+/*
+ * Cycle counter access. On x86 the time stamp counter is read directly;
+ * elsewhere CLOCK_MONOTONIC nanoseconds stand in for ticks. tsc_calibrate()
+ * must run once before ticks are converted to time.
+ *
+ * tsc_calibrate() measures the tick rate over a short busy wait and takes
+ * tsc_base, tsc_base_ns as the start of the run. tsc_recalibrate() refines
+ * the rate against CLOCK_MONOTONIC over the whole run so far; one thread
+ * (the heap log reader) calls it and tsc_elapsed_ns() as often as it likes.
+ * tsc_elapsed_ns() follows the refined rate without ever going back: an
+ * error of the earlier rate is slewed out, not stepped.
+ */
+
+/* ticks per nanosecond, set by tsc_calibrate() and tsc_recalibrate() */
+extern double tsc_ticks_per_ns;
+
+/* ticks spent in an empty tsc_begin()/tsc_end() pair */
+extern uint64_t tsc_overhead;
+
+/* ticks and CLOCK_MONOTONIC nanoseconds at tsc_calibrate() */
+extern uint64_t tsc_base;
+extern int64_t tsc_base_ns;
+
+void tsc_calibrate(void);
+void tsc_recalibrate(uint64_t now);
+double tsc_elapsed_ns(uint64_t ticks);
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+/* start of a measured region: earlier instructions retire first */
+static inline uint64_t tsc_begin(void)
+{
+        _mm_lfence();
+        return __rdtsc();
+}
+
+/* end of a measured region: waits for the region to finish */
+static inline uint64_t tsc_end(void)
+{
+        unsigned int aux;
+        uint64_t t = __rdtscp(&aux);
+        _mm_lfence();
+        return t;
+}
+
+static inline uint64_t tsc_now(void)
+{
+        return __rdtsc();
+}
+#else
+static inline uint64_t tsc_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t tsc_begin(void)
+{
+        return tsc_now();
+}
+
+static inline uint64_t tsc_end(void)
+{
+        return tsc_now();
+}
+#endif
+
+static inline double tsc_to_ns(uint64_t ticks)
+{
+        return (double)ticks / tsc_ticks_per_ns;
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+#endif /* __TSC_H__ */
@@ -0,0 +1,390 @@
+/******************************************************************************
+ * heap_profile.cpp
+ *
+ * Sampling heap profiler for malloc_count, see heap_profile.h.
+ *
+ * All tables are fixed-size static arrays filled with atomic operations, so
+ * the profiler itself never calls malloc() while recording a sample and does
+ * not take locks on the allocation path.
+ *
+ *****************************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "heap_profile.h"
+#include "sampler.h"
+
+/* output */
+#define PPREFIX "malloc_count ### "
+
+/* default output prefix, gives heap.prof and heap.folded */
+#define HEAPPROF_DEFAULT_PREFIX "heap"
+
+/* number of return addresses kept per allocation site */
+#define HEAPPROF_MAX_DEPTH      16
+
+/* capacity of the site and sampled object tables (powers of two) */
+#define HEAPPROF_MAX_SITES      8192
+#define HEAPPROF_MAX_OBJECTS    65536
+
+/* open addressing gives up after this many slots */
+#define HEAPPROF_MAX_PROBES     64
+
+size_t heapprof_rate = 0;
+long heapprof_live_objects = 0;
+__thread long long heapprof_bytes_until_sample = 0;
+unsigned char heapprof_filter[1 << HEAPPROF_FILTER_BITS];
+
+static char heapprof_prefix[256] = HEAPPROF_DEFAULT_PREFIX;
+
+/* an allocation site, identified by its call stack. Counters are raw sample
+ * counts (as pprof's heap_v2 format expects) plus the estimated bytes the
+ * samples stand for. */
+struct heap_site {
+    volatile int state;             /* 0 empty, 1 being filled, 2 ready */
+    int depth;
+    uint64_t hash;
+    void* pcs[HEAPPROF_MAX_DEPTH];
+    long alloc_count, alloc_bytes, alloc_estimate;
+    long free_count, free_bytes, free_estimate;
+};
+
+#define SITE_EMPTY      0
+#define SITE_BUSY       1
+#define SITE_READY      2
+
+static struct heap_site sites[HEAPPROF_MAX_SITES];
+
+/* a sampled object which has not been freed yet */
+struct heap_object {
+    volatile uintptr_t addr;        /* or one of the OBJECT_ markers */
+    unsigned int site;
+    size_t size;
+    long estimate;
+};
+
+#define OBJECT_EMPTY    0
+#define OBJECT_DELETED  1
+#define OBJECT_BUSY     2
+
+static struct heap_object objects[HEAPPROF_MAX_OBJECTS];
+
+/* samples which did not fit into the tables */
+static long lost_sites = 0, lost_objects = 0;
+
+static __thread uint64_t tls_rng = 0;
+static __thread int tls_busy = 0;
+static __thread uintptr_t tls_stack_hi = 0;
+
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* upper end of the calling thread's stack, bounds the frame pointer walk */
+static uintptr_t stack_top(void)
+{
+    if (!tls_stack_hi) {
+        pthread_attr_t attr;
+        void* addr;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0)
+                tls_stack_hi = (uintptr_t)addr + size;
+            pthread_attr_destroy(&attr);
+        }
+        if (!tls_stack_hi) /* only walk the frame we are in */
+            tls_stack_hi = (uintptr_t)__builtin_frame_address(0) + 1;
+    }
+    return tls_stack_hi;
+}
+
+/* walks the frame pointer chain starting at frame fp. Frames compiled without
+ * frame pointers end the walk early, bad pointers are caught by the bounds
+ * checks. */
+static int walk_stack(uintptr_t* fp, void** pcs, int skip)
+{
+    uintptr_t hi = stack_top();
+    int depth = 0;
+
+    while (depth < HEAPPROF_MAX_DEPTH) {
+        if (((uintptr_t)fp & (sizeof(void*) - 1)) ||
+            (uintptr_t)fp + 2 * sizeof(void*) > hi)
+            break;
+
+        uintptr_t* next = (uintptr_t*)fp[0];
+        uintptr_t pc = fp[1];
+        if (pc < 4096) break;
+
+        if (skip) --skip;
+        else pcs[depth++] = (void*)pc;
+
+        if (next <= fp) break; /* stack grows down, callers live above */
+        fp = next;
+    }
+    return depth;
+}
+
+/* returns the index of the site for the given stack, -1 if the table is
+ * full */
+static int find_site(void** pcs, int depth)
+{
+    uint64_t hash = depth;
+    for (int i = 0; i < depth; ++i)
+        hash = mix64(hash ^ (uintptr_t)pcs[i]);
+
+    for (unsigned int probe = 0; probe < HEAPPROF_MAX_PROBES; ++probe) {
+        unsigned int idx = (hash + probe) & (HEAPPROF_MAX_SITES - 1);
+        struct heap_site* s = &sites[idx];
+        int state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+
+        if (state == SITE_EMPTY &&
+            __sync_bool_compare_and_swap(&s->state, SITE_EMPTY, SITE_BUSY))
+        {
+            s->hash = hash;
+            s->depth = depth;
+            memcpy(s->pcs, pcs, depth * sizeof(void*));
+            __atomic_store_n(&s->state, SITE_READY, __ATOMIC_RELEASE);
+            return idx;
+        }
+        while ((state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE))
+               == SITE_BUSY)
+            __asm__ __volatile__("pause" ::: "memory");
+
+        if (s->hash == hash && s->depth == depth &&
+            memcmp(s->pcs, pcs, depth * sizeof(void*)) == 0)
+            return idx;
+    }
+    __sync_add_and_fetch(&lost_sites, 1);
+    return -1;
+}
+
+static void remember_object(void* ptr, unsigned int site, size_t size,
+                            long estimate)
+{
+    uint64_t hash = mix64((uintptr_t)ptr);
+
+    for (unsigned int probe = 0; probe < HEAPPROF_MAX_PROBES; ++probe) {
+        struct heap_object* o =
+            &objects[(hash + probe) & (HEAPPROF_MAX_OBJECTS - 1)];
+        uintptr_t addr = o->addr;
+
+        if ((addr == OBJECT_EMPTY || addr == OBJECT_DELETED) &&
+            __sync_bool_compare_and_swap(&o->addr, addr, OBJECT_BUSY))
+        {
+            o->site = site;
+            o->size = size;
+            o->estimate = estimate;
+            unsigned char* f = &heapprof_filter[heapprof_filter_idx(ptr)];
+            if (*f != 0xFF) /* saturated buckets stay set */
+                __sync_add_and_fetch(f, 1);
+            __sync_add_and_fetch(&heapprof_live_objects, 1);
+            __atomic_store_n(&o->addr, (uintptr_t)ptr, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    __sync_add_and_fetch(&lost_objects, 1);
+}
+
+void heapprof_sample(void* ptr, size_t size)
+{
+    if (tls_busy) {
+        /* allocation made by the profiler itself */
+        heapprof_bytes_until_sample = heapprof_rate;
+        return;
+    }
+    tls_busy = 1;
+
+    bool first = (tls_rng == 0);
+    if (first)
+        tls_rng = mix64((uintptr_t)&tls_rng ^ (uintptr_t)ptr) | 1;
+    heapprof_bytes_until_sample = sampler_next_interval(&tls_rng,
+                                                        heapprof_rate);
+
+    /* the first allocation of a thread only arms its sampler */
+    if (!first) {
+        void* pcs[HEAPPROF_MAX_DEPTH];
+        /* skip the return address into malloc() */
+        int depth = walk_stack((uintptr_t*)__builtin_frame_address(0),
+                               pcs, 1);
+        int site = find_site(pcs, depth);
+        if (site >= 0) {
+            struct heap_site* s = &sites[site];
+            long estimate = (long)(size * sampler_weight(size, heapprof_rate));
+            __sync_add_and_fetch(&s->alloc_count, 1);
+            __sync_add_and_fetch(&s->alloc_bytes, size);
+            __sync_add_and_fetch(&s->alloc_estimate, estimate);
+            remember_object(ptr, site, size, estimate);
+        }
+    }
+    tls_busy = 0;
+}
+
+void heapprof_forget(void* ptr)
+{
+    uint64_t hash = mix64((uintptr_t)ptr);
+
+    for (unsigned int probe = 0; probe < HEAPPROF_MAX_PROBES; ++probe) {
+        struct heap_object* o =
+            &objects[(hash + probe) & (HEAPPROF_MAX_OBJECTS - 1)];
+        uintptr_t addr = __atomic_load_n(&o->addr, __ATOMIC_ACQUIRE);
+
+        if (addr == OBJECT_EMPTY) return;
+        if (addr != (uintptr_t)ptr) continue;
+
+        struct heap_site* s = &sites[o->site];
+        __sync_add_and_fetch(&s->free_count, 1);
+        __sync_add_and_fetch(&s->free_bytes, o->size);
+        __sync_add_and_fetch(&s->free_estimate, o->estimate);
+
+        unsigned char* f = &heapprof_filter[heapprof_filter_idx(ptr)];
+        if (*f != 0xFF)
+            __sync_sub_and_fetch(f, 1);
+        __sync_sub_and_fetch(&heapprof_live_objects, 1);
+        __atomic_store_n(&o->addr, OBJECT_DELETED, __ATOMIC_RELEASE);
+        return;
+    }
+}
+
+void heapprof_init(void)
+{
+    const char* rate = getenv("MALLOC_COUNT_HEAPPROF");
+    const char* prefix = getenv("MALLOC_COUNT_HEAPPROF_PREFIX");
+
+    if (prefix && *prefix) {
+        strncpy(heapprof_prefix, prefix, sizeof(heapprof_prefix) - 1);
+        heapprof_prefix[sizeof(heapprof_prefix) - 1] = 0;
+    }
+    if (rate && *rate) {
+        heapprof_rate = strtoull(rate, NULL, 0);
+        if (heapprof_rate)
+            fprintf(stderr, PPREFIX "heap profiler on, one sample per %zu "
+                    "bytes, writing %s.prof\n", heapprof_rate,
+                    heapprof_prefix);
+    }
+}
+
+/* appends the name of the function containing pc to a folded stack line */
+static void print_frame(FILE* f, void* pc, bool first)
+{
+    Dl_info info;
+    int found = dladdr(pc, &info);
+    if (!first) fputc(';', f);
+    if (found && info.dli_sname) {
+        fputs(info.dli_sname, f);
+    } else if (found && info.dli_fname) {
+        const char* base = strrchr(info.dli_fname, '/');
+        fprintf(f, "%s+0x%lx", base ? base + 1 : info.dli_fname,
+                (unsigned long)((uintptr_t)pc - (uintptr_t)info.dli_fbase));
+    } else {
+        fprintf(f, "%p", pc);
+    }
+}
+
+/* folded stacks (root first) with estimated live or total bytes */
+static void write_folded(FILE* f, bool live)
+{
+    for (int i = 0; i < HEAPPROF_MAX_SITES; ++i) {
+        struct heap_site* s = &sites[i];
+        if (s->state != SITE_READY) continue;
+
+        long bytes = live ? s->alloc_estimate - s->free_estimate
+                          : s->alloc_estimate;
+        if (bytes <= 0) continue;
+
+        if (s->depth == 0) fputs("[unknown]", f);
+        for (int d = s->depth - 1; d >= 0; --d)
+            print_frame(f, s->pcs[d], d == s->depth - 1);
+        fprintf(f, " %ld\n", bytes);
+    }
+}
+
+/* legacy pprof heap profile, sample counts are unscaled (heap_v2) */
+static void write_pprof(FILE* f)
+{
+    long in_count = 0, in_bytes = 0, all_count = 0, all_bytes = 0;
+
+    for (int i = 0; i < HEAPPROF_MAX_SITES; ++i) {
+        struct heap_site* s = &sites[i];
+        if (s->state != SITE_READY) continue;
+        in_count += s->alloc_count - s->free_count;
+        in_bytes += s->alloc_bytes - s->free_bytes;
+        all_count += s->alloc_count;
+        all_bytes += s->alloc_bytes;
+    }
+    fprintf(f, "heap profile: %6ld: %8ld [%6ld: %8ld] @ heap_v2/%zu\n",
+            in_count, in_bytes, all_count, all_bytes, heapprof_rate);
+
+    for (int i = 0; i < HEAPPROF_MAX_SITES; ++i) {
+        struct heap_site* s = &sites[i];
+        if (s->state != SITE_READY) continue;
+        fprintf(f, "%6ld: %8ld [%6ld: %8ld] @",
+                s->alloc_count - s->free_count, s->alloc_bytes - s->free_bytes,
+                s->alloc_count, s->alloc_bytes);
+        for (int d = 0; d < s->depth; ++d)
+            fprintf(f, " %p", s->pcs[d]);
+        fputc('\n', f);
+    }
+
+    /* lets pprof symbolize the addresses offline */
+    fputs("\nMAPPED_LIBRARIES:\n", f);
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0)
+            fwrite(buf, 1, n, f);
+        fclose(maps);
+    }
+}
+
+int heapprof_dump(const char* prefix)
+{
+    char path[300];
+    FILE* f;
+    int ret = 0;
+
+    if (!heapprof_rate) return -1;
+    if (!prefix) prefix = heapprof_prefix;
+
+    /* keep our own stdio buffers out of the profile */
+    int was_busy = tls_busy;
+    tls_busy = 1;
+
+    snprintf(path, sizeof(path), "%s.prof", prefix);
+    if ((f = fopen(path, "w")) != NULL) {
+        write_pprof(f);
+        fclose(f);
+    } else ret = -1;
+
+    snprintf(path, sizeof(path), "%s.folded", prefix);
+    if ((f = fopen(path, "w")) != NULL) {
+        write_folded(f, true);
+        fclose(f);
+    } else ret = -1;
+
+    snprintf(path, sizeof(path), "%s.alloc.folded", prefix);
+    if ((f = fopen(path, "w")) != NULL) {
+        write_folded(f, false);
+        fclose(f);
+    } else ret = -1;
+
+    if (lost_sites || lost_objects)
+        fprintf(stderr, PPREFIX "heap profiler tables full, lost %ld sites "
+                "and %ld objects\n", lost_sites, lost_objects);
+
+    tls_busy = was_busy;
+    return ret;
+}
+
+/*****************************************************************************/
@@ -758,6 +758,17 @@ size_t ltmsize(void *p)
     return size;
 }
 
+// usable size of the block ltmalloc(size) returns, without looking at any
+// block (for callers which know the size of the block they free)
+size_t ltgoodsize(size_t size)
+{
+    if (likely(size - 1u <= MAX_BLOCK_SIZE - 1u))
+        return class_to_size(get_size_class(size));
+    if (unlikely(size == 0))
+        return class_to_size(get_size_class(1));
+    return (size + CHUNK_SIZE-1) & ~(CHUNK_SIZE-1);
+}
+
 static void release_thread_cache(void *p)
 {
     unsigned int sizeClass = 0;
@@ -978,7 +989,12 @@ continue_:
 }
 
 #if defined(__cplusplus) && !defined(LTALLOC_DISABLE_OPERATOR_NEW_OVERRIDE)
-void *operator new(size_t size) throw(std::bad_alloc)
+#if __cplusplus >= 201103L
+#define LTALLOC_THROW_BAD_ALLOC // dynamic exception specs are gone in C++17
+#else
+#define LTALLOC_THROW_BAD_ALLOC throw(std::bad_alloc)
+#endif
+void *operator new(size_t size) LTALLOC_THROW_BAD_ALLOC
 {
     return ltmalloc<true>(size);
 }
@@ -986,7 +1002,7 @@ void *operator new(size_t size, const std::nothrow_t&) throw()
 {
     return ltmalloc<false>(size);
 }
-void *operator new[](size_t size) throw(std::bad_alloc)
+void *operator new[](size_t size) LTALLOC_THROW_BAD_ALLOC
 {
     return ltmalloc<true>(size);
 }
@@ -1019,8 +1035,11 @@ void operator delete[](void* p, const std::nothrow_t&) throw()
 
 void *ltcalloc(size_t elems, size_t size)
 {
+    void *p;
+    if (elems && size > (size_t)-1 / elems) return NULL;
     size *= elems;
-    return memset(ltmalloc( size ), 0, size);
+    p = ltmalloc( size );
+    return p ? memset(p, 0, size) : NULL;
 }
 
 void *ltmemalign(size_t align, size_t size)
@@ -1042,10 +1061,21 @@ void *ltrealloc(void *ptr, size_t sz)
 
 size_t get_actual_info(void *p) 
 {
-    if (likely((uintptr_t)p & (CHUNK_SIZE-1))) {
-        size_t sizeClass = ((Chunk *)((uintptr_t) p & ~(CHUNK_SIZE-1)))->sizeClass;
-        return class_to_size(sizeClass);
-    } else {
-        return ptrie_lookup((uintptr_t)p);
-    }
+    // same as ltmsize(), which also takes ptrieLock for system allocations
+    return ltmsize(p);
 }
+
+// plain C entry points, looked up with dlsym() by malloc_count
+#ifdef __cplusplus
+extern "C" {
+#endif
+void *ltalloc_malloc(size_t size) { return ltmalloc(size); }
+void ltalloc_free(void *p) { ltfree(p); }
+void *ltalloc_realloc(void *p, size_t size) { return ltrealloc(p, size); }
+void *ltalloc_calloc(size_t elems, size_t size) { return ltcalloc(elems, size); }
+void *ltalloc_memalign(size_t align, size_t size) { return ltmemalign(align, size); }
+size_t ltalloc_usable_size(void *p) { return ltmsize(p); }
+size_t ltalloc_good_size(size_t size) { return ltgoodsize(size); }
+#ifdef __cplusplus
+}
+#endif
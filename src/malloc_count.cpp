@@ -30,12 +30,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <malloc.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef __MACH__
+#include <mach-o/dyld.h>
+#endif
 #include <locale.h>
 #include <dlfcn.h>
 #include "malloc_count.h"
 #include <new>
 #include <pthread.h>
 #include "ringbuffer.h"
+#include "heap_profile.h"
+#include "sampler.h"
+#include "tsc.h"
+#include "latency_hist.h"
+#include "alloctrace.h"
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
 
 /* user-defined options for output malloc()/free() operations to stderr */
@@ -43,29 +62,185 @@
 static const int log_operations = 0;    /* <-- set this to 1 for log output */
 static const size_t log_operations_threshold = 1024*1024;
 
-/* option to use gcc's intrinsics to do thread-safe statistics operations */
-#define THREAD_SAFE_GCC_INTRINSICS      1
-
 /* to each allocation additional data is added for bookkeeping. due to
- * alignment requirements, we can optionally add more than just one integer. */
-static const size_t alignment = 16; /* bytes (>= 2*sizeof(size_t)) */
+ * alignment requirements, we can optionally add more than just one integer.
+ * The prefix is a debugging aid (its sentinel detects corruption) and pushes
+ * small objects into the next size class of the backend, so by default the
+ * block size is asked from the backend instead and the prefix is only used
+ * on the init heap. Build with -DMALLOC_COUNT_HEADER=1 to restore it. */
+#ifndef MALLOC_COUNT_HEADER
+#define MALLOC_COUNT_HEADER 0
+#endif
+
+static const size_t init_alignment = 16; /* bytes (>= 2*sizeof(size_t)) */
+static const size_t alignment = MALLOC_COUNT_HEADER ? init_alignment : 0;
+
+/* With -DMALLOC_COUNT_STATIC_BACKEND=1 (make static=1) the backend of the
+ * build is called directly instead of through pointers loaded at startup */
+#ifndef MALLOC_COUNT_STATIC_BACKEND
+#define MALLOC_COUNT_STATIC_BACKEND 0
+#endif
 
+#if !MALLOC_COUNT_STATIC_BACKEND
 /* function pointer to the real procedures, loaded using dlsym */
 typedef void* (*malloc_type)(size_t);
 typedef void  (*free_type)(void*);
 typedef void* (*realloc_type)(void*, size_t);
+typedef size_t (*usable_size_type)(void*);
+typedef void* (*memalign_type)(size_t, size_t);
+typedef void* (*calloc_type)(size_t, size_t);
+typedef size_t (*good_size_type)(size_t);
 
 static malloc_type real_malloc = NULL;
 static free_type real_free = NULL;
 static realloc_type real_realloc = NULL;
+static usable_size_type real_usable_size = NULL;
+static memalign_type real_memalign = NULL;
+static calloc_type real_calloc = NULL;
+/* usable size of a block of the given request size, optional */
+static good_size_type real_good_size = NULL;
+#endif /* !MALLOC_COUNT_STATIC_BACKEND */
+
+/* Backend policies: the backend's entry points as static member functions.
+ * The allocation functions below only call backend_policy, which is picked
+ * at compile time. dynamic_backend goes through the pointers that
+ * load_backend() fills at startup. The static policies call the backend by
+ * name, so with ltalloc compiled into the binary and LTO its thread cache
+ * fast path is inlined into malloc() and free(). */
+#if !MALLOC_COUNT_STATIC_BACKEND
+struct dynamic_backend {
+    static bool loaded() { return real_malloc != NULL; }
+    static bool has_good_size() { return real_good_size != NULL; }
+    static void* malloc(size_t size) { return (*real_malloc)(size); }
+    static void free(void* ptr) { (*real_free)(ptr); }
+    static void* realloc(void* ptr, size_t size)
+    { return (*real_realloc)(ptr, size); }
+    static void* calloc(size_t nmemb, size_t size)
+    { return (*real_calloc)(nmemb, size); }
+    static void* memalign(size_t align, size_t size)
+    { return (*real_memalign)(align, size); }
+    static size_t usable_size(void* ptr) { return (*real_usable_size)(ptr); }
+    static size_t good_size(size_t size) { return (*real_good_size)(size); }
+};
+typedef dynamic_backend backend_policy;
+
+#elif defined(LTALLOC)
+extern "C" {
+void* ltalloc_malloc(size_t size);
+void ltalloc_free(void* ptr);
+void* ltalloc_realloc(void* ptr, size_t size);
+void* ltalloc_calloc(size_t nmemb, size_t size);
+void* ltalloc_memalign(size_t align, size_t size);
+size_t ltalloc_usable_size(void* ptr);
+size_t ltalloc_good_size(size_t size);
+}
+
+struct ltalloc_backend {
+    static bool loaded() { return true; }
+    static bool has_good_size() { return true; }
+    static void* malloc(size_t size) { return ltalloc_malloc(size); }
+    static void free(void* ptr) { ltalloc_free(ptr); }
+    static void* realloc(void* ptr, size_t size)
+    { return ltalloc_realloc(ptr, size); }
+    static void* calloc(size_t nmemb, size_t size)
+    { return ltalloc_calloc(nmemb, size); }
+    static void* memalign(size_t align, size_t size)
+    { return ltalloc_memalign(align, size); }
+    static size_t usable_size(void* ptr) { return ltalloc_usable_size(ptr); }
+    static size_t good_size(size_t size) { return ltalloc_good_size(size); }
+};
+typedef ltalloc_backend backend_policy;
+
+#elif defined(SCALLOC)
+extern "C" {
+void* scalloc_malloc(size_t size);
+void scalloc_free(void* ptr);
+void* scalloc_realloc(void* ptr, size_t size);
+void* scalloc_calloc(size_t nmemb, size_t size);
+void* scalloc_memalign(size_t align, size_t size);
+size_t scalloc_malloc_usable_size(void* ptr);
+size_t scalloc_good_size(size_t size);
+}
+
+struct scalloc_backend {
+    static bool loaded() { return true; }
+    static bool has_good_size() { return true; }
+    static void* malloc(size_t size) { return scalloc_malloc(size); }
+    static void free(void* ptr) { scalloc_free(ptr); }
+    static void* realloc(void* ptr, size_t size)
+    { return scalloc_realloc(ptr, size); }
+    static void* calloc(size_t nmemb, size_t size)
+    { return scalloc_calloc(nmemb, size); }
+    static void* memalign(size_t align, size_t size)
+    { return scalloc_memalign(align, size); }
+    static size_t usable_size(void* ptr)
+    { return scalloc_malloc_usable_size(ptr); }
+    static size_t good_size(size_t size) { return scalloc_good_size(size); }
+};
+typedef scalloc_backend backend_policy;
+
+#else
+extern "C" {
+void* __libc_malloc(size_t size);
+void __libc_free(void* ptr);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_calloc(size_t nmemb, size_t size);
+void* __libc_memalign(size_t align, size_t size);
+}
+
+struct glibc_backend {
+    static bool loaded() { return true; }
+    static bool has_good_size() { return false; }
+    static void* malloc(size_t size) { return __libc_malloc(size); }
+    static void free(void* ptr) { __libc_free(ptr); }
+    static void* realloc(void* ptr, size_t size)
+    { return __libc_realloc(ptr, size); }
+    static void* calloc(size_t nmemb, size_t size)
+    { return __libc_calloc(nmemb, size); }
+    static void* memalign(size_t align, size_t size)
+    { return __libc_memalign(align, size); }
+    /* malloc_usable_size() is overridden here, so this is glibc's musable()
+     * for chunks in use: the chunk size in the word before the block minus
+     * its flag bits, less that word, and less one more word for mmap()ed
+     * chunks (flag 2) */
+    static size_t usable_size(void* ptr)
+    {
+        size_t head = ((size_t*)ptr)[-1];
+        return (head & ~(size_t)7) - ((head & 2) ? 2 : 1) * sizeof(size_t);
+    }
+    static size_t good_size(size_t) { return 0; }
+};
+typedef glibc_backend backend_policy;
+#endif /* MALLOC_COUNT_STATIC_BACKEND */
+
+/* backend used when neither MALLOC_COUNT_BACKEND nor the config file names
+ * one; recorded in the heap log header */
+#if defined(LTALLOC)
+static const char* backend_name = "ltalloc";
+#elif defined(SCALLOC)
+static const char* backend_name = "scalloc";
+#else
+static const char* backend_name = "glibc";
+#endif
+
+/* set while this thread runs backend code. A dlopen()ed backend allocates its
+ * thread-local data with malloc() on first use in a thread, which must not
+ * reach the backend again. */
+static __thread int tls_in_backend = 0;
 
 /* a sentinel value prefixed to each allocation */
 static const size_t sentinel = 0xDEADC0DE;
+static const size_t aligned_sentinel = 0xA11C0DE5;
 
-/* a simple memory heap for allocations prior to dlsym loading */
+/* a simple memory heap for allocations prior to dlsym loading and for
+ * allocations made from inside the backend (see tls_in_backend). Freed blocks
+ * are kept in a list and reused, so per-thread data of exited threads does
+ * not use up the heap. */
 #define INIT_HEAP_SIZE 1024*1024
-static char init_heap[INIT_HEAP_SIZE];
+static char init_heap[INIT_HEAP_SIZE] __attribute__((aligned(16)));
 static size_t init_heap_use = 0;
+static void* init_heap_free_list = NULL;
+static volatile int init_heap_lock = 0;
 static const int log_operations_init_heap = 0;
 
 /* output */
@@ -75,74 +250,773 @@ static const int log_operations_init_heap = 0;
 /* run-time memory allocation statistics */
 /*****************************************/
 
-static long long peak = 0, curr = 0, total = 0, num_allocs = 0;
+/* the heap size as seen by the log and the peak tracker. Threads do not
+ * update it on every allocation: each thread accumulates its changes in its
+ * own counter shard and folds them in only when they exceed
+ * counter_flush_threshold bytes (MALLOC_COUNT_FLUSH_BYTES, default 64 KiB),
+ * so the peak and the logged heap size miss up to that much per thread.
+ * MALLOC_COUNT_FLUSH_BYTES=0 folds every change at once and makes both exact
+ * to the byte, at the cost of an atomic add on a shared line per call. */
+struct heap_total {
+    long long curr;
+    long long peak;
+} __attribute__((aligned(64)));
+
+/* written on every change, so on a cache line of its own away from the
+ * read-mostly settings below */
+static struct heap_total heap_total;
+static long long counter_flush_threshold = 64*1024;
+
+/* per-thread counter shard. The owning thread is the only writer, so updates
+ * are plain relaxed load/store pairs without a lock prefix. Readers sum all
+ * shards lazily under shard_lock. */
+#define MAX_COUNT_SHARDS 256
+
+/* counters of one region in one shard, same rules as the shard itself */
+struct region_count {
+    long long curr;
+    long long total;
+    long long num_allocs;
+    long long num_frees;
+    long long ticks;        /* time in the backend */
+};
+
+struct count_shard {
+    long long curr;         /* bytes allocated minus bytes freed */
+    long long total;        /* bytes allocated */
+    long long num_allocs;
+    long long num_frees;
+    long long pending;      /* change of curr not yet folded into ::curr */
+    int in_use;
+    struct latency_hist* latency; /* MALLOC_COUNT_NUM_OPS histograms, mapped
+                                     on first use and kept with the slot */
+    struct region_count* regions; /* MAX_REGIONS counters, likewise */
+} __attribute__((aligned(64)));
+
+static struct count_shard shards[MAX_COUNT_SHARDS];
+
+/* counts of threads which have exited, and of threads which found no free
+ * shard; updated with atomics as both cases are rare. */
+static struct count_shard shared_shard;
+
+/* latency histograms of exited threads and of threads without a shard */
+static struct latency_hist shared_latency[MALLOC_COUNT_NUM_OPS];
+
+/* regions pushed by malloc_count_region_push(); index 0 means no region.
+ * curr is the sum over all threads, updated atomically on every change so
+ * that the region's peak is exact. Each region has a cache line of its own,
+ * so threads working in different regions do not share one; the names,
+ * scanned by every push, are kept apart from the counters. */
+#define MAX_REGIONS 64
+#define MAX_REGION_DEPTH 32
+#define REGION_NAME_LEN 32
+
+struct region_total {
+    long long curr;
+    long long peak;
+} __attribute__((aligned(64)));
+
+static struct region_total regions[MAX_REGIONS];
+static char region_names[MAX_REGIONS][REGION_NAME_LEN];
+static int num_regions = 1;
+static volatile int region_lock = 0;
+
+/* region counts of exited threads and of threads without a shard */
+static struct region_count shared_regions[MAX_REGIONS];
+
+/* this thread's innermost region and the stack of enclosing ones */
+static __thread int tls_region = 0;
+static __thread int tls_region_depth = 0;
+static __thread int tls_region_stack[MAX_REGION_DEPTH];
+
+static volatile int shard_lock = 0;
+static pthread_key_t shard_key;
+static bool shard_key_valid = false;
+static __thread struct count_shard* tls_shard = NULL;
+
+/* counter values at the last malloc_count_snapshot() */
+static struct malloc_count_stats last_snapshot;
+
+#define SHARD_LOAD(f)      __atomic_load_n(&(f), __ATOMIC_RELAXED)
+#define SHARD_ADD(f, v) \
+    __atomic_store_n(&(f), SHARD_LOAD(f) + (v), __ATOMIC_RELAXED)
+
+static void shard_lock_acquire(void)
+{
+    while (__sync_lock_test_and_set(&shard_lock, 1))
+        while (shard_lock) __asm__ __volatile__("pause" ::: "memory");
+}
+
+static void shard_lock_release(void)
+{
+    __sync_lock_release(&shard_lock);
+}
+
+/* raise peak to at least mycurr */
+static void update_peak(long long mycurr)
+{
+    long long mypeak = __atomic_load_n(&heap_total.peak, __ATOMIC_RELAXED);
+    while (mycurr > mypeak &&
+           !__atomic_compare_exchange_n(&heap_total.peak, &mypeak, mycurr,
+                                        true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+        ;
+}
+
+/* fold the pending heap size change of a shard into the global curr */
+static long long flush_shard(struct count_shard* s)
+{
+    long long mycurr = __sync_add_and_fetch(&heap_total.curr,
+                                            SHARD_LOAD(s->pending));
+    SHARD_ADD(s->pending, -SHARD_LOAD(s->pending));
+    update_peak(mycurr);
+    return mycurr;
+}
+
+/* pthread key destructor: move the counts of an exiting thread into
+ * shared_shard and give its slot to the next thread. */
+static void log_interval_flush(void);
+static void trace_flush(bool release);
+
+static void release_shard(void* arg)
+{
+    struct count_shard* s = (struct count_shard*)arg;
+
+    log_interval_flush();
+    trace_flush(true);
+    flush_shard(s);
+    shard_lock_acquire();
+    __sync_add_and_fetch(&shared_shard.curr, s->curr);
+    __sync_add_and_fetch(&shared_shard.total, s->total);
+    __sync_add_and_fetch(&shared_shard.num_allocs, s->num_allocs);
+    __sync_add_and_fetch(&shared_shard.num_frees, s->num_frees);
+    if (s->latency) {
+        for (int op = 0; op < MALLOC_COUNT_NUM_OPS; ++op)
+            latency_merge_atomic(&shared_latency[op], &s->latency[op]);
+        memset(s->latency, 0, MALLOC_COUNT_NUM_OPS * sizeof(*s->latency));
+    }
+    if (s->regions) {
+        for (int r = 1; r < MAX_REGIONS; ++r) {
+            struct region_count* rc = &s->regions[r];
+            __sync_add_and_fetch(&shared_regions[r].curr, rc->curr);
+            __sync_add_and_fetch(&shared_regions[r].total, rc->total);
+            __sync_add_and_fetch(&shared_regions[r].num_allocs,
+                                 rc->num_allocs);
+            __sync_add_and_fetch(&shared_regions[r].num_frees, rc->num_frees);
+            __sync_add_and_fetch(&shared_regions[r].ticks, rc->ticks);
+        }
+        memset(s->regions, 0, MAX_REGIONS * sizeof(*s->regions));
+    }
+    s->curr = s->total = s->num_allocs = s->num_frees = s->pending = 0;
+    __atomic_store_n(&s->in_use, 0, __ATOMIC_RELEASE);
+    shard_lock_release();
+    tls_shard = NULL;
+}
+
+/* claim a counter shard for the calling thread */
+static struct count_shard* acquire_shard(void)
+{
+    for (int i = 0; i < MAX_COUNT_SHARDS; ++i) {
+        if (!shards[i].in_use &&
+            __sync_bool_compare_and_swap(&shards[i].in_use, 0, 1))
+        {
+            /* set before pthread_setspecific(), which may call malloc() */
+            tls_shard = &shards[i];
+            if (shard_key_valid)
+                pthread_setspecific(shard_key, tls_shard);
+            return tls_shard;
+        }
+    }
+    return NULL;
+}
+
+static inline struct count_shard* get_shard(void)
+{
+    struct count_shard* s = tls_shard;
+    if (__builtin_expect(s == NULL, 0))
+        s = acquire_shard();
+    return s;
+}
+
+/* sum of all shards; must hold shard_lock */
+static void sum_shards(struct malloc_count_stats* st)
+{
+    long long mycurr = SHARD_LOAD(shared_shard.curr);
+    long long mytotal = SHARD_LOAD(shared_shard.total);
+    long long myallocs = SHARD_LOAD(shared_shard.num_allocs);
+    long long myfrees = SHARD_LOAD(shared_shard.num_frees);
+
+    for (int i = 0; i < MAX_COUNT_SHARDS; ++i) {
+        if (!SHARD_LOAD(shards[i].in_use)) continue;
+        mycurr += SHARD_LOAD(shards[i].curr);
+        mytotal += SHARD_LOAD(shards[i].total);
+        myallocs += SHARD_LOAD(shards[i].num_allocs);
+        myfrees += SHARD_LOAD(shards[i].num_frees);
+    }
+    st->current = mycurr;
+    st->total = mytotal;
+    st->num_allocs = myallocs;
+    st->num_frees = myfrees;
+}
+
+static long long current_sum(void)
+{
+    struct malloc_count_stats st;
+    shard_lock_acquire();
+    sum_shards(&st);
+    shard_lock_release();
+    return st.current;
+}
+
+/* current allocation for the hot path: the folded global plus what this
+ * thread has not folded yet. Exact with MALLOC_COUNT_FLUSH_BYTES=0 or when
+ * only one thread allocates. */
+static inline long long current_fast(void)
+{
+    struct count_shard* s = tls_shard;
+    return __atomic_load_n(&heap_total.curr, __ATOMIC_RELAXED) +
+           (s ? SHARD_LOAD(s->pending) : 0);
+}
 
 static malloc_count_callback_type callback = NULL;
 static void* callback_cookie = NULL;
 
 pthread_t reader_thread_id;
 static struct ringbuffer rb_buffer;
-#define EQUAL(a,b) ((a)==(b))
 static bool g_record_flag = true;
 
+/* heap log sampling: by default every allocation writes a ring record. With
+ * MALLOC_COUNT_LOG_EVERY=N only every Nth allocation of a thread is logged,
+ * with MALLOC_COUNT_LOG_BYTES=K one allocation per K bytes on average
+ * (exponentially distributed byte intervals). The weight of each record is
+ * the number of allocations it stands for, so allocation counts and bytes
+ * can be rebuilt offline as sums of weight and weight*alloc_size. */
+static unsigned long log_every = 1;
+static size_t log_bytes = 0;
+static __thread unsigned long tls_log_countdown = 0;
+static __thread long long tls_log_bytes_until_sample = 0;
+static __thread uint64_t tls_log_rng = 0;
+
+static void log_sampling_init(void)
+{
+    const char* every = getenv("MALLOC_COUNT_LOG_EVERY");
+    const char* bytes = getenv("MALLOC_COUNT_LOG_BYTES");
+
+    if (bytes && *bytes)
+        log_bytes = strtoull(bytes, NULL, 0);
+    else if (every && *every && strtoul(every, NULL, 0) > 1)
+        log_every = strtoul(every, NULL, 0);
+
+    if (log_bytes)
+        printf("Heap log samples one allocation per %zu bytes\n", log_bytes);
+    else if (log_every > 1)
+        printf("Heap log samples every %lu allocations\n", log_every);
+}
 
-/* add allocation to statistics */
-static void inc_count(size_t inc)
+/* returns the weight of the ring record for an allocation of size bytes, 0
+ * if the allocation is not logged */
+static inline float log_sample_weight(size_t size)
+{
+    if (log_bytes) {
+        if ((tls_log_bytes_until_sample -= size) >= 0) return 0;
+        if (!tls_log_rng)
+            tls_log_rng = ((uintptr_t)&tls_log_rng * 0x9E3779B97F4A7C15ULL) | 1;
+        tls_log_bytes_until_sample = sampler_next_interval(&tls_log_rng,
+                                                           log_bytes);
+        return sampler_weight(size, log_bytes);
+    }
+    if (log_every > 1) {
+        if (tls_log_countdown) {
+            --tls_log_countdown;
+            return 0;
+        }
+        tls_log_countdown = log_every - 1;
+        return log_every;
+    }
+    return 1;
+}
+
+#if MALLOC_COUNT_LOG_INTERVAL
+/* interval aggregation (make loginterval=1): instead of a record per
+ * allocation each thread logs one record per interval with the range of the
+ * heap size and the counts, bytes and allocator time of its allocations and
+ * frees. An interval ends MALLOC_COUNT_LOG_INTERVAL_US microseconds (default
+ * 1000, 0 for never) after its first operation, or at
+ * malloc_count_log_step(); its record is logged at the thread's next
+ * operation, at thread exit or at program exit. */
+struct log_interval {
+    struct ringbuff_cell c;
+    uint64_t end;               /* tick at which it ends */
+    uint64_t alloc_ticks;
+    unsigned step;              /* log_step at its start */
+    bool open;
+};
+
+static uint64_t log_interval_ticks = 0;
+static unsigned log_step = 0;   /* bumped by malloc_count_log_step() */
+static __thread struct log_interval tls_interval;
+static __thread uint64_t tls_interval_ticks;    /* backend time of the op */
+
+static void log_interval_init(void)
+{
+    const char* us = getenv("MALLOC_COUNT_LOG_INTERVAL_US");
+    unsigned long long n = (us && *us) ? strtoull(us, NULL, 0) : 1000;
+
+    log_interval_ticks = (uint64_t)(n * 1000 * tsc_ticks_per_ns);
+    if (n)
+        printf("Heap log records %llu us intervals\n", n);
+    else
+        printf("Heap log records intervals between malloc_count_log_step()\n");
+}
+
+static void log_interval_flush(void)
+{
+    struct log_interval* iv = &tls_interval;
+
+    if (!iv->open) return;
+    iv->open = false;
+    iv->c.timestamp = 0;    /* set from the ring key by the reader */
+    iv->c.alloc_us = tsc_to_ns(iv->alloc_ticks) / 1000;
+    if (g_record_flag)
+        rb_put(&rb_buffer, &iv->c);
+}
+
+/* adds an allocation of alloc bytes or a free of freed bytes to the
+ * thread's interval, after the counters were updated */
+static inline void log_interval_update(size_t alloc, size_t freed)
+{
+    struct log_interval* iv = &tls_interval;
+    uint32_t heap = current_fast();
+    uint64_t now = tsc_now();
+
+    if (iv->open &&
+        ((log_interval_ticks && (int64_t)(now - iv->end) >= 0) ||
+         iv->step != __atomic_load_n(&log_step, __ATOMIC_RELAXED)))
+        log_interval_flush();
+    if (!iv->open) {
+        memset(&iv->c, 0, sizeof(iv->c));
+        iv->c.heap_min = heap;
+        iv->c.heap_max = heap;
+        iv->end = now + log_interval_ticks;
+        iv->alloc_ticks = 0;
+        iv->step = __atomic_load_n(&log_step, __ATOMIC_RELAXED);
+        iv->open = true;
+    }
+    iv->c.curr_heap_size = heap;
+    if (heap < iv->c.heap_min) iv->c.heap_min = heap;
+    if (heap > iv->c.heap_max) iv->c.heap_max = heap;
+    if (alloc) {
+        iv->c.weight += 1;
+        iv->c.alloc_bytes += alloc;
+    }
+    else {
+        iv->c.frees += 1;
+        iv->c.free_bytes += freed;
+    }
+    iv->alloc_ticks += tls_interval_ticks;
+    tls_interval_ticks = 0;
+}
+
+static inline void log_interval_time(uint64_t ticks)
 {
-#if THREAD_SAFE_GCC_INTRINSICS
-    long long mycurr = __sync_add_and_fetch(&curr, inc);
-    if (mycurr > peak) peak = mycurr;
-    __sync_add_and_fetch(&total, inc);
-    if (callback) callback(callback_cookie, mycurr);
+    tls_interval_ticks += ticks;
+}
 #else
-    if ((curr += inc) > peak) peak = curr;
-    total += inc;
-    if (callback) callback(callback_cookie, curr);
+static inline void log_interval_flush(void) {}
+static inline void log_interval_update(size_t, size_t) {}
+static inline void log_interval_time(uint64_t) {}
+#endif /* MALLOC_COUNT_LOG_INTERVAL */
+
+/* user function to end the heap log interval of every thread, e.g. at the
+ * end of a simulation step */
+extern void malloc_count_log_step(void)
+{
+#if MALLOC_COUNT_LOG_INTERVAL
+    __atomic_add_fetch(&log_step, 1, __ATOMIC_RELAXED);
+    log_interval_flush();
 #endif
-    ++num_allocs;
+}
+
+/* allocation trace: with MALLOC_COUNT_TRACE=file every backend malloc,
+ * calloc, memalign, realloc and free is written to file in the format of
+ * alloctrace.h, for tools/alloc_replay. Each thread collects its events in
+ * an mmap()ed buffer and appends it with one write() when it is full, at
+ * thread exit and, for the thread running the exit handlers, at exit; the
+ * last events of threads still running at exit are lost. */
+#define TRACE_EVENTS 4096       /* events per thread buffer */
+
+struct trace_buffer {
+    struct alloctrace_chunk chunk;
+    struct alloctrace_event ev[TRACE_EVENTS];
+};
+
+static int trace_fd = -1;
+static unsigned trace_threads = 0;
+static __thread struct trace_buffer* tls_trace = NULL;
+
+static void trace_open(void)
+{
+    const char* name = getenv("MALLOC_COUNT_TRACE");
+    struct alloctrace_header h;
+
+    if (!name || !*name) return;
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        fprintf(stderr, PPREFIX "cannot open trace %s: %s\n", name,
+                strerror(errno));
+        return;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ALLOCTRACE_MAGIC, sizeof(ALLOCTRACE_MAGIC));
+    h.version = ALLOCTRACE_VERSION;
+    h.header_size = sizeof(h);
+    h.event_size = sizeof(struct alloctrace_event);
+    h.ticks_per_ns = tsc_ticks_per_ns;
+    strncpy(h.backend, backend_name, sizeof(h.backend) - 1);
+    if (write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h)) {
+        fprintf(stderr, PPREFIX "cannot write trace %s\n", name);
+        close(fd);
+        return;
+    }
+    trace_fd = fd;
+    printf("Allocation trace goes to %s\n", name);
+}
+
+/* appends the events of this thread's buffer to the trace. With release the
+ * buffer is unmapped, for thread exit. */
+static void trace_flush(bool release)
+{
+    struct trace_buffer* b = tls_trace;
+
+    if (!b) return;
+    if (b->chunk.count) {
+        size_t len = sizeof(b->chunk) + b->chunk.count * sizeof(b->ev[0]);
+        if (write(trace_fd, b, len) != (ssize_t)len)
+            fprintf(stderr, PPREFIX "trace write failed, %u events lost\n",
+                    b->chunk.count);
+        b->chunk.count = 0;
+    }
+    if (release) {
+        tls_trace = NULL;
+        munmap(b, sizeof(*b));
+    }
+}
+
+static void trace_record(uint32_t op, void* addr, size_t size, uint64_t arg,
+                         uint64_t release_tsc)
+{
+    struct trace_buffer* b = tls_trace;
+    uint64_t now = tsc_now();
+
+    if (__builtin_expect(b == NULL, 0)) {
+        void* p = mmap(NULL, sizeof(*b), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return;
+        b = tls_trace = (struct trace_buffer*)p;
+        b->chunk.thread = __atomic_fetch_add(&trace_threads, 1,
+                                             __ATOMIC_RELAXED);
+    }
+    struct alloctrace_event* e = &b->ev[b->chunk.count];
+    e->tsc = now;
+    e->addr = (uintptr_t)addr;
+    e->size = size;
+    e->arg = arg;
+    e->op = op;
+    e->release = (release_tsc && now - release_tsc < UINT32_MAX)
+                 ? (uint32_t)(now - release_tsc) : 0;
+    if (++b->chunk.count == TRACE_EVENTS)
+        trace_flush(false);
+}
+
+/* traces one call if MALLOC_COUNT_TRACE is set */
+static inline void trace_event(uint32_t op, void* addr, size_t size,
+                               uint64_t arg = 0, uint64_t release_tsc = 0)
+{
+    if (__builtin_expect(trace_fd >= 0, 0))
+        trace_record(op, addr, size, arg, release_tsc);
+}
+
+
+/* raise the peak of region r to at least mycurr */
+static void update_region_peak(int r, long long mycurr)
+{
+    long long mypeak = __atomic_load_n(&regions[r].peak, __ATOMIC_RELAXED);
+    while (mycurr > mypeak &&
+           !__atomic_compare_exchange_n(&regions[r].peak, &mypeak, mycurr,
+                                        true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+        ;
+}
+
+/* region counters of a shard, mapped on first use */
+static struct region_count* shard_regions(struct count_shard* s)
+{
+    if (__builtin_expect(s->regions == NULL, 0)) {
+        void* p = mmap(NULL, MAX_REGIONS * sizeof(struct region_count),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+        if (p == MAP_FAILED) return NULL;
+        __atomic_store_n(&s->regions, (struct region_count*)p,
+                         __ATOMIC_RELEASE);
+    }
+    return s->regions;
+}
+
+/* charge an allocation (delta > 0) or free (delta < 0) to the thread's
+ * region */
+static void region_update(struct count_shard* s, long long delta)
+{
+    int r = tls_region;
+    struct region_count* rc = s ? shard_regions(s) : NULL;
+
+    if (__builtin_expect(rc == NULL, 0)) {
+        rc = &shared_regions[r];
+        __sync_add_and_fetch(&rc->curr, delta);
+        if (delta > 0) {
+            __sync_add_and_fetch(&rc->total, delta);
+            __sync_add_and_fetch(&rc->num_allocs, 1);
+        }
+        else {
+            __sync_add_and_fetch(&rc->num_frees, 1);
+        }
+        update_region_peak(r, __sync_add_and_fetch(&regions[r].curr, delta));
+        return;
+    }
+
+    rc += r;
+    SHARD_ADD(rc->curr, delta);
+    if (delta > 0) {
+        SHARD_ADD(rc->total, delta);
+        SHARD_ADD(rc->num_allocs, 1);
+    }
+    else {
+        SHARD_ADD(rc->num_frees, 1);
+    }
+    update_region_peak(r, __sync_add_and_fetch(&regions[r].curr, delta));
+}
+
+/* charge the duration of a backend call to the thread's region */
+static void region_ticks(uint64_t ticks)
+{
+    struct count_shard* s = get_shard();
+    struct region_count* rc = s ? shard_regions(s) : NULL;
+
+    ticks = ticks > tsc_overhead ? ticks - tsc_overhead : 0;
+    if (__builtin_expect(rc == NULL, 0))
+        __sync_add_and_fetch(&shared_regions[tls_region].ticks, ticks);
+    else
+        SHARD_ADD(rc[tls_region].ticks, (long long)ticks);
+}
+
+/* index of the region called name, registering it on first use */
+static int region_lookup(const char* name)
+{
+    static bool warned = false;
+    int n = __atomic_load_n(&num_regions, __ATOMIC_ACQUIRE);
+    int r;
+
+    for (r = 1; r < n; ++r)
+        if (strncmp(region_names[r], name, REGION_NAME_LEN - 1) == 0)
+            return r;
+
+    while (__sync_lock_test_and_set(&region_lock, 1))
+        while (region_lock) __asm__ __volatile__("pause" ::: "memory");
+    for (r = 1; r < num_regions; ++r)
+        if (strncmp(region_names[r], name, REGION_NAME_LEN - 1) == 0)
+            break;
+    if (r == num_regions) {
+        if (r < MAX_REGIONS) {
+            strncpy(region_names[r], name, REGION_NAME_LEN - 1);
+            __atomic_store_n(&num_regions, r + 1, __ATOMIC_RELEASE);
+        }
+        else {
+            if (!warned)
+                fprintf(stderr, PPREFIX "more than %d regions, \"%s\" and "
+                        "later ones are not tracked\n", MAX_REGIONS - 1, name);
+            warned = true;
+            r = 0;
+        }
+    }
+    __sync_lock_release(&region_lock);
+    return r;
+}
+
+/* add allocation to statistics */
+static void inc_count(size_t inc)
+{
+    struct count_shard* s = get_shard();
+
+    if (__builtin_expect(s == NULL, 0)) {
+        __sync_add_and_fetch(&shared_shard.curr, inc);
+        __sync_add_and_fetch(&shared_shard.total, inc);
+        __sync_add_and_fetch(&shared_shard.num_allocs, 1);
+        update_peak(__sync_add_and_fetch(&heap_total.curr, inc));
+        if (tls_region) region_update(NULL, inc);
+        log_interval_update(inc, 0);
+        if (callback) callback(callback_cookie, heap_total.curr);
+        return;
+    }
+
+    SHARD_ADD(s->curr, inc);
+    SHARD_ADD(s->total, inc);
+    SHARD_ADD(s->num_allocs, 1);
+    SHARD_ADD(s->pending, inc);
+    if (SHARD_LOAD(s->pending) > counter_flush_threshold)
+        flush_shard(s);
+    if (__builtin_expect(tls_region != 0, 0)) region_update(s, inc);
+    log_interval_update(inc, 0);
+    if (callback) callback(callback_cookie, current_fast());
 }
 
 /* decrement allocation to statistics */
 static void dec_count(size_t dec)
 {
-#if THREAD_SAFE_GCC_INTRINSICS
-    long long mycurr = __sync_sub_and_fetch(&curr, dec);
-    if (callback) callback(callback_cookie, mycurr);
-#else
-    curr -= dec;
-    if (callback) callback(callback_cookie, curr);
-#endif
+    struct count_shard* s = get_shard();
+
+    if (__builtin_expect(s == NULL, 0)) {
+        __sync_sub_and_fetch(&shared_shard.curr, dec);
+        __sync_add_and_fetch(&shared_shard.num_frees, 1);
+        __sync_sub_and_fetch(&heap_total.curr, dec);
+        if (tls_region) region_update(NULL, -(long long)dec);
+        log_interval_update(0, dec);
+        if (callback) callback(callback_cookie, heap_total.curr);
+        return;
+    }
+
+    SHARD_ADD(s->curr, -(long long)dec);
+    SHARD_ADD(s->num_frees, 1);
+    SHARD_ADD(s->pending, -(long long)dec);
+    if (SHARD_LOAD(s->pending) < -counter_flush_threshold)
+        flush_shard(s);
+    if (__builtin_expect(tls_region != 0, 0))
+        region_update(s, -(long long)dec);
+    log_interval_update(0, dec);
+    if (callback) callback(callback_cookie, current_fast());
+}
+
+/* allocator latency measurement, enabled by MALLOC_COUNT_LATENCY=1 */
+static bool latency_enabled = false;
+
+static const char* const latency_op_name[MALLOC_COUNT_NUM_OPS] = {
+    "malloc", "free", "realloc"
+};
+
+/* add the duration of one backend call to this thread's histogram */
+static void record_latency(int op, uint64_t ticks)
+{
+    struct count_shard* s = get_shard();
+
+    ticks = ticks > tsc_overhead ? ticks - tsc_overhead : 0;
+    if (__builtin_expect(s == NULL, 0)) {
+        latency_record_atomic(&shared_latency[op], ticks);
+        return;
+    }
+    if (__builtin_expect(s->latency == NULL, 0)) {
+        void* p = mmap(NULL, MALLOC_COUNT_NUM_OPS * sizeof(struct latency_hist),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+        if (p == MAP_FAILED) {
+            latency_record_atomic(&shared_latency[op], ticks);
+            return;
+        }
+        __atomic_store_n(&s->latency, (struct latency_hist*)p,
+                         __ATOMIC_RELEASE);
+    }
+    latency_record(&s->latency[op], ticks);
+}
+
+/* account the duration of one backend call */
+static inline void record_backend_time(int op, uint64_t ticks)
+{
+    if (latency_enabled) record_latency(op, ticks);
+    if (tls_region) region_ticks(ticks);
+    log_interval_time(ticks);
 }
 
 /* user function to return the currently allocated amount of memory */
 extern size_t malloc_count_current(void)
 {
-    return curr;
+    return current_sum();
 }
 
 /* user function to return the peak allocation */
 extern size_t malloc_count_peak(void)
 {
-    return peak;
+    update_peak(current_sum());
+    return heap_total.peak;
 }
 
 /* user function to reset the peak allocation to current */
 extern void malloc_count_reset_peak(void)
 {
-    peak = curr;
+    __atomic_store_n(&heap_total.peak, current_sum(), __ATOMIC_RELAXED);
 }
 
 /* user function to return total number of allocations */
 extern size_t malloc_count_num_allocs(void)
 {
-    return num_allocs;
+    struct malloc_count_stats st;
+    shard_lock_acquire();
+    sum_shards(&st);
+    shard_lock_release();
+    return st.num_allocs;
+}
+
+/* user function to return the counter changes since the previous call */
+extern void malloc_count_snapshot(struct malloc_count_stats* delta)
+{
+    struct malloc_count_stats st;
+    shard_lock_acquire();
+    sum_shards(&st);
+    delta->current = st.current - last_snapshot.current;
+    delta->total = st.total - last_snapshot.total;
+    delta->num_allocs = st.num_allocs - last_snapshot.num_allocs;
+    delta->num_frees = st.num_frees - last_snapshot.num_frees;
+    last_snapshot = st;
+    shard_lock_release();
+    update_peak(st.current);
+    delta->peak = heap_total.peak;
+}
+
+/* user function to summarize the backend call latencies */
+extern int malloc_count_latency_report(struct malloc_count_latency* report)
+{
+    /* summed histograms, static as they are too large for small stacks */
+    static struct latency_hist sum[MALLOC_COUNT_NUM_OPS];
+
+    if (!latency_enabled) return -1;
+
+    shard_lock_acquire();
+    memset(sum, 0, sizeof(sum));
+    for (int op = 0; op < MALLOC_COUNT_NUM_OPS; ++op) {
+        latency_merge(&sum[op], &shared_latency[op]);
+        for (int i = 0; i < MAX_COUNT_SHARDS; ++i) {
+            struct latency_hist* h =
+                __atomic_load_n(&shards[i].latency, __ATOMIC_ACQUIRE);
+            if (h) latency_merge(&sum[op], &h[op]);
+        }
+
+        uint64_t n = 0;
+        for (unsigned int b = 0; b < LATENCY_BUCKETS; ++b)
+            n += sum[op].count[b];
+
+        struct malloc_count_latency* r = &report[op];
+        r->count = n;
+        r->mean_ns = n ? tsc_to_ns(sum[op].total) / n : 0;
+        r->p50_ns = tsc_to_ns(latency_percentile(&sum[op], n, 0.5));
+        r->p99_ns = tsc_to_ns(latency_percentile(&sum[op], n, 0.99));
+        r->p999_ns = tsc_to_ns(latency_percentile(&sum[op], n, 0.999));
+        r->max_ns = tsc_to_ns(sum[op].max);
+    }
+    shard_lock_release();
+    return 0;
 }
 
 /* user function which prints current and peak allocation to stderr */
 extern void malloc_count_print_status(void)
 {
     fprintf(stderr, PPREFIX "current %'lld, peak %'lld\n",
-            curr, peak);
+            (long long)malloc_count_current(), (long long)malloc_count_peak());
 }
 
 /* user function to supply a memory profile callback */
@@ -152,6 +1026,68 @@ void malloc_count_set_callback(malloc_count_callback_type cb, void* cookie)
     callback_cookie = cookie;
 }
 
+/* user function to write the sampled heap profile */
+extern int malloc_count_dump_heap_profile(const char* prefix)
+{
+    return heapprof_dump(prefix);
+}
+
+/* user function to enter a region */
+extern int malloc_count_region_push(const char* name)
+{
+    int r = region_lookup(name);
+    if (tls_region_depth < MAX_REGION_DEPTH)
+        tls_region_stack[tls_region_depth] = tls_region;
+    ++tls_region_depth;
+    tls_region = r;
+    return r;
+}
+
+/* user function to leave the innermost region */
+extern void malloc_count_region_pop(void)
+{
+    if (tls_region_depth == 0) return;
+    --tls_region_depth;
+    if (tls_region_depth < MAX_REGION_DEPTH)
+        tls_region = tls_region_stack[tls_region_depth];
+}
+
+/* user function to summarize the regions */
+extern int malloc_count_region_report(struct malloc_count_region* report,
+                                      int max)
+{
+    int n = __atomic_load_n(&num_regions, __ATOMIC_ACQUIRE) - 1;
+    if (n > max) n = max;
+
+    shard_lock_acquire();
+    for (int k = 0; k < n; ++k) {
+        int r = k + 1;
+        struct region_count sum = shared_regions[r];
+        for (int i = 0; i < MAX_COUNT_SHARDS; ++i) {
+            struct region_count* rc =
+                __atomic_load_n(&shards[i].regions, __ATOMIC_ACQUIRE);
+            if (!rc) continue;
+            sum.curr += SHARD_LOAD(rc[r].curr);
+            sum.total += SHARD_LOAD(rc[r].total);
+            sum.num_allocs += SHARD_LOAD(rc[r].num_allocs);
+            sum.num_frees += SHARD_LOAD(rc[r].num_frees);
+            sum.ticks += SHARD_LOAD(rc[r].ticks);
+        }
+        update_region_peak(r, sum.curr);
+
+        struct malloc_count_region* rep = &report[k];
+        rep->name = region_names[r];
+        rep->current = sum.curr;
+        rep->total = sum.total;
+        rep->num_allocs = sum.num_allocs;
+        rep->num_frees = sum.num_frees;
+        rep->peak = regions[r].peak;
+        rep->alloc_ns = tsc_to_ns(sum.ticks);
+    }
+    shard_lock_release();
+    return n;
+}
+
 /* Record operation API */
 void malloc_count_record_start(void)
 {
@@ -162,118 +1098,322 @@ void malloc_count_record_stop(void)
      g_record_flag = false;
 }
 
-static double diff_in_second(double t1, double t2)
+/* size accounted for a block the backend returned for a request of size
+ * bytes: the requested size with the debug prefix, otherwise the usable size
+ * of the block (including the backend's size class rounding). */
+static inline size_t alloc_size(void* block, size_t size)
 {
-    return (t2 - t1);
+#if MALLOC_COUNT_HEADER
+    (void)block;
+    return size;
+#else
+    (void)size;
+    return backend_policy::usable_size(block);
+#endif
 }
-/****************************************************/
-/* exported symbols that overlay the libc functions */
-/****************************************************/
-/* exported malloc symbol that overrides loading from libc */
-extern void* malloc(size_t size)
+
+/* prepend allocation size and sentinel, returns the user pointer. Size and
+ * sentinel are the two words in front of the user pointer. A prefix longer
+ * than init_alignment (aligned allocations) also stores its length in the
+ * word before them and is marked by aligned_sentinel. */
+static inline void* put_header(void* block, size_t size, size_t align)
+{
+    if (!align) return block;
+    size_t* ptr = (size_t*)((char*)block + align);
+    ptr[-2] = size;
+    if (align == init_alignment) {
+        ptr[-1] = sentinel;
+    }
+    else {
+        ptr[-1] = aligned_sentinel;
+        ptr[-3] = align;
+    }
+    return ptr;
+}
+
+/* returns the size accounted for the user pointer ptr and stores the pointer
+ * originally returned by the backend in *block */
+static inline size_t block_size(void* ptr, void** block, const char* op)
+{
+#if MALLOC_COUNT_HEADER
+    size_t* hdr = (size_t*)ptr;
+
+    if (hdr[-1] == aligned_sentinel) {
+        *block = (char*)ptr - hdr[-3];
+        return hdr[-2];
+    }
+    if (hdr[-1] != sentinel) {
+        fprintf(stderr, PPREFIX
+                "%s(%p) has no sentinel !!! memory corruption?\n", op,
+                (char*)ptr - alignment);
+    }
+
+    *block = (char*)ptr - alignment;
+    return hdr[-2];
+#else
+    (void)op;
+    *block = ptr;
+    return backend_policy::usable_size(ptr);
+#endif
+}
+
+/* backend calls are timed for the latency histograms and inside regions,
+ * and always for the proprietary log which records alloc_time and for the
+ * interval log */
+#if PROPRIETARY_LOGGING || MALLOC_COUNT_LOG_INTERVAL
+#define MEASURE_BACKEND true
+#else
+#define MEASURE_BACKEND (latency_enabled || tls_region)
+#endif
+
+/* ret = call, with the duration of the call in ticks if it is measured */
+#define TIMED_BACKEND_CALL(op, ret, ticks, call)                        \
+    do {                                                                \
+        tls_in_backend = 1;                                             \
+        if (MEASURE_BACKEND) {                                          \
+            uint64_t t0_ = tsc_begin();                                 \
+            ret = (call);                                               \
+            ticks = tsc_end() - t0_;                                    \
+            record_backend_time(op, ticks);                             \
+        }                                                               \
+        else {                                                          \
+            ret = (call);                                               \
+        }                                                               \
+        tls_in_backend = 0;                                             \
+    } while (0)
+
+/* bookkeeping for a block the backend returned for a request of size bytes
+ * with a prefix of align bytes: heap log record, counters and heap profile.
+ * ticks is the duration of the backend call. Returns the user pointer. */
+static inline void* account_alloc(void* ret, size_t size, size_t align,
+                                  uint64_t ticks)
 {
-    void* ret;
 #if PROPRIETARY_LOGGING
-    static double last_ts;
-    static double first_ts;
+    static uint64_t last_ts;
+    static uint64_t first_ts;
     static double last_fragper;
     static bool ts_init_flag = true;
     double var_count;
     double fragper;
-#endif /* PROPRIETARY_LOGGING */
 
+    struct ringbuff_cell temp;
+    uint64_t now = tsc_now();
+    if(ts_init_flag == true ){
+        ts_init_flag = false;
+        first_ts = now;
+        last_ts = first_ts;
+    }
 
-    if (size == 0) return NULL;
-    if (real_malloc)
-    {
-        /* call read malloc procedure in libc */
-#if PROPRIETARY_LOGGING
+    temp.timestamp = 0;     /* set from the ring key by the reader */
 
-        struct ringbuff_cell temp;
-        double next_ts;
-        if(ts_init_flag == true ){
-            ts_init_flag = false;
-            first_ts = get_curr_time();
-            last_ts = first_ts;
+    /* Record real memory allocate size */
+    size_t actual_size = backend_policy::usable_size(ret);
+    fragper = (double)(actual_size - (align + size))/(double)(align + size);
+    var_count = (fragper > last_fragper)? (fragper - last_fragper) : (last_fragper - fragper);
+    if(tsc_to_ns(now - last_ts) / BILLION > 60 |
+                                     (fragper > 0.3)|
+        (var_count > last_fragper) ? (var_count - last_fragper): (last_fragper - var_count) > 0.2)
+    {
+        last_fragper = var_count;
+        temp.curr_heap_size = current_fast();
+        temp.alloc_size = size;
+        temp.weight = 1;
+        if(fragper > 0.3)
+        {
+           printf("fragper : %0.3f,actual_size %d,alignment %d, size %d \n",fragper,actual_size,align,size );
         }
 
-        temp.timestamp = get_curr_time();    
-        ret = (*real_malloc)(alignment + size);  
-        next_ts = get_curr_time();
+        temp.curr_frag_size = fragper;//(actual_size - (alignment + size))/(alignment + size);
 
-        /* Record real memory allocate size */
-#ifdef LTALLOC  
-        size_t actual_size = 0;//get_actual_info(ret);
-        fragper = (double)(actual_size - (alignment + size))/(double)(alignment + size);
-        var_count = (fragper > last_fragper)? (fragper - last_fragper) : (last_fragper - fragper);
-#else
-        size_t actual_size = malloc_usable_size(ret);
-        fragper = (double)(actual_size - (alignment + size))/(double)(alignment + size);
-        var_count = (fragper > last_fragper)? (fragper -last_fragper) : (last_fragper - fragper);   
-#endif
-        if(diff_in_second(last_ts, temp.timestamp) > 60 |
-                                         (fragper > 0.3)|
-            (var_count > last_fragper) ? (var_count - last_fragper): (last_fragper - var_count) > 0.2)
-        {
-            last_fragper = var_count;
-            temp.curr_heap_size = curr;
-            if(fragper > 0.3)
-            {
-               printf("fragper : %0.3f,actual_size %d,alignment %d, size %d \n",fragper,actual_size,alignment,size );
-            }
+        temp.alloc_time     = tsc_to_ns(ticks) / 1000;
+        temp.time_interval   = tsc_to_ns(now - first_ts) / BILLION;
+        last_ts = now;
 
-            temp.curr_frag_size = fragper;//(actual_size - (alignment + size))/(alignment + size);
+        rb_put(&rb_buffer,&temp);
+    }
+#elif MALLOC_COUNT_LOG_INTERVAL
+    (void)ticks;    /* logged by inc_count() */
+#else  /* For Unit test*/
+    float weight;
+    (void)ticks;
+    if (g_record_flag && (weight = log_sample_weight(size)) != 0)
+    {
+            struct ringbuff_cell temp;
+            temp.timestamp = 0;     /* set from the ring key by the reader */
+            temp.curr_heap_size = current_fast();
+            temp.alloc_size = size;
+            temp.weight = weight;
+            rb_put(&rb_buffer,&temp);
+    }
 
-            temp.alloc_time     = diff_in_second(temp.timestamp, next_ts)*1000000;
-            temp.time_interval   = diff_in_second(first_ts, temp.timestamp);
-            last_ts = temp.timestamp;
+#endif /*PROPRIETARY_LOGGING */
+    inc_count(alloc_size(ret, size));
+    if (log_operations && size >= log_operations_threshold) {
+        fprintf(stderr, PPREFIX "malloc(%'lld) = %p   (current %'lld)\n",
+                (long long)size, (char*)ret + align, current_fast());
+    }
 
-            rb_put(&rb_buffer,&temp);
-        }
-#else  /* For Unit test*/
-        if (g_record_flag)
-        {
-                struct ringbuff_cell temp;
-                //clock_get_hw_time(&temp.timestamp);
-                //temp.timestamp = get_curr_time();
-                temp.curr_heap_size = curr;
-                rb_put(&rb_buffer,&temp);
+    ret = put_header(ret, size, align);
+    heapprof_malloc_hook(ret, size);
+    return ret;
+}
+
+/* return a block to the backend */
+static inline void backend_free(void* block)
+{
+    tls_in_backend = 1;
+    if (MEASURE_BACKEND) {
+        uint64_t t0 = tsc_begin();
+        backend_policy::free(block);
+        record_backend_time(MALLOC_COUNT_OP_FREE, tsc_end() - t0);
+    }
+    else {
+        backend_policy::free(block);
+    }
+    tls_in_backend = 0;
+}
+
+static inline bool on_init_heap(const void* ptr)
+{
+    return (const char*)ptr >= init_heap &&
+           (const char*)ptr <= init_heap + init_heap_use;
+}
+
+/* allocate size bytes aligned to align (a power of two) from the init heap,
+ * reusing a freed block if one fits */
+static void* init_heap_alloc(size_t size, size_t align)
+{
+    size_t* ret = NULL;
+
+    while (__sync_lock_test_and_set(&init_heap_lock, 1))
+        while (init_heap_lock) __asm__ __volatile__("pause" ::: "memory");
+
+    for (void** prev = &init_heap_free_list; *prev; prev = (void**)*prev) {
+        size_t* blk = (size_t*)*prev;
+        if (blk[-2] >= size && !((uintptr_t)blk & (align - 1))) {
+            *prev = *(void**)blk;
+            ret = blk;
+            break;
         }
+    }
 
-#endif /*PROPRIETARY_LOGGING */
-        ret = (*real_malloc)(alignment + size);
-        inc_count(size);
-        if (log_operations && size >= log_operations_threshold) {
-            fprintf(stderr, PPREFIX "malloc(%'lld) = %p   (current %'lld)\n",
-                    (long long)size, (char*)ret + alignment, curr);
+    if (!ret) {
+        uintptr_t user = (uintptr_t)(init_heap + init_heap_use + init_alignment);
+        size_t pad = ((user + align - 1) & ~(uintptr_t)(align - 1)) - user;
+        size_t cap = (size + init_alignment - 1) & ~(init_alignment - 1);
+
+        if (init_heap_use + pad + init_alignment + cap > INIT_HEAP_SIZE) {
+            fprintf(stderr, PPREFIX "init heap full !!!\n");
+            exit(EXIT_FAILURE);
         }
+        ret = (size_t*)put_header(init_heap + init_heap_use + pad, cap,
+                                  init_alignment);
+        init_heap_use += pad + init_alignment + cap;
+    }
+    __sync_lock_release(&init_heap_lock);
 
-        /* prepend allocation size and check sentinel */
-        *(size_t*)ret = size;
-        *(size_t*)((char*)ret + alignment - sizeof(size_t)) = sentinel;
+    /* the header holds the capacity while the block is free */
+    ret[-2] = size;
 
-        return (char*)ret + alignment;
+    if (log_operations_init_heap) {
+        fprintf(stderr, PPREFIX "malloc(%'lld) = %p   on init heap\n",
+                (long long)size, ret);
+    }
+    return ret;
+}
+
+/* put a block of the init heap on the free list */
+static void init_heap_release(void* ptr)
+{
+    size_t* blk = (size_t*)ptr;
+
+    if (log_operations_init_heap) {
+        fprintf(stderr, PPREFIX "free(%p)   on init heap\n", ptr);
+    }
+
+    while (__sync_lock_test_and_set(&init_heap_lock, 1))
+        while (init_heap_lock) __asm__ __volatile__("pause" ::: "memory");
+    blk[-2] = (blk[-2] + init_alignment - 1) & ~(init_alignment - 1);
+    *(void**)blk = init_heap_free_list;
+    init_heap_free_list = blk;
+    __sync_lock_release(&init_heap_lock);
+}
+
+/****************************************************/
+/* exported symbols that overlay the libc functions */
+/****************************************************/
+/* exported malloc symbol that overrides loading from libc */
+extern void* malloc(size_t size)
+{
+    void* ret;
+
+    if (size == 0) return NULL;
+    if (backend_policy::loaded() && !tls_in_backend)
+    {
+        /* call read malloc procedure in libc */
+        uint64_t ticks = 0;
+        TIMED_BACKEND_CALL(MALLOC_COUNT_OP_MALLOC, ret, ticks,
+                           backend_policy::malloc(alignment + size));
+        if (!ret) return NULL;
+
+        ret = account_alloc(ret, size, alignment, ticks);
+        trace_event(ALLOCTRACE_MALLOC, ret, size);
+        return ret;
     }
     else
     {
-        if (init_heap_use + alignment + size > INIT_HEAP_SIZE) {
-            fprintf(stderr, PPREFIX "init heap full !!!\n");
-            exit(EXIT_FAILURE);
-        }
-        ret = init_heap + init_heap_use;
-        init_heap_use += alignment + size;
+        return init_heap_alloc(size, init_alignment);
+    }
+}
 
-        /* prepend allocation size and check sentinel */
-        *(size_t*)ret = size;
-        *(size_t*)((char*)ret + alignment - sizeof(size_t)) = sentinel;
+/* allocation aligned to align bytes, which must be a power of two. Served by
+ * the backend's aligned entry point, so the block needs no manual alignment
+ * and, without the debug prefix, no extra bytes. */
+static void* aligned_malloc(size_t align, size_t size)
+{
+    void* ret;
 
-        if (log_operations_init_heap) {
-            fprintf(stderr, PPREFIX "malloc(%'lld) = %p   on init heap\n",
-                    (long long)size, (char*)ret + alignment);
-        }
+    /* blocks of the backends and of the init heap are 16 byte aligned */
+    if (align <= init_alignment) return malloc(size);
+    if (size == 0) return NULL;
 
-        return (char*)ret + alignment;
+    if (!backend_policy::loaded() || tls_in_backend)
+        return init_heap_alloc(size, align);
+
+    /* the debug prefix fills the align bytes in front of the user pointer,
+     * which leaves room to store its length */
+    size_t prefix = alignment ? align : 0;
+    uint64_t ticks = 0;
+    TIMED_BACKEND_CALL(MALLOC_COUNT_OP_MALLOC, ret, ticks,
+                       backend_policy::memalign(align, prefix + size));
+    if (!ret) return NULL;
+
+    if ((uintptr_t)ret & (align - 1)) {
+        /* more than the backend can align to (ltalloc: 64 KiB) */
+        backend_free(ret);
+        errno = ENOMEM;
+        return NULL;
     }
+
+    ret = account_alloc(ret, size, prefix, ticks);
+    trace_event(ALLOCTRACE_MEMALIGN, ret, size, align);
+    return ret;
+}
+
+/* free() for callers which know the requested size (C++14 sized delete).
+ * Without the debug prefix the accounted size is computed by the backend from
+ * the size alone, so the block's metadata is not looked up. */
+static inline void sized_free(void* ptr, size_t size)
+{
+    if (!MALLOC_COUNT_HEADER && backend_policy::has_good_size() && ptr && !on_init_heap(ptr)) {
+        heapprof_free_hook(ptr);
+        trace_event(ALLOCTRACE_FREE, ptr, size);
+        /* operator new() allocates 1 byte for size 0 */
+        dec_count(backend_policy::good_size(size ? size : 1));
+        backend_free(ptr);
+        return;
+    }
+    free(ptr);
 }
 
 /* exported free symbol that overrides loading from libc */
@@ -283,48 +1423,58 @@ extern void free(void* ptr)
 
     if (!ptr) return;   /* free(NULL) is no operation */
 
-    if ((char*)ptr >= init_heap &&
-        (char*)ptr <= init_heap + init_heap_use)
+    if (on_init_heap(ptr))
     {
-        if (log_operations_init_heap) {
-            fprintf(stderr, PPREFIX "free(%p)   on init heap\n", ptr);
-        }
+        init_heap_release(ptr);
         return;
     }
 
-    if (!real_free) {
+    if (!backend_policy::loaded()) {
         fprintf(stderr, PPREFIX
                 "free(%p) outside init heap and without real_free !!!\n", ptr);
         return;
     }
 
-    ptr = (char*)ptr - alignment;
-
-    if (*(size_t*)((char*)ptr + alignment - sizeof(size_t)) != sentinel) {
-        fprintf(stderr, PPREFIX
-                "free(%p) has no sentinel !!! memory corruption?\n", ptr);
-    }
-
-    size = *(size_t*)ptr;
+    heapprof_free_hook(ptr);
+    trace_event(ALLOCTRACE_FREE, ptr, 0);
+    size = block_size(ptr, &ptr, "free");
     dec_count(size);
 
     if (log_operations && size >= log_operations_threshold) {
         fprintf(stderr, PPREFIX "free(%p) -> %'lld   (current %'lld)\n",
-                ptr, (long long)size, curr);
+                ptr, (long long)size, current_fast());
     }
 
-    (*real_free)(ptr);
+    backend_free(ptr);
 }
 
-/* exported calloc() symbol that overrides loading from libc, implemented using
- * our malloc */
+/* exported calloc() symbol that overrides loading from libc. Goes to the
+ * backend's calloc(), which may skip clearing blocks fresh from the system
+ * (glibc does, ltalloc always clears). */
 extern void* calloc(size_t nmemb, size_t size)
 {
     void* ret;
-    size *= nmemb;
+
+    if (__builtin_mul_overflow(nmemb, size, &size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
     if (!size) return NULL;
-    ret = malloc(size);
-    memset(ret, 0, size);
+
+    if (!backend_policy::loaded() || tls_in_backend) {
+        /* dlsym() calls calloc() before the backend is loaded */
+        ret = malloc(size);
+        if (ret) memset(ret, 0, size);
+        return ret;
+    }
+
+    uint64_t ticks = 0;
+    TIMED_BACKEND_CALL(MALLOC_COUNT_OP_MALLOC, ret, ticks,
+                       backend_policy::calloc(1, alignment + size));
+    if (!ret) return NULL;
+
+    ret = account_alloc(ret, size, alignment, ticks);
+    trace_event(ALLOCTRACE_CALLOC, ret, size);
     return ret;
 }
 
@@ -334,16 +1484,15 @@ extern void* realloc(void* ptr, size_t size)
     void* newptr;
     size_t oldsize;
 
-    if ((char*)ptr >= (char*)init_heap &&
-        (char*)ptr <= (char*)init_heap + init_heap_use)
+    if (on_init_heap(ptr))
     {
         if (log_operations_init_heap) {
             fprintf(stderr, PPREFIX "realloc(%p) = on init heap\n", ptr);
         }
 
-        ptr = (char*)ptr - alignment;
+        ptr = (char*)ptr - init_alignment;
 
-        if (*(size_t*)((char*)ptr + alignment - sizeof(size_t)) != sentinel) {
+        if (*(size_t*)((char*)ptr + init_alignment - sizeof(size_t)) != sentinel) {
             fprintf(stderr, PPREFIX
                     "realloc(%p) has no sentinel !!! memory corruption?\n",
                     ptr);
@@ -354,11 +1503,11 @@ extern void* realloc(void* ptr, size_t size)
         if (oldsize >= size) {
             /* keep old area, just reduce the size */
             *(size_t*)ptr = size;
-            return (char*)ptr + alignment;
+            return (char*)ptr + init_alignment;
         }
         else {
             /* allocate new area and copy data */
-            ptr = (char*)ptr + alignment;
+            ptr = (char*)ptr + init_alignment;
             newptr = malloc(size);
             memcpy(newptr, ptr, oldsize);
             free(ptr);
@@ -375,130 +1524,373 @@ extern void* realloc(void* ptr, size_t size)
         return malloc(size);
     }
 
-    ptr = (char*)ptr - alignment;
+    void* oldptr = ptr;
+    uint64_t release_tsc = trace_fd >= 0 ? tsc_now() : 0;
+    oldsize = block_size(ptr, &ptr, "realloc");
 
-    if (*(size_t*)((char*)ptr + alignment - sizeof(size_t)) != sentinel) {
-        fprintf(stderr, PPREFIX
-                "free(%p) has no sentinel !!! memory corruption?\n", ptr);
+    tls_in_backend = 1;
+    if (MEASURE_BACKEND) {
+        uint64_t t0 = tsc_begin();
+        newptr = backend_policy::realloc(ptr, alignment + size);
+        record_backend_time(MALLOC_COUNT_OP_REALLOC, tsc_end() - t0);
     }
+    else {
+        newptr = backend_policy::realloc(ptr, alignment + size);
+    }
+    tls_in_backend = 0;
+    if (!newptr) return NULL;   /* the old block is still live */
 
-    oldsize = *(size_t*)ptr;
-
+    heapprof_free_hook(oldptr);
     dec_count(oldsize);
-    inc_count(size);
-
-    newptr = (*real_realloc)(ptr, alignment + size);
+    inc_count(alloc_size(newptr, size));
 
     if (log_operations && size >= log_operations_threshold)
     {
         if (newptr == ptr)
             fprintf(stderr, PPREFIX
                     "realloc(%'lld -> %'lld) = %p   (current %'lld)\n",
-                   (long long)oldsize, (long long)size, newptr, curr);
+                   (long long)oldsize, (long long)size, newptr, current_fast());
         else
             fprintf(stderr, PPREFIX
                     "realloc(%'lld -> %'lld) = %p -> %p   (current %'lld)\n",
-                   (long long)oldsize, (long long)size, ptr, newptr, curr);
+                   (long long)oldsize, (long long)size, ptr, newptr,
+                   current_fast());
     }
 
-    *(size_t*)newptr = size;
-
-    return (char*)newptr + alignment;
+    newptr = put_header(newptr, size, alignment);
+    heapprof_malloc_hook(newptr, size);
+    trace_event(ALLOCTRACE_REALLOC, newptr, size, (uintptr_t)oldptr,
+                release_tsc);
+    return newptr;
 }
 
-static void load_dynamic_lib() {
-    
-#ifdef LTALLOC 
-    puts("Use LTALLOC dynamic library!");   
-    char *error;
-    void *handle = dlopen("./patch_rocket_sim/src/ltalloc.so", RTLD_LAZY);
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "error %s\n", error);
-        exit(EXIT_FAILURE);
+/* exported reallocarray() symbol, glibc's version calls its own realloc() */
+extern void* reallocarray(void* ptr, size_t nmemb, size_t size)
+{
+    if (__builtin_mul_overflow(nmemb, size, &size)) {
+        errno = ENOMEM;
+        return NULL;
     }
-    real_malloc = (malloc_type)dlsym(handle, "_Z8ltmallocm");
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "error %s\n", error);
-        exit(EXIT_FAILURE);
+    return realloc(ptr, size);
+}
+
+/* exported posix_memalign() symbol that overrides loading from libc */
+extern int posix_memalign(void** memptr, size_t align, size_t size)
+{
+    void* ret;
+
+    if (align < sizeof(void*) || (align & (align - 1)))
+        return EINVAL;
+    ret = aligned_malloc(align, size);
+    if (!ret && size) return ENOMEM;
+    *memptr = ret;
+    return 0;
+}
+
+/* exported aligned_alloc() symbol that overrides loading from libc */
+extern void* aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
     }
-    real_realloc = (realloc_type)dlsym(handle, "_Z9ltreallocPvm");
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "error %s\n", error);
-        exit(EXIT_FAILURE);
+    return aligned_malloc(align, size);
+}
+
+/* exported memalign() symbol, like glibc it rounds align up to a power of
+ * two */
+extern void* memalign(size_t align, size_t size)
+{
+    if (align & (align - 1)) {
+        if (align > ((size_t)-1 >> 1) + 1) {
+            errno = EINVAL;
+            return NULL;
+        }
+        align = (size_t)1 << (64 - __builtin_clzll(align));
     }
+    return aligned_malloc(align, size);
+}
 
-    real_free = (free_type)dlsym(handle, "_Z6ltfreePv");
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "error %s\n", error);
-        exit(EXIT_FAILURE);
+/* exported valloc() and pvalloc() symbols, page aligned */
+extern void* valloc(size_t size)
+{
+    return aligned_malloc(sysconf(_SC_PAGESIZE), size);
+}
+
+extern void* pvalloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return aligned_malloc(page, (size + page - 1) & ~(page - 1));
+}
+
+/* exported malloc_usable_size() symbol, the bytes the caller may use */
+extern size_t malloc_usable_size(void* ptr)
+{
+    void* block;
+
+    if (!ptr) return 0;
+    if (on_init_heap(ptr)) return ((size_t*)ptr)[-2];
+    if (!backend_policy::loaded()) return 0;
+#if MALLOC_COUNT_HEADER
+    block_size(ptr, &block, "malloc_usable_size");
+    return backend_policy::usable_size(block) - ((char*)ptr - (char*)block);
+#else
+    (void)block;
+    return backend_policy::usable_size(ptr);
+#endif
+}
+
+#if !MALLOC_COUNT_STATIC_BACKEND
+/*********************/
+/* backend selection */
+/*********************/
+
+/* the backend is picked at startup: MALLOC_COUNT_BACKEND=ltalloc|scalloc|glibc,
+ * else "backend = ..." in the config file (MALLOC_COUNT_CONFIG, default
+ * malloc_count.conf next to the executable), else the one the binary was
+ * built for. The library is searched relative to the executable unless
+ * MALLOC_COUNT_BACKEND_LIB or "library = ..." gives its path. */
+#ifdef __MACH__
+#define SCALLOC_LIB "scalloc-1.0.0/out/Release/libscalloc.dylib"
+#else
+#define SCALLOC_LIB "scalloc-1.0.0/out/Release/lib.target/libscalloc.so"
+#endif
+
+static const struct backend_desc {
+    const char* name;
+    const char* libs[3];        /* relative to the executable, NULL: libc */
+    const char* malloc_sym;
+    const char* free_sym;
+    const char* realloc_sym;
+    const char* usable_size_sym;
+    const char* memalign_sym;
+    const char* calloc_sym;
+    const char* good_size_sym;  /* optional */
+} backends[] = {
+    { "ltalloc",
+      { "patch_rocket_sim/src/ltalloc.so", "ltalloc.so", NULL },
+      "ltalloc_malloc", "ltalloc_free", "ltalloc_realloc",
+      "ltalloc_usable_size", "ltalloc_memalign", "ltalloc_calloc",
+      "ltalloc_good_size" },
+    /* scalloc_memalign() is the same code as scalloc_posix_memalign() and
+     * scalloc_aligned_alloc() */
+    { "scalloc",
+      { "patch_rocket_sim/src/" SCALLOC_LIB, SCALLOC_LIB, NULL },
+      "scalloc_malloc", "scalloc_free", "scalloc_realloc",
+      "scalloc_malloc_usable_size", "scalloc_memalign", "scalloc_calloc",
+      "scalloc_good_size" },
+    /* glibc has no size class function, sized delete looks the block up */
+    { "glibc",
+      { NULL },
+      "malloc", "free", "realloc",
+      "malloc_usable_size", "memalign", "calloc",
+      NULL },
+};
+
+#define NUM_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+/* directory of the running executable, with a trailing slash */
+static void exe_dir(char* dir, size_t len)
+{
+    ssize_t n = -1;
+#ifdef __MACH__
+    uint32_t size = len;
+    if (_NSGetExecutablePath(dir, &size) == 0) n = strlen(dir);
+#else
+    n = readlink("/proc/self/exe", dir, len - 1);
+#endif
+    if (n < 0) n = 0;
+    dir[n] = 0;
+    char* slash = strrchr(dir, '/');
+    if (slash) slash[1] = 0;
+    else dir[0] = 0;
+}
+
+/* looks up key in the config file, "key = value" lines and # comments.
+ * Returns value in buf, or NULL. Reads with read(2) as there is no malloc()
+ * yet. */
+static const char* config_value(const char* path, const char* key,
+                                char* buf, size_t len)
+{
+    char text[4096];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    ssize_t n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0) return NULL;
+    text[n] = 0;
+
+    size_t keylen = strlen(key);
+    for (char* line = text; line && *line; ) {
+        char* next = strchr(line, '\n');
+        if (next) *next++ = 0;
+        line += strspn(line, " \t");
+        if (strncmp(line, key, keylen) == 0) {
+            char* v = line + keylen;
+            v += strspn(v, " \t");
+            if (*v == '=') {
+                v += 1 + strspn(v + 1, " \t");
+                size_t vlen = strcspn(v, " \t\r#");
+                if (vlen && vlen < len) {
+                    memcpy(buf, v, vlen);
+                    buf[vlen] = 0;
+                    return buf;
+                }
+            }
+        }
+        line = next;
     }
-#endif /* LTALLOC */
-
-#ifdef SCALLOC  
-    char *error;
-#if __MACH__
-    puts("Use SCALLOC dynamic library! (mac)");  
-    void *handle = dlopen("./patch_rocket_sim/src/scalloc-1.0.0/out/Release/libscalloc.dylib", 
-                            RTLD_LAZY);
-#else /* Linux */
-    void *handle = dlopen("./patch_rocket_sim/src/scalloc-1.0.0/out/Release/lib.target/libscalloc.so", 
-                            RTLD_LAZY);
-    puts("Use SCALLOC dynamic library! (Linux)");  
-    
-#endif /* __MACH__ */
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "error %s\n", error);
+    return NULL;
+}
+
+/* dlsym() that stops with a clear message if the backend lacks the symbol */
+static void* backend_symbol(void* handle, const char* lib, const char* sym,
+                            bool required)
+{
+    dlerror();
+    void* fn = dlsym(handle, sym);
+    if (!fn && required) {
+        const char* error = dlerror();
+        fprintf(stderr, PPREFIX "backend %s: symbol %s not found in %s%s%s\n",
+                backend_name, sym, lib, error ? ": " : "", error ? error : "");
         exit(EXIT_FAILURE);
     }
-    real_malloc = (malloc_type)dlsym(handle, "scalloc_malloc");
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "error %s\n", error);
-        exit(EXIT_FAILURE);
+    return fn;
+}
+
+static void load_backend(void)
+{
+    char dir[PATH_MAX], conf[PATH_MAX], name[64], path[PATH_MAX];
+    const char* want = getenv("MALLOC_COUNT_BACKEND");
+    const char* lib = getenv("MALLOC_COUNT_BACKEND_LIB");
+    const char* conf_path = getenv("MALLOC_COUNT_CONFIG");
+    const struct backend_desc* b = NULL;
+    void* handle;
+
+    exe_dir(dir, sizeof(dir));
+    if (!conf_path || !*conf_path) {
+        snprintf(conf, sizeof(conf), "%smalloc_count.conf", dir);
+        conf_path = conf;
     }
-    real_realloc = (realloc_type)dlsym(handle, "scalloc_realloc");
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "error %s\n", error);
+    if (!want || !*want)
+        want = config_value(conf_path, "backend", name, sizeof(name));
+    if (!lib || !*lib)
+        lib = config_value(conf_path, "library", path, sizeof(path));
+    if (!want) want = backend_name;
+
+    for (size_t i = 0; i < NUM_BACKENDS; ++i)
+        if (strcmp(backends[i].name, want) == 0) b = &backends[i];
+    if (!b) {
+        fprintf(stderr, PPREFIX "unknown backend \"%s\", use ltalloc, "
+                "scalloc or glibc\n", want);
         exit(EXIT_FAILURE);
     }
+    backend_name = b->name;
 
-    real_free = (free_type)dlsym(handle, "scalloc_free");
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "error %s\n", error);
-        exit(EXIT_FAILURE);
+    if (!b->libs[0]) {
+        handle = RTLD_NEXT;
+        lib = "libc";
     }
-#endif /* SCALLOC */
-
-}
-#ifdef GLIBC
-static void load_glib() {
-    puts("Use glibc!");
-    
-    char *error;
-    real_malloc = (malloc_type)dlsym(RTLD_NEXT, "malloc");
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "error %s\n", error);
-        exit(EXIT_FAILURE);
+    else if (lib && *lib) {
+        if (!(handle = dlopen(lib, RTLD_LAZY))) {
+            fprintf(stderr, PPREFIX "backend %s: %s\n", b->name, dlerror());
+            exit(EXIT_FAILURE);
+        }
     }
-
-    real_realloc = (realloc_type)dlsym(RTLD_NEXT, "realloc");
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "error %s\n", error);
-        exit(EXIT_FAILURE);
+    else {
+        handle = NULL;
+        for (int i = 0; !handle && i < 3 && b->libs[i]; ++i) {
+            snprintf(path, sizeof(path), "%s%s", dir, b->libs[i]);
+            handle = dlopen(path, RTLD_LAZY);
+        }
+        if (!handle) {
+            fprintf(stderr, PPREFIX "backend %s: %s not found next to the "
+                    "executable in %s (set MALLOC_COUNT_BACKEND_LIB)\n",
+                    b->name, b->libs[0], dir);
+            exit(EXIT_FAILURE);
+        }
+        lib = path;
     }
+    printf("Use %s (%s)\n", b->name, lib);
+
+    /* publish real_malloc last: dlsym() may allocate, and malloc() must keep
+     * using the init heap until all other functions are there */
+    malloc_type m = (malloc_type)backend_symbol(handle, lib, b->malloc_sym, true);
+    real_free = (free_type)backend_symbol(handle, lib, b->free_sym, true);
+    real_realloc = (realloc_type)backend_symbol(handle, lib, b->realloc_sym,
+                                                true);
+    real_usable_size = (usable_size_type)backend_symbol(handle, lib,
+                                                        b->usable_size_sym,
+                                                        true);
+    real_memalign = (memalign_type)backend_symbol(handle, lib,
+                                                  b->memalign_sym, true);
+    real_calloc = (calloc_type)backend_symbol(handle, lib, b->calloc_sym, true);
+    if (b->good_size_sym)
+        real_good_size = (good_size_type)backend_symbol(handle, lib,
+                                                        b->good_size_sym,
+                                                        false);
+    __atomic_store_n(&real_malloc, m, __ATOMIC_RELEASE);
+}
+#endif /* !MALLOC_COUNT_STATIC_BACKEND */
 
-    real_free = (free_type)dlsym(RTLD_NEXT, "free");
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "error %s\n", error);
-        exit(EXIT_FAILURE);
+/* heap log reader: MALLOC_COUNT_READER_CPU=2 or 2,4-5 pins it to those CPUs,
+ * MALLOC_COUNT_READER_NICE=n sets its nice level, and
+ * MALLOC_COUNT_READER_WAIT_MS=n is the longest it sleeps while no ring fills
+ * up (default 10). */
+static unsigned reader_wait_ms = 10;
+#define READER_SPINS 1000       /* empty polls before the reader parks */
+
+static void reader_setup(void)
+{
+    const char* cpus = getenv("MALLOC_COUNT_READER_CPU");
+    const char* nice_level = getenv("MALLOC_COUNT_READER_NICE");
+    const char* wait = getenv("MALLOC_COUNT_READER_WAIT_MS");
+
+    if (wait && *wait)
+        reader_wait_ms = strtoul(wait, NULL, 0);
+#ifdef __linux__
+    if (cpus && *cpus) {
+        cpu_set_t set;
+        const char* p = cpus;
+        char* end;
+
+        CPU_ZERO(&set);
+        for (;;) {
+            long lo = strtol(p, &end, 10), hi = lo;
+            if (end == p) break;
+            if (*end == '-') hi = strtol(end + 1, &end, 10);
+            for (long c = lo; c <= hi && c < CPU_SETSIZE; ++c)
+                CPU_SET(c, &set);
+            if (*end != ',') break;
+            p = end + 1;
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            fprintf(stderr, PPREFIX "cannot pin the log reader to CPUs %s\n",
+                    cpus);
     }
+    if (nice_level && *nice_level &&
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), atoi(nice_level)) != 0)
+        fprintf(stderr, PPREFIX "cannot set nice level %s of the log reader: "
+                "%s\n", nice_level, strerror(errno));
+#else
+    (void)cpus;
+    (void)nice_level;
+#endif
 }
-#endif /* GLIBC */
 
 void *reader_thread(void *arg)
 {
-        while (!(reader_end_flag && EQUAL(rb_buffer.reader_idx, rb_buffer.writer_idx)))
+        unsigned idle = 0;
+
+        reader_setup();
+        while (!(reader_end_flag && rb_empty(&rb_buffer)))
         {
-            rb_get(&rb_buffer, NULL);
+            if (rb_write_log(&rb_buffer))
+                idle = 0;
+            else if (++idle < READER_SPINS)
+                __asm__ __volatile__("pause" ::: "memory");
+            else
+                rb_wait(&rb_buffer, reader_wait_ms);
         }
         rb_deinit(&rb_buffer);
         return NULL;
@@ -506,12 +1898,46 @@ void *reader_thread(void *arg)
 
 static __attribute__((constructor)) void init(void)
 {
-#ifdef GLIBC     
-    load_glib();
+#if MALLOC_COUNT_STATIC_BACKEND
+    {
+        const char* want = getenv("MALLOC_COUNT_BACKEND");
+        if (want && *want && strcmp(want, backend_name) != 0)
+            fprintf(stderr, PPREFIX "built with the static %s backend, "
+                    "MALLOC_COUNT_BACKEND=%s ignored\n", backend_name, want);
+        printf("Use %s (static)\n", backend_name);
+    }
 #else
-    load_dynamic_lib();
+    load_backend();
 #endif
-    rb_init(&rb_buffer);
+    shard_key_valid = (pthread_key_create(&shard_key, release_shard) == 0);
+    if (shard_key_valid && tls_shard)
+        pthread_setspecific(shard_key, tls_shard);
+    {
+        const char* flush = getenv("MALLOC_COUNT_FLUSH_BYTES");
+        if (flush && *flush) {
+            counter_flush_threshold = strtoll(flush, NULL, 0);
+            if (counter_flush_threshold <= 0) {
+                counter_flush_threshold = 0;
+                printf("Heap size and peak are exact\n");
+            }
+            else {
+                printf("Counters are folded every %lld bytes per thread\n",
+                       counter_flush_threshold);
+            }
+        }
+    }
+    heapprof_init();
+    log_sampling_init();
+    tsc_calibrate();
+    trace_open();
+#if MALLOC_COUNT_LOG_INTERVAL
+    log_interval_init();
+#endif
+    {
+        const char* lat = getenv("MALLOC_COUNT_LATENCY");
+        latency_enabled = (lat && atoi(lat) != 0);
+    }
+    rb_init(&rb_buffer, backend_name);
     printf("Default record is start !!\n");
     pthread_create(&reader_thread_id, NULL, reader_thread, NULL);
 
@@ -521,23 +1947,113 @@ static __attribute__((constructor)) void init(void)
 
 static __attribute__((destructor)) void finish(void)
 {
+    log_interval_flush();
+    if (trace_fd >= 0) trace_flush(false);
     reader_end_flag = true;
-    printf("Please wait file operation. widx:%d, ridx:%d ......\n", 
-            rb_buffer.writer_idx, rb_buffer.reader_idx);
+    rb_wake(&rb_buffer);
+    printf("Please wait file operation. put:%llu, written:%llu ......\n",
+           (unsigned long long)rb_records_put(&rb_buffer),
+           (unsigned long long)rb_buffer.written);
     pthread_join(reader_thread_id, NULL);
+    if (rb_buffer.lost)
+        fprintf(stderr, PPREFIX "heap log lost %llu records to full rings\n",
+                (unsigned long long)rb_buffer.lost);
     printf("All Finish. Ready exit\n");
+    if (heapprof_rate) heapprof_dump(NULL);
+
+    struct malloc_count_latency lat[MALLOC_COUNT_NUM_OPS];
+    if (malloc_count_latency_report(lat) == 0) {
+        for (int op = 0; op < MALLOC_COUNT_NUM_OPS; ++op) {
+            fprintf(stderr, PPREFIX "%s %-7s n=%zu mean=%.1fns p50=%.1fns "
+                    "p99=%.1fns p99.9=%.1fns max=%.1fns\n", backend_name,
+                    latency_op_name[op], lat[op].count, lat[op].mean_ns,
+                    lat[op].p50_ns, lat[op].p99_ns, lat[op].p999_ns,
+                    lat[op].max_ns);
+        }
+    }
+    struct malloc_count_region reg[MAX_REGIONS];
+    int nreg = malloc_count_region_report(reg, MAX_REGIONS);
+    for (int r = 0; r < nreg; ++r) {
+        fprintf(stderr, PPREFIX "region %-16s current %'lld, peak %'zu, "
+                "total %'zu, allocs %'zu, frees %'zu, alloc time %.3f ms\n",
+                reg[r].name, reg[r].current, reg[r].peak, reg[r].total,
+                reg[r].num_allocs, reg[r].num_frees, reg[r].alloc_ns / 1e6);
+    }
+
+    struct malloc_count_stats st;
+    shard_lock_acquire();
+    sum_shards(&st);
+    shard_lock_release();
+    update_peak(st.current);
     fprintf(stderr, PPREFIX
             "exiting, total: %'lld, peak: %'lld, current: %'lld\n",
-            total, peak, curr);
+            (long long)st.total, heap_total.peak, st.current);
 }
-void *operator new[](std::size_t s) throw(std::bad_alloc)
+/* C++ allocation functions, routed through the functions above so that they
+ * are counted and reach the backend's aligned entry point and, for sized
+ * delete, its size class function */
+static void* cxx_alloc(std::size_t size, std::size_t align)
 {
-    // TODO: implement
-    return malloc(s);
+    void* p;
+    if (!size) size = 1;    /* new must return distinct pointers */
+    while (!(p = aligned_malloc(align, size))) {
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+    return p;
 }
-void operator delete[](void *p) throw()
+
+static void* cxx_alloc_nothrow(std::size_t size, std::size_t align) noexcept
 {
-    // TODO: implement
-    free(p);
+    try {
+        return cxx_alloc(size, align);
+    }
+    catch (...) {
+        return NULL;
+    }
 }
+
+void* operator new(std::size_t s) { return cxx_alloc(s, 0); }
+void* operator new[](std::size_t s) { return cxx_alloc(s, 0); }
+void* operator new(std::size_t s, const std::nothrow_t&) noexcept
+{ return cxx_alloc_nothrow(s, 0); }
+void* operator new[](std::size_t s, const std::nothrow_t&) noexcept
+{ return cxx_alloc_nothrow(s, 0); }
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, std::size_t s) noexcept { sized_free(p, s); }
+void operator delete[](void* p, std::size_t s) noexcept { sized_free(p, s); }
+#endif
+
+#ifdef __cpp_aligned_new
+/* the sized variants free through the generic path: the backends round
+ * aligned requests differently from plain ones */
+void* operator new(std::size_t s, std::align_val_t a)
+{ return cxx_alloc(s, (std::size_t)a); }
+void* operator new[](std::size_t s, std::align_val_t a)
+{ return cxx_alloc(s, (std::size_t)a); }
+void* operator new(std::size_t s, std::align_val_t a,
+                   const std::nothrow_t&) noexcept
+{ return cxx_alloc_nothrow(s, (std::size_t)a); }
+void* operator new[](std::size_t s, std::align_val_t a,
+                     const std::nothrow_t&) noexcept
+{ return cxx_alloc_nothrow(s, (std::size_t)a); }
+
+void operator delete(void* p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept
+{ free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept
+{ free(p); }
+void operator delete(void* p, std::align_val_t,
+                     const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, std::align_val_t,
+                       const std::nothrow_t&) noexcept { free(p); }
+#endif /* __cpp_aligned_new */
 /*****************************************************************************/
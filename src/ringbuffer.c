@@ -1,7 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 #include "ringbuffer.h"
+#include "heaplog.h"
+#include "tsc.h"
 
 /*
 As the mutex lock is stored in global (static) memory it can be 
@@ -9,75 +24,1035 @@ As the mutex lock is stored in global (static) memory it can be
     If we had allocated space for the mutex on the heap, 
     then we would have used pthread_mutex_init(ptr, NULL)
 */
-FILE              *log_file;
+static int log_fd = -1;
+static struct heaplog_shm *shm_log = NULL;     /* MALLOC_COUNT_LOG_SHM */
+static size_t shm_log_len;
+static char *shm_records;
+static struct heaplog_header log_header;        /* of the heap.log file */
+static uint8_t log_block[HEAPLOG_BLOCK_SIZE];   /* MALLOC_COUNT_LOG_FORMAT */
+static uint8_t log_work[4 * HEAPLOG_BLOCK_SIZE];/* its records, every field */
+static uint8_t *log_block_pos;                  /* in log_work, NULL: raw */
+static uint64_t log_prev[HEAPLOG_MAX_FIELDS];   /* for the deltas */
+static uint32_t log_const_mask;                 /* fields unchanged so far */
+static uint32_t log_field_bytes[HEAPLOG_MAX_FIELDS]; /* encoded, per field */
+static uint32_t log_first_bytes[HEAPLOG_MAX_FIELDS]; /* of the first record */
+static size_t log_block_bytes;                  /* once constants are moved */
+static uint64_t log_block_first;                /* record number and time */
+static double log_block_time;                   /* of the block's first */
+static uint64_t log_records_written;            /* to the file(s) */
+static uint64_t log_segment_limit;              /* bytes, 0: one file */
+static uint32_t log_segment;                    /* number of the open one */
+static uint64_t log_segment_bytes;              /* written to it */
+static int log_index_fd = -1;                   /* heap.log.idx */
+static uint64_t log_next_index;                 /* record of the next entry */
 bool reader_end_flag = false;
 
-void rb_init(struct ringbuffer *rb)
+static volatile int rings_lock = 0;
+static pthread_mutex_t shared_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static bool ring_key_valid = false;
+static __thread struct rb_thread_ring *tls_ring = NULL;
+
+/* reader state of rb_write_log() */
+static struct ringbuff_cell out_cells[RB_LOG_BATCH];
+static uint64_t out_keys[RB_LOG_BATCH];
+static uint32_t merge_heap[RB_MAX_RINGS];       /* rings by key of next record */
+static uint32_t merge_head[RB_MAX_RINGS];       /* heads seen this round */
+static uint64_t merge_key[RB_MAX_RINGS];        /* key a ring is placed by */
+static uint32_t last_heap_size;                 /* of the last record written */
+
+/* writes all of iov, retrying on short writes */
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
 {
-    rb->writer_idx = 0;
-    rb->reader_idx = 0;
-    rb->cell_nums = 0;
-    log_file = fopen(FILE_NAME,"w");
-    setvbuf(log_file, NULL, _IONBF, 0);
-    reader_end_flag = false;
+        while (iovcnt > 0) {
+                ssize_t n = writev(fd, iov, iovcnt);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+                        n -= iov->iov_len;
+                        ++iov;
+                        --iovcnt;
+                }
+                if (iovcnt > 0) {
+                        iov->iov_base = (char *)iov->iov_base + n;
+                        iov->iov_len -= n;
+                }
+        }
+        return 0;
 }
 
-void rb_deinit(struct ringbuffer *rb)
+#define ADD_FIELD(h, member, t) do { \
+        struct heaplog_field *f = &(h)->fields[(h)->num_fields++]; \
+        strncpy(f->name, #member, HEAPLOG_NAME_LEN - 1); \
+        f->offset = offsetof(struct ringbuff_cell, member); \
+        f->type = (t); \
+} while (0)
+
+static void fill_log_header(struct heaplog_header *h, const char *backend)
+{
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, HEAPLOG_MAGIC, sizeof(HEAPLOG_MAGIC));
+        h->version = HEAPLOG_VERSION;
+        h->header_size = sizeof(*h);
+        h->record_size = sizeof(struct ringbuff_cell);
+        strncpy(h->backend, backend, HEAPLOG_NAME_LEN - 1);
+        strncpy(h->clock, "tsc_s", HEAPLOG_NAME_LEN - 1);
+        h->ticks_per_ns = tsc_ticks_per_ns;
+        h->base_tsc = tsc_base;
+        h->base_monotonic_ns = tsc_base_ns;
+        /* timestamp and heap size first, as memprofile.gnuplot expects */
+        ADD_FIELD(h, timestamp, HEAPLOG_F64);
+        ADD_FIELD(h, curr_heap_size, HEAPLOG_U32);
+#if PROPRIETARY_LOGGING
+        ADD_FIELD(h, curr_frag_size, HEAPLOG_F64);
+        ADD_FIELD(h, alloc_time, HEAPLOG_F64);
+        ADD_FIELD(h, time_interval, HEAPLOG_F64);
+#endif
+        ADD_FIELD(h, alloc_size, HEAPLOG_U32);
+        ADD_FIELD(h, weight, HEAPLOG_F32);
+        ADD_FIELD(h, lost, HEAPLOG_U32);
+#if MALLOC_COUNT_LOG_INTERVAL
+        ADD_FIELD(h, heap_min, HEAPLOG_U32);
+        ADD_FIELD(h, heap_max, HEAPLOG_U32);
+        ADD_FIELD(h, frees, HEAPLOG_U32);
+        ADD_FIELD(h, alloc_us, HEAPLOG_F32);
+        ADD_FIELD(h, alloc_bytes, HEAPLOG_U64);
+        ADD_FIELD(h, free_bytes, HEAPLOG_U64);
+#endif
+}
+
+/* MALLOC_COUNT_LOG_SHM: maps a fresh segment of
+ * MALLOC_COUNT_LOG_SHM_RECORDS records (default SHM_LOG_RECORDS), see
+ * heaplog.h. Returns 0 on success. */
+#define SHM_LOG_RECORDS (1UL << 20)
+#define SHM_LOG_MIN_RECORDS (1UL << 12)
+
+static int open_shm_log(const char *name, const char *backend)
+{
+        const char *recs = getenv("MALLOC_COUNT_LOG_SHM_RECORDS");
+        unsigned long long want = SHM_LOG_RECORDS;
+        uint64_t cap;
+        size_t hdr, len;
+        char path[256];
+        void *p;
+        int fd;
+
+        if (recs && *recs)
+                want = strtoull(recs, NULL, 0);
+        for (cap = SHM_LOG_MIN_RECORDS; cap < want; cap <<= 1)
+                ;
+        snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+        hdr = (sizeof(struct heaplog_shm) + 4095) & ~(size_t)4095;
+        len = hdr + cap * sizeof(struct ringbuff_cell);
+
+        /* monitors still attached to the last run keep their segment */
+        shm_unlink(path);
+        fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 || ftruncate(fd, len) < 0) {
+                perror(path);
+                if (fd >= 0)
+                        close(fd);
+                return -1;
+        }
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+                perror(path);
+                return -1;
+        }
+        shm_log = (struct heaplog_shm *)p;
+        shm_log_len = len;
+        shm_records = (char *)p + hdr;
+        fill_log_header(&shm_log->log, backend);
+        shm_log->version = HEAPLOG_SHM_VERSION;
+        shm_log->header_size = hdr;
+        shm_log->capacity = cap;
+        /* readers check the magic last */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(shm_log->magic, HEAPLOG_SHM_MAGIC, sizeof(HEAPLOG_SHM_MAGIC));
+        printf("Heap log goes to shared memory %s, %llu records\n", path,
+               (unsigned long long)cap);
+        return 0;
+}
+
+/* minimum of MALLOC_COUNT_LOG_SEGMENT_MB */
+#define LOG_MIN_SEGMENT (1UL << 20)
+
+/* closes the open file, with the current calibration in its header */
+static void close_segment(void)
+{
+        if (log_fd < 0)
+                return;
+        log_header.ticks_per_ns = tsc_ticks_per_ns;
+        if (pwrite(log_fd, &log_header, sizeof(log_header), 0) !=
+            (ssize_t)sizeof(log_header))
+                perror("heap log header");
+        close(log_fd);
+        log_fd = -1;
+}
+
+/* opens heap.log, or segment n of it, and writes the header */
+static void open_segment(uint32_t n)
+{
+        char name[sizeof(FILE_NAME) + 16];
+        struct iovec iov;
+
+        if (log_segment_limit)
+                snprintf(name, sizeof(name), HEAPLOG_SEGMENT_FORMAT, FILE_NAME,
+                         n);
+        else
+                snprintf(name, sizeof(name), "%s", FILE_NAME);
+        log_segment = n;
+        log_segment_bytes = sizeof(log_header);
+        log_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log_fd < 0) {
+                perror(name);
+                return;
+        }
+        log_header.ticks_per_ns = tsc_ticks_per_ns;
+        iov.iov_base = &log_header;
+        iov.iov_len = sizeof(log_header);
+        if (writev_all(log_fd, &iov, 1) < 0)
+                perror("heap log header");
+}
+
+/* MALLOC_COUNT_LOG_SEGMENT_MB: removes what the last run left and creates
+ * the index, see heaplog.h */
+static void open_index(void)
+{
+        struct heaplog_index_header ih;
+        char name[sizeof(FILE_NAME) + 16];
+        struct iovec iov;
+        uint32_t n;
+
+        unlink(FILE_NAME);
+        for (n = 0; ; ++n) {
+                snprintf(name, sizeof(name), HEAPLOG_SEGMENT_FORMAT, FILE_NAME,
+                         n);
+                if (unlink(name) < 0)
+                        break;
+        }
+        snprintf(name, sizeof(name), "%s" HEAPLOG_INDEX_SUFFIX, FILE_NAME);
+        log_index_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log_index_fd < 0) {
+                perror(name);
+                return;
+        }
+        memset(&ih, 0, sizeof(ih));
+        memcpy(ih.magic, HEAPLOG_INDEX_MAGIC, sizeof(HEAPLOG_INDEX_MAGIC));
+        ih.version = HEAPLOG_INDEX_VERSION;
+        ih.entry_size = sizeof(struct heaplog_index_entry);
+        iov.iov_base = &ih;
+        iov.iov_len = sizeof(ih);
+        if (writev_all(log_index_fd, &iov, 1) < 0)
+                perror(name);
+}
+
+/* Writes len bytes holding whole records or blocks, the first being record
+ * number first with timestamp time. Starts the next segment if they do not
+ * fit into this one, and adds an index entry when one is due. */
+static void log_write(const void *buf, size_t len, uint64_t first, double time)
+{
+        struct iovec iov;
+
+        if (log_segment_limit && log_segment_bytes + len > log_segment_limit &&
+            log_segment_bytes > sizeof(log_header)) {
+                close_segment();
+                open_segment(log_segment + 1);
+        }
+        if (log_fd < 0)
+                return;
+        if (log_index_fd >= 0 && (first >= log_next_index ||
+                                  log_segment_bytes == sizeof(log_header))) {
+                struct heaplog_index_entry e;
+                memset(&e, 0, sizeof(e));
+                e.segment = log_segment;
+                e.offset = log_segment_bytes;
+                e.first_record = first;
+                e.first_time = time;
+                iov.iov_base = &e;
+                iov.iov_len = sizeof(e);
+                if (writev_all(log_index_fd, &iov, 1) < 0) {
+                        perror("heap log index");
+                        close(log_index_fd);
+                        log_index_fd = -1;
+                }
+                log_next_index = first + HEAPLOG_INDEX_RECORDS;
+        }
+        iov.iov_base = (void *)buf;
+        iov.iov_len = len;
+        if (writev_all(log_fd, &iov, 1) < 0) {
+                perror(FILE_NAME);
+                close(log_fd);
+                log_fd = -1;
+        }
+        log_segment_bytes += len;
+}
+
+static void open_log(const char *backend)
+{
+        const char *shm = getenv("MALLOC_COUNT_LOG_SHM");
+        const char *format = getenv("MALLOC_COUNT_LOG_FORMAT");
+        const char *segment = getenv("MALLOC_COUNT_LOG_SEGMENT_MB");
+        struct heaplog_header *h = &log_header;
+        char name[sizeof(FILE_NAME) + 16];
+
+        if (shm && *shm) {
+                open_shm_log(shm, backend);
+                return;
+        }
+        fill_log_header(h, backend);
+        log_block_pos = NULL;
+        if (format && strcmp(format, "compact") == 0) {
+                /* the timestamps are ticks of the record keys */
+                h->encoding = HEAPLOG_ENC_BLOCKS;
+                h->block_size = HEAPLOG_BLOCK_SIZE;
+                log_block_pos = log_work;
+                memset(log_prev, 0, sizeof(log_prev));
+                ((struct heaplog_block *)log_block)->num_records = 0;
+        } else if (format && *format && strcmp(format, "raw") != 0) {
+                fprintf(stderr, "heap log: unknown format %s, writing raw "
+                        "records\n", format);
+        }
+        log_records_written = 0;
+        log_next_index = 0;
+        log_segment_limit = 0;
+        if (segment && *segment)
+                log_segment_limit = strtoull(segment, NULL, 0) << 20;
+        if (log_segment_limit) {
+                if (log_segment_limit < LOG_MIN_SEGMENT)
+                        log_segment_limit = LOG_MIN_SEGMENT;
+                open_index();
+                printf("Heap log goes to segments of %llu MiB, %s.idx\n",
+                       (unsigned long long)(log_segment_limit >> 20),
+                       FILE_NAME);
+        } else {
+                /* a stale index would point into a segmented earlier run */
+                snprintf(name, sizeof(name), "%s" HEAPLOG_INDEX_SUFFIX,
+                         FILE_NAME);
+                unlink(name);
+        }
+        open_segment(0);
+}
+
+/* appends n records to the shared-memory ring, see heaplog.h */
+static void shm_log_append(const struct ringbuff_cell *c, uint32_t n)
 {
-        fflush(log_file);
-        fclose(log_file);
+        uint64_t w = shm_log->write_end, cap = shm_log->capacity;
+        struct ringbuff_cell *ring = (struct ringbuff_cell *)shm_records;
+
+        if (n > cap) {
+                w += n - cap;
+                c += n - cap;
+                n = cap;
+        }
+        __atomic_store_n(&shm_log->write_begin, w + n, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        while (n) {
+                uint64_t i = w & (cap - 1);
+                uint32_t k = (n < cap - i) ? n : cap - i;
+                memcpy(&ring[i], c, k * sizeof(*c));
+                w += k;
+                c += k;
+                n -= k;
+        }
+        __atomic_store_n(&shm_log->write_end, w, __ATOMIC_RELEASE);
+}
+
+/* length of the varint at p */
+static size_t varint_len(const uint8_t *p)
+{
+        size_t n = 1;
+        while (*p++ & 0x80)
+                ++n;
+        return n;
+}
+
+/* writes the current block, padded to its full size, and starts the next.
+ * The records in log_work hold every field; the fields in log_const_mask
+ * move to the block header here. */
+static void flush_block(void)
+{
+        const struct heaplog_header *h = &log_header;
+        struct heaplog_block *b = (struct heaplog_block *)log_block;
+        uint8_t *data = log_block + sizeof(*b), *out = data;
+        const uint8_t *in;
+        uint32_t i, f;
+        size_t len;
+
+        if (b->num_records == 0)
+                return;
+        /* the values of the constant fields, from the first record */
+        for (in = log_work, f = 0; f < h->num_fields; ++f, in += len) {
+                len = varint_len(in);
+                if (log_const_mask & (1u << f)) {
+                        memcpy(out, in, len);
+                        out += len;
+                }
+        }
+        for (in = log_work, i = 0; i < b->num_records; ++i) {
+                for (f = 0; f < h->num_fields; ++f, in += len) {
+                        len = varint_len(in);
+                        if (!(log_const_mask & (1u << f))) {
+                                memcpy(out, in, len);
+                                out += len;
+                        }
+                }
+        }
+        memcpy(b->magic, HEAPLOG_BLOCK_MAGIC, sizeof(b->magic));
+        b->bytes = out - data;
+        b->const_mask = log_const_mask;
+        memset(out, 0, log_block + sizeof(log_block) - out);
+        log_write(log_block, sizeof(log_block), log_block_first,
+                  log_block_time);
+        b->num_records = 0;
+        log_block_pos = log_work;
+        memset(log_prev, 0, sizeof(log_prev));
+}
+
+/* appends n records to the current block in the format of heaplog.h */
+static void encode_records(const struct ringbuff_cell *c,
+                           const uint64_t *keys, uint32_t n)
+{
+        const struct heaplog_header *h = &log_header;
+        struct heaplog_block *b = (struct heaplog_block *)log_block;
+        size_t max = h->num_fields * HEAPLOG_VARINT_MAX;
+        uint64_t vals[HEAPLOG_MAX_FIELDS];
+        uint32_t lens[HEAPLOG_MAX_FIELDS];
+        uint32_t i, f;
+
+        for (i = 0; i < n; ++i) {
+                const char *rec = (const char *)&c[i];
+                uint32_t changed;
+                size_t grow;
+                uint8_t *p;
+
+                if ((size_t)(log_work + sizeof(log_work) - log_block_pos) <
+                    max || b->num_records == HEAPLOG_BLOCK_SIZE)
+                        flush_block();
+again:
+                p = log_block_pos;
+                changed = 0;
+                for (f = 0; f < h->num_fields; ++f) {
+                        const struct heaplog_field *fd = &h->fields[f];
+                        uint64_t v = 0, u;
+                        uint8_t *q = p;
+
+                        if (f == 0)     /* timestamp, see fill_log_header() */
+                                v = keys[i] - tsc_base;
+                        else if (fd->type == HEAPLOG_U32 ||
+                                 fd->type == HEAPLOG_F32)
+                                memcpy(&v, rec + fd->offset, sizeof(uint32_t));
+                        else
+                                memcpy(&v, rec + fd->offset, sizeof(uint64_t));
+                        if (f == 0 || fd->type == HEAPLOG_U32 ||
+                            fd->type == HEAPLOG_U64)
+                                u = heaplog_zigzag((int64_t)(v - log_prev[f]));
+                        else
+                                u = v ^ log_prev[f];
+                        p = heaplog_put_varint(p, u);
+                        lens[f] = p - q;
+                        vals[f] = v;
+                        if (u)
+                                changed |= 1u << f;
+                }
+                /* size of the block with this record, counting a field that
+                 * stops being constant with all of its earlier deltas */
+                grow = 0;
+                for (f = 0; f < h->num_fields; ++f) {
+                        if (b->num_records == 0)
+                                grow += lens[f];
+                        else if (!(log_const_mask & (1u << f)))
+                                grow += lens[f];
+                        else if (changed & (1u << f))
+                                grow += log_field_bytes[f] -
+                                        log_first_bytes[f] + lens[f];
+                }
+                if (b->num_records &&
+                    sizeof(*b) + log_block_bytes + grow > sizeof(log_block)) {
+                        flush_block();
+                        goto again;
+                }
+                if (b->num_records == 0) {
+                        log_block_first = log_records_written;
+                        log_block_time = c[i].timestamp;
+                        log_const_mask = (1u << h->num_fields) - 1;
+                        log_block_bytes = 0;
+                        memcpy(log_first_bytes, lens, sizeof(lens));
+                        memset(log_field_bytes, 0, sizeof(log_field_bytes));
+                } else {
+                        log_const_mask &= ~changed;
+                }
+                for (f = 0; f < h->num_fields; ++f) {
+                        log_field_bytes[f] += lens[f];
+                        log_prev[f] = vals[f];
+                }
+                log_block_bytes += grow;
+                log_block_pos = p;
+                ++b->num_records;
+                ++log_records_written;
+        }
 }
 
-INLINE void rb_put(struct ringbuffer *rb, void *value)
+/* keys are the ring keys of the records, used by the compact format */
+static void log_records(const struct ringbuff_cell *c, const uint64_t *keys,
+                        uint32_t n)
 {
-        while(__sync_bool_compare_and_swap(&rb->cell_nums, NUM_OF_CELL, NUM_OF_CELL));
-        __sync_fetch_and_add(&rb->writer_idx, 1);
-        rb->cell[RB_CELL_IDX(rb->writer_idx)] = *(struct ringbuff_cell *)value;
-        __sync_add_and_fetch(&rb->cell_nums, 1);
+        if (shm_log) {
+                shm_log_append(c, n);
+                return;
+        }
+        if (log_block_pos) {
+                encode_records(c, keys, n);
+                return;
+        }
+        while (n) {
+                uint32_t k = n;
+                /* split where the segment is full */
+                if (log_segment_limit) {
+                        uint64_t room = 0;
+                        if (log_segment_bytes < log_segment_limit)
+                                room = (log_segment_limit - log_segment_bytes) /
+                                       sizeof(*c);
+                        if (room == 0)
+                                room = (log_segment_limit -
+                                        sizeof(log_header)) / sizeof(*c);
+                        if (k > room)
+                                k = room;
+                }
+                log_write(c, k * sizeof(*c), log_records_written,
+                          c->timestamp);
+                log_records_written += k;
+                c += k;
+                n -= k;
+        }
 }
 
-INLINE void rb_get(struct ringbuffer *rb, void *value)
+static void close_log(void)
 {
-        
-        while(__sync_bool_compare_and_swap(&rb->cell_nums, 0, 0));
-        __sync_fetch_and_add(&rb->reader_idx, 1);
+        if (shm_log) {
+                shm_log->log.ticks_per_ns = tsc_ticks_per_ns;
+                __atomic_store_n(&shm_log->closed, 1, __ATOMIC_RELEASE);
+                munmap(shm_log, shm_log_len);
+                shm_log = NULL;
+        }
+        if (log_block_pos) {
+                flush_block();
+                log_block_pos = NULL;
+        }
+        /* the final calibration, for offline conversion */
+        close_segment();
+        if (log_index_fd >= 0) {
+                close(log_index_fd);
+                log_index_fd = -1;
+        }
+}
 
-#if 0 //Add your logging method
-        fwrite(&rb->cell[RB_CELL_IDX(rb->reader_idx)], 
-                sizeof(struct ringbuff_cell), 1, log_file);
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+        __asm__ __volatile__("pause" ::: "memory");
 #else
-        fprintf(log_file, "%d\n", rb->cell[RB_CELL_IDX(rb->reader_idx)].curr_heap_size);
+        __asm__ __volatile__("" ::: "memory");
 #endif
-        __sync_sub_and_fetch(&rb->cell_nums, 1);
 }
 
+/* pthread key destructor: give the ring of an exiting thread back */
+static void release_ring(void *arg)
+{
+        struct rb_thread_ring *r = (struct rb_thread_ring *)arg;
+
+        __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+        tls_ring = NULL;
+}
 
-void clock_get_hw_time(struct timespec *ts)
+static const char *overflow_name[] = { "block", "drop", "overwrite",
+                                       "sample" };
+
+#define RB_HUGE_PAGE    (2UL << 20)
+#define RB_FULL_SPINS   100     /* polls of a full ring before sleeping */
+
+/* maps a ring of rb->cells records; NULL if there is no memory */
+static struct rb_thread_ring *map_ring(struct ringbuffer *rb)
 {
-#ifdef __MACH__
-    clock_serv_t cclock;
-    mach_timespec_t mts;
-    kern_return_t ret_val;
-    if ((ret_val = host_get_clock_service(mach_host_self(),
-                                          SYSTEM_CLOCK, &cclock) != KERN_SUCCESS))
-        goto ret;
+        size_t hdr = (sizeof(struct rb_thread_ring) + RB_CACHE_LINE - 1) &
+                     ~(size_t)(RB_CACHE_LINE - 1);
+        size_t len = hdr + (size_t)rb->cells *
+                     (sizeof(uint64_t) + sizeof(struct ringbuff_cell));
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        bool touch = rb->prefault;
+        void *p = MAP_FAILED;
+        struct rb_thread_ring *r;
+
+#ifdef MAP_POPULATE
+        if (rb->prefault) {
+                flags |= MAP_POPULATE;
+                touch = false;
+        }
+#endif
+#ifdef MAP_HUGETLB
+        if (rb->hugepages)
+                p = mmap(NULL, (len + RB_HUGE_PAGE - 1) & ~(RB_HUGE_PAGE - 1),
+                         PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+#endif
+        if (p == MAP_FAILED) {
+                /* no reserved huge pages: ask for transparent ones, which
+                 * must happen before the pages are faulted in */
+#ifdef MAP_POPULATE
+                if (rb->hugepages) {
+                        touch = rb->prefault;
+                        flags &= ~MAP_POPULATE;
+                }
+#endif
+                p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+                if (p == MAP_FAILED) {
+                        perror("heap log ring");
+                        return NULL;
+                }
+#ifdef MADV_HUGEPAGE
+                if (rb->hugepages)
+                        madvise(p, len, MADV_HUGEPAGE);
+#endif
+        }
+        if (touch)
+                memset(p, 0, len);
+
+        r = (struct rb_thread_ring *)p;
+        r->key = (uint64_t *)((char *)p + hdr);
+        r->cell = (struct ringbuff_cell *)(r->key + rb->cells);
+        return r;
+}
+
+/* Reads the ring options and maps ring 0 on first use, which may come before
+ * rb_init(). Must hold rings_lock. */
+static void setup_rings(struct ringbuffer *rb)
+{
+        const char *cells, *huge, *prefault, *overflow;
+        unsigned long long want = RB_THREAD_CELLS;
+        uint32_t n;
+
+        if (rb->cells)
+                return;
+        cells = getenv("MALLOC_COUNT_RING_CELLS");
+        huge = getenv("MALLOC_COUNT_RING_HUGEPAGES");
+        prefault = getenv("MALLOC_COUNT_RING_PREFAULT");
+        overflow = getenv("MALLOC_COUNT_RING_OVERFLOW");
+        if (cells && *cells)
+                want = strtoull(cells, NULL, 0);
+        if (want > RB_MAX_CELLS)
+                want = RB_MAX_CELLS;
+        for (n = RB_MIN_CELLS; n < want; n <<= 1)
+                ;
+        rb->mask = n - 1;
+        rb->cells = n;
+        rb->hugepages = huge && atoi(huge) != 0;
+        rb->prefault = prefault && atoi(prefault) != 0;
+        rb->overflow = RB_BLOCK;
+        if (overflow && strcmp(overflow, "drop") == 0)
+                rb->overflow = RB_DROP;
+        else if (overflow && strcmp(overflow, "overwrite") == 0)
+                rb->overflow = RB_OVERWRITE;
+        else if (overflow && strcmp(overflow, "sample") == 0)
+                rb->overflow = RB_SAMPLE;
+        else if (overflow && *overflow && strcmp(overflow, "block") != 0)
+                fprintf(stderr, "heap log: unknown overflow policy %s, "
+                        "using block\n", overflow);
 
-    ret_val = clock_get_time(cclock, &mts);
-    mach_port_deallocate(mach_task_self(), cclock);
-    ts->tv_sec = mts.tv_sec;
-    ts->tv_nsec = mts.tv_nsec;
-ret:
-    return;
+        if ((rb->ring[0] = map_ring(rb)) != NULL)
+                __atomic_store_n(&rb->num_rings, 1, __ATOMIC_RELEASE);
+}
+
+static void rings_lock_acquire(void)
+{
+        while (__sync_lock_test_and_set(&rings_lock, 1))
+                cpu_relax();
+}
+
+/* Claims a free ring for the calling thread, maps a new one if there is
+ * none. Threads left without one share ring 0; NULL if even that failed. */
+static struct rb_thread_ring *acquire_ring(struct ringbuffer *rb)
+{
+        struct rb_thread_ring *r = NULL;
+        uint32_t i, n;
+
+        rings_lock_acquire();
+        setup_rings(rb);
+        n = rb->num_rings;
+        for (i = 1; i < n && !r; ++i)
+                if (__sync_bool_compare_and_swap(&rb->ring[i]->in_use, 0, 1))
+                        r = rb->ring[i];
+        if (!r && n > 0 && n < RB_MAX_RINGS && (r = map_ring(rb)) != NULL) {
+                r->in_use = 1;
+                rb->ring[n] = r;
+                __atomic_store_n(&rb->num_rings, n + 1, __ATOMIC_RELEASE);
+        }
+        __sync_lock_release(&rings_lock);
+
+        /* set before pthread_setspecific(), which may call malloc() */
+        tls_ring = r ? r : rb->ring[0];
+        if (r && ring_key_valid)
+                pthread_setspecific(ring_key, r);
+        return tls_ring;
+}
+
+void rb_init(struct ringbuffer *rb, const char *backend)
+{
+    rings_lock_acquire();
+    setup_rings(rb);
+    __sync_lock_release(&rings_lock);
+    if (rb->hugepages || rb->prefault || rb->cells != RB_THREAD_CELLS ||
+        rb->overflow != RB_BLOCK)
+        printf("Heap log rings of %u records%s%s, %s when full\n", rb->cells,
+               rb->hugepages ? ", huge pages" : "",
+               rb->prefault ? ", prefaulted" : "",
+               overflow_name[rb->overflow]);
+    ring_key_valid = (pthread_key_create(&ring_key, release_ring) == 0);
+    if (ring_key_valid && tls_ring && tls_ring != rb->ring[0])
+        pthread_setspecific(ring_key, tls_ring);
+    open_log(backend);
+    reader_end_flag = false;
+}
+
+/* Writes a record for each ring with dropped records or sampled weight that
+ * no later record carried: alloc_size 0, the heap size of the last record. */
+static void write_loss_records(struct ringbuffer *rb)
+{
+        struct ringbuff_cell c;
+        uint32_t i, n = __atomic_load_n(&rb->num_rings, __ATOMIC_ACQUIRE);
+        uint64_t key;
+
+        for (i = 0; i < n; ++i) {
+                struct rb_thread_ring *r = rb->ring[i];
+                if (!r->lost && !r->pending_weight)
+                        continue;
+                memset(&c, 0, sizeof(c));
+                c.curr_heap_size = last_heap_size;
+                key = tsc_now();
+                c.timestamp = tsc_elapsed_ns(key) / BILLION;
+                c.weight = r->pending_weight;
+                c.lost = r->lost;
+                rb->lost += c.lost;
+                r->lost = 0;
+                r->pending_weight = 0;
+                log_records(&c, &key, 1);
+                ++rb->written;
+        }
+}
+
+void rb_deinit(struct ringbuffer *rb)
+{
+        write_loss_records(rb);
+        close_log();
+}
+
+/* Sleeps until the reader takes records from the full ring r, whose tail was
+ * t. The timeout covers a reader which looked at waiting before it was set. */
+static void wait_for_space(struct ringbuffer *rb, struct rb_thread_ring *r,
+                           uint32_t t)
+{
+        __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+        rb_wake(rb);
+#ifdef __linux__
+        {
+                struct timespec ts = { 0, 1000000L };
+                syscall(SYS_futex, &r->tail, FUTEX_WAIT_PRIVATE, t, &ts,
+                        NULL, 0);
+        }
 #else
-  //clock_gettime(CLOCK_MONOTONIC_COARSE, ts);
-  clock_gettime(CLOCK_MONOTONIC, ts);
+        (void)t;
+        sched_yield();
 #endif
 }
 
-static struct timespec ts;
-INLINE double get_curr_time(void) 
+/* RB_SAMPLE: whether to keep a record of the given weight in ring r, which
+ * holds fill records. From half full on only every 2nd record is kept, from
+ * three quarters every 4th, and so on; the rest add their weight to the next
+ * kept one. */
+static bool sample_keep(struct ringbuffer *rb, struct rb_thread_ring *r,
+                        uint32_t fill, float weight)
+{
+        uint32_t level = 0, mark = rb->cells / 2;
+
+        while (fill >= mark && level < 16) {
+                ++level;
+                mark += (rb->cells - mark + 1) / 2;
+        }
+        if ((++r->sample_count & ((1u << level) - 1)) == 0)
+                return true;
+        r->pending_weight += weight;
+        return false;
+}
+
+void rb_put(struct ringbuffer *rb, void *value)
+{
+        struct rb_thread_ring *r = tls_ring;
+        struct ringbuff_cell *c;
+        uint32_t h, t;
+
+        if (__builtin_expect(r == NULL, 0) && (r = acquire_ring(rb)) == NULL)
+                return;
+        if (__builtin_expect(r == rb->ring[0], 0))
+                pthread_mutex_lock(&shared_ring_lock);
+
+        h = r->head;
+        t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (__builtin_expect(rb->overflow == RB_SAMPLE, 0) &&
+            h - t >= rb->cells / 2 &&
+            !sample_keep(rb, r, h - t, ((struct ringbuff_cell *)value)->weight))
+                goto out;
+        if (__builtin_expect(h - t >= rb->cells, 0)) {
+                unsigned spins = 0;
+
+                rb_wake(rb);
+                switch (rb->overflow) {
+                case RB_BLOCK:
+                        while (h - (t = __atomic_load_n(&r->tail,
+                                                        __ATOMIC_ACQUIRE)) >=
+                               rb->cells) {
+                                if (++spins < RB_FULL_SPINS)
+                                        cpu_relax();
+                                else
+                                        wait_for_space(rb, r, t);
+                        }
+                        break;
+                case RB_OVERWRITE:
+                        /* take the oldest record away from the reader, which
+                         * notices the gap when its own update of tail fails */
+                        while (h - t >= rb->cells &&
+                               !__atomic_compare_exchange_n(&r->tail, &t, t + 1,
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+                                ;
+                        break;
+                case RB_SAMPLE:
+                        r->pending_weight +=
+                                ((struct ringbuff_cell *)value)->weight;
+                        goto out;
+                default:
+                        ++r->lost;
+                        goto out;
+                }
+        }
+        /* full barrier: the reader either sees busy or a later key */
+        __atomic_exchange_n(&r->busy, 1, __ATOMIC_SEQ_CST);
+        r->key[RB_CELL_IDX(rb, h)] = tsc_begin();
+        c = &r->cell[RB_CELL_IDX(rb, h)];
+        *c = *(struct ringbuff_cell *)value;
+        c->lost = r->lost;
+        r->lost = 0;
+        if (__builtin_expect(r->pending_weight != 0, 0)) {
+                c->weight += r->pending_weight;
+                r->pending_weight = 0;
+        }
+        __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+
+        /* a wake lost to a reader parking right now costs at most its
+         * timeout, and the next put checks again */
+        if (__builtin_expect(h + 1 - t >= RB_WAKE_FILL(rb), 0))
+                rb_wake(rb);
+out:
+        if (__builtin_expect(r == rb->ring[0], 0))
+                pthread_mutex_unlock(&shared_ring_lock);
+}
+
+/* Parks the reader until a producer calls rb_wake() or timeout_ms passes. */
+void rb_wait(struct ringbuffer *rb, unsigned timeout_ms)
 {
-    
-    clock_get_hw_time(&ts);
-    return ts.tv_sec + (double)ts.tv_nsec/(double)BILLION;
-}
\ No newline at end of file
+        struct timespec ts;
+
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        __atomic_store_n(&rb->reader_parked, 1, __ATOMIC_SEQ_CST);
+        if (!reader_end_flag) {
+#ifdef __linux__
+                syscall(SYS_futex, &rb->reader_parked, FUTEX_WAIT_PRIVATE, 1,
+                        &ts, NULL, 0);
+#else
+                nanosleep(&ts, NULL);
+#endif
+        }
+        __atomic_store_n(&rb->reader_parked, 0, __ATOMIC_RELAXED);
+}
+
+void rb_wake(struct ringbuffer *rb)
+{
+        /* only the first producer to see the reader parked makes the call */
+        if (__atomic_load_n(&rb->reader_parked, __ATOMIC_RELAXED) &&
+            __sync_bool_compare_and_swap(&rb->reader_parked, 1, 0)) {
+#ifdef __linux__
+                syscall(SYS_futex, &rb->reader_parked, FUTEX_WAKE_PRIVATE, 1,
+                        NULL, NULL, 0);
+#endif
+        }
+}
+
+bool rb_empty(struct ringbuffer *rb)
+{
+        uint32_t i, n = __atomic_load_n(&rb->num_rings, __ATOMIC_ACQUIRE);
+
+        for (i = 0; i < n; ++i)
+                if (__atomic_load_n(&rb->ring[i]->head, __ATOMIC_ACQUIRE) !=
+                    rb->ring[i]->tail)
+                        return false;
+        return true;
+}
+
+uint64_t rb_records_put(struct ringbuffer *rb)
+{
+        uint32_t i, n = __atomic_load_n(&rb->num_rings, __ATOMIC_ACQUIRE);
+        uint64_t sum = 0;
+
+        for (i = 0; i < n; ++i)
+                sum += __atomic_load_n(&rb->ring[i]->head, __ATOMIC_RELAXED);
+        return sum;
+}
+
+static inline uint64_t next_key(struct ringbuffer *rb, uint32_t i)
+{
+        struct rb_thread_ring *r = rb->ring[i];
+        return r->key[RB_CELL_IDX(rb, __atomic_load_n(&r->tail,
+                                                      __ATOMIC_RELAXED))];
+}
+
+/* Restore the heap order of merge_heap[0..n) below position k. The heap is
+ * ordered by merge_key, not by the rings' current keys: an overwriting
+ * producer moves tail and with it the key of its ring, but only ever to a
+ * later one, so merge_key stays a lower bound and the top of the heap is
+ * the earliest record once its own key is checked. */
+static void merge_sift_down(uint32_t k, uint32_t n)
+{
+        uint32_t v = merge_heap[k];
+        uint64_t key = merge_key[v];
+
+        for (;;) {
+                uint32_t c = 2 * k + 1;
+                if (c >= n)
+                        break;
+                if (c + 1 < n &&
+                    merge_key[merge_heap[c + 1]] < merge_key[merge_heap[c]])
+                        ++c;
+                if (key <= merge_key[merge_heap[c]])
+                        break;
+                merge_heap[k] = merge_heap[c];
+                k = c;
+        }
+        merge_heap[k] = v;
+}
+
+/* Merges the thread rings by key and writes up to RB_LOG_BATCH records to
+ * the log with a single write. Records above the bound described in
+ * ringbuffer.h stay in their rings for the next call. Returns the number of
+ * records written, 0 if none was ready. */
+uint32_t rb_write_log(struct ringbuffer *rb)
+{
+        uint32_t i, n, nheap = 0, nout = 0;
+        uint64_t limit = UINT64_MAX, now;
+
+        n = __atomic_load_n(&rb->num_rings, __ATOMIC_ACQUIRE);
+        now = tsc_begin();
+        tsc_recalibrate(now);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        for (i = 0; i < n; ++i) {
+                struct rb_thread_ring *r = rb->ring[i];
+                /* busy is read first: a record published after it was seen
+                 * clear has a key above now */
+                bool busy = __atomic_load_n(&r->busy, __ATOMIC_ACQUIRE);
+                uint32_t h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+                uint32_t t = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+                uint64_t bound = now;
+
+                if (busy)
+                        bound = (h != t) ? r->key[RB_CELL_IDX(rb, h - 1)]
+                                         : r->last_key;
+                if (bound < limit)
+                        limit = bound;
+                merge_head[i] = h;
+                if (h != t) {
+                        merge_key[i] = rb->overflow != RB_OVERWRITE ?
+                                       r->key[RB_CELL_IDX(rb, t)] :
+                                       r->last_key;
+                        merge_heap[nheap++] = i;
+                }
+        }
+        for (i = nheap / 2; i-- > 0; )
+                merge_sift_down(i, nheap);
+
+        while (nheap && nout < RB_LOG_BATCH) {
+                uint32_t top = merge_heap[0];
+                struct rb_thread_ring *r = rb->ring[top];
+                struct ringbuff_cell *c = &out_cells[nout];
+                uint32_t t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+                uint64_t key;
+
+                /* an overwriting producer may have moved tail past what
+                 * was seen at the start of the round */
+                if ((int32_t)(merge_head[top] - t) <= 0) {
+                        merge_heap[0] = merge_heap[--nheap];
+                        if (nheap)
+                                merge_sift_down(0, nheap);
+                        continue;
+                }
+                key = r->key[RB_CELL_IDX(rb, t)];
+                if (key != merge_key[top]) {
+                        /* placed by a lower bound, or tail was moved by an
+                         * overwriting producer since. The key is only good
+                         * if tail did not move while it was read: a slot
+                         * taken by the producer gets a later key than the
+                         * ring's next record. */
+                        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                        if (__atomic_load_n(&r->tail, __ATOMIC_RELAXED) != t)
+                                continue;
+                        merge_key[top] = key;
+                        merge_sift_down(0, nheap);
+                        continue;
+                }
+                if (key > limit)
+                        break;
+                *c = r->cell[RB_CELL_IDX(rb, t)];
+                out_keys[nout] = key;
+                /* the copy is done, hand the cell back to the producer */
+                if (rb->overflow != RB_OVERWRITE) {
+                        __atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+                } else if (!__atomic_compare_exchange_n(&r->tail, &t, t + 1,
+                                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                        /* overwritten while it was copied; the check
+                         * above places the ring by its new key */
+                        continue;
+                }
+                c->lost += t - r->expect;
+                r->expect = t + 1;
+                rb->lost += c->lost;
+                c->timestamp = tsc_elapsed_ns(key) / BILLION;
+                ++nout;
+                r->last_key = key;
+                if (t + 1 == merge_head[top])
+                        merge_heap[0] = merge_heap[--nheap];
+                else if (rb->overflow != RB_OVERWRITE)
+                        merge_key[top] = next_key(rb, top);
+                else
+                        merge_key[top] = key;   /* checked when on top */
+                if (nheap)
+                        merge_sift_down(0, nheap);
+        }
+        for (i = 0; i < n; ++i) {
+                struct rb_thread_ring *r = rb->ring[i];
+                if (__atomic_load_n(&r->waiting, __ATOMIC_RELAXED)) {
+                        __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+#ifdef __linux__
+                        syscall(SYS_futex, &r->tail, FUTEX_WAKE_PRIVATE,
+                                INT_MAX, NULL, NULL, 0);
+#endif
+                }
+        }
+        if (nout == 0)
+                return 0;
+
+        last_heap_size = out_cells[nout - 1].curr_heap_size;
+        log_records(out_cells, out_keys, nout);
+        rb->written += nout;
+        return nout;
+}
+
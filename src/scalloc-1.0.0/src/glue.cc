@@ -128,6 +128,16 @@ void* scalloc_realloc(void* ptr, size_t size) __THROW {
 }
 
 
+size_t scalloc_malloc_usable_size(void* p) __THROW {
+  return scalloc::malloc_usable_size(p);
+}
+
+
+size_t scalloc_good_size(size_t size) __THROW {
+  return scalloc::good_size(size);
+}
+
+
 void* scalloc_memalign(size_t __alignment, size_t __size) __THROW {
   return scalloc::memalign(__alignment, __size);
 }
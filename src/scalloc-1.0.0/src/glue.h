@@ -99,6 +99,37 @@ always_inline void* realloc(void* ptr, size_t size) {
 }
 
 
+always_inline size_t malloc_usable_size(void* p) {
+  if (UNLIKELY(p == NULL)) {
+    return 0;
+  }
+  if (LIKELY(object_space.Contains(p))) {
+    Span* s = Span::FromObject(p);
+    size_t size = ClassToSize[s->size_class()];
+    if (UNLIKELY(seen_memalign != 0)) {
+      // Aligned objects start somewhere inside their block.
+      size -= reinterpret_cast<uintptr_t>(p) -
+              reinterpret_cast<uintptr_t>(s->AlignToBlockStart(p));
+    }
+    return size;
+  }
+  return LargeObject::PayloadSize(p);
+}
+
+
+// Usable size of the block malloc(size) returns, computed from the size alone.
+always_inline size_t good_size(size_t size) {
+  const size_t sc = SizeToClass(size);
+  if (LIKELY(sc != 0)) {
+    return ClassToSize[sc];
+  }
+  if (UNLIKELY(size == 0)) {
+    return 0;
+  }
+  return PadSize(size + sizeof(LargeObject), kPageSize) - sizeof(LargeObject);
+}
+
+
 always_inline int posix_memalign(void** ptr, size_t align, size_t size) {
   LOG(kTrace, "posix memalign: size: %lu", size);
   if (seen_memalign == 0) {
@@ -23,6 +23,8 @@ extern "C" {
   void cfree(void* p) __THROW                       ALIAS(scalloc_free);
   void* calloc(size_t nmemb, size_t size) __THROW   ALIAS(scalloc_calloc);
   void* realloc(void* ptr, size_t size) __THROW     ALIAS(scalloc_realloc);
+  size_t malloc_usable_size(void* p) __THROW
+      ALIAS(scalloc_malloc_usable_size);
   void* memalign(size_t __alignment, size_t __size) __THROW
       ALIAS(scalloc_memalign);
   void* aligned_alloc(size_t alignment, size_t size) __THROW
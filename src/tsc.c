@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <time.h>
+#include "tsc.h"
+
+#define BILLION 1000000000L
+
+/* length of the calibration interval */
+#define TSC_CALIBRATE_NS        (10 * 1000 * 1000)
+/* interval of tsc_recalibrate(), and the time an error is slewed over */
+#define TSC_RECALIBRATE_NS      (1000 * 1000 * 1000)
+/* largest slew, a fraction of the rate; keeps tsc_elapsed_ns() rising */
+#define TSC_MAX_SLEW            0.001
+
+double tsc_ticks_per_ns = 1.0;
+uint64_t tsc_overhead = 0;
+uint64_t tsc_base = 0;
+int64_t tsc_base_ns = 0;
+
+/* tsc_elapsed_ns() is anchor_ns + (ticks - anchor) * ns_per_tick */
+static uint64_t anchor;
+static double anchor_ns;
+static double ns_per_tick = 1.0;
+static uint64_t next_recalibration;
+
+static int64_t monotonic_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+/* reads the counter and the clock as close together as it can, the tick
+ * count being the middle of the clock read */
+static void read_pair(uint64_t *ticks, int64_t *ns)
+{
+        uint64_t best = UINT64_MAX;
+        int i;
+
+        for (i = 0; i < 5; ++i) {
+                uint64_t t0 = tsc_now();
+                int64_t n = monotonic_ns();
+                uint64_t t1 = tsc_now();
+                if (t1 - t0 < best) {
+                        best = t1 - t0;
+                        *ticks = t0 + (t1 - t0) / 2;
+                        *ns = n;
+                }
+        }
+}
+
+/* Measures the tick rate against CLOCK_MONOTONIC over a short busy wait and
+ * the cost of an empty measurement, which callers subtract from their
+ * samples. */
+void tsc_calibrate(void)
+{
+        int64_t ns0, ns1;
+        uint64_t t0, t1;
+        int i;
+
+        read_pair(&t0, &ns0);
+        do {
+                ns1 = monotonic_ns();
+        } while (ns1 - ns0 < TSC_CALIBRATE_NS);
+        read_pair(&t1, &ns1);
+        tsc_ticks_per_ns = (double)(t1 - t0) / (double)(ns1 - ns0);
+        tsc_base = t1;
+        tsc_base_ns = ns1;
+        anchor = t1;
+        anchor_ns = 0;
+        ns_per_tick = 1.0 / tsc_ticks_per_ns;
+        next_recalibration = t1 + (uint64_t)(TSC_RECALIBRATE_NS *
+                                             tsc_ticks_per_ns);
+
+        tsc_overhead = UINT64_MAX;
+        for (i = 0; i < 1000; ++i) {
+                uint64_t b = tsc_begin();
+                uint64_t e = tsc_end();
+                if (e - b < tsc_overhead)
+                        tsc_overhead = e - b;
+        }
+}
+
+/* Once a TSC_RECALIBRATE_NS interval has passed since the last call, sets
+ * the rate to that of the run so far and steers tsc_elapsed_ns() towards
+ * CLOCK_MONOTONIC over the next interval. now is a recent tsc_now(). */
+void tsc_recalibrate(uint64_t now)
+{
+        uint64_t t;
+        int64_t ns;
+        double rate, err, slew;
+
+        if ((int64_t)(now - next_recalibration) < 0)
+                return;
+        read_pair(&t, &ns);
+        if (ns <= tsc_base_ns || t <= tsc_base)
+                return;
+        rate = (double)(t - tsc_base) / (double)(ns - tsc_base_ns);
+        __atomic_store(&tsc_ticks_per_ns, &rate, __ATOMIC_RELAXED);
+
+        /* continue from where the old rate got to, then drift to the clock */
+        anchor_ns = tsc_elapsed_ns(t);
+        anchor = t;
+        err = anchor_ns - (double)(ns - tsc_base_ns);
+        slew = err / TSC_RECALIBRATE_NS;
+        if (slew > TSC_MAX_SLEW)
+                slew = TSC_MAX_SLEW;
+        if (slew < -TSC_MAX_SLEW)
+                slew = -TSC_MAX_SLEW;
+        ns_per_tick = (1.0 - slew) / rate;
+        next_recalibration = t + (uint64_t)(TSC_RECALIBRATE_NS * rate);
+}
+
+/* nanoseconds from tsc_base to ticks */
+double tsc_elapsed_ns(uint64_t ticks)
+{
+        return anchor_ns + (double)(int64_t)(ticks - anchor) * ns_per_tick;
+}
@@ -0,0 +1,106 @@
+/*
+ * alloc_backend.h - loads one of the allocators malloc_count can run on, by
+ * the same symbols, for the tools and benchmarks that call it directly.
+ */
+#ifndef __ALLOC_BACKEND_H__
+#define __ALLOC_BACKEND_H__
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+#ifdef __MACH__
+#define SCALLOC_LIB "scalloc-1.0.0/out/Release/libscalloc.dylib"
+#else
+#define SCALLOC_LIB "scalloc-1.0.0/out/Release/lib.target/libscalloc.so"
+#endif
+
+/* as in malloc_count.cpp; lib relative to the directory of the executable,
+ * which is tools/ or bench/ */
+static const struct alloc_backend {
+        const char *name;
+        const char *lib;                /* NULL: libc */
+        const char *malloc_sym, *free_sym, *realloc_sym, *calloc_sym,
+                   *memalign_sym;
+} alloc_backends[] = {
+#ifdef __GLIBC__
+        /* libc's own entry points, which an interposer linked into the
+         * program does not replace */
+        { "glibc", NULL, "__libc_malloc", "__libc_free", "__libc_realloc",
+          "__libc_calloc", "__libc_memalign" },
+#else
+        { "glibc", NULL, "malloc", "free", "realloc", "calloc", "memalign" },
+#endif
+        { "ltalloc", "../src/ltalloc.so", "ltalloc_malloc", "ltalloc_free",
+          "ltalloc_realloc", "ltalloc_calloc", "ltalloc_memalign" },
+        { "scalloc", "../src/" SCALLOC_LIB, "scalloc_malloc", "scalloc_free",
+          "scalloc_realloc", "scalloc_calloc", "scalloc_memalign" },
+};
+
+#define NUM_ALLOC_BACKENDS \
+        (sizeof(alloc_backends) / sizeof(alloc_backends[0]))
+
+static void *(*a_malloc)(size_t);
+static void (*a_free)(void *);
+static void *(*a_realloc)(void *, size_t);
+static void *(*a_calloc)(size_t, size_t);
+static void *(*a_memalign)(size_t, size_t);
+
+static const struct alloc_backend *find_alloc_backend(const char *name)
+{
+        size_t i;
+
+        for (i = 0; i < NUM_ALLOC_BACKENDS; ++i)
+                if (strcmp(name, alloc_backends[i].name) == 0)
+                        return &alloc_backends[i];
+        fprintf(stderr, "unknown allocator %s\n", name);
+        return NULL;
+}
+
+/* the default library of b next to the executable, NULL for libc */
+static const char *alloc_backend_lib(const struct alloc_backend *b)
+{
+        static char path[4096];
+        ssize_t n;
+        char *slash;
+
+        if (!b->lib)
+                return NULL;
+        n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        path[n > 0 ? n : 0] = 0;
+        slash = strrchr(path, '/');
+        snprintf(slash ? slash + 1 : path,
+                 sizeof(path) - (slash ? slash + 1 - path : 0), "%s", b->lib);
+        return path;
+}
+
+/* Points the a_ functions at allocator name, from lib or its default
+ * library. Returns the library loaded ("libc" for glibc), NULL after
+ * printing why it failed. */
+static const char *load_alloc_backend(const char *name, const char *lib)
+{
+        const struct alloc_backend *b = find_alloc_backend(name);
+        void *h = RTLD_DEFAULT;
+
+        if (!b)
+                return NULL;
+        if (!lib)
+                lib = alloc_backend_lib(b);
+        if (lib && !(h = dlopen(lib, RTLD_NOW | RTLD_LOCAL))) {
+                fprintf(stderr, "%s\n", dlerror());
+                return NULL;
+        }
+        *(void **)&a_malloc = dlsym(h, b->malloc_sym);
+        *(void **)&a_free = dlsym(h, b->free_sym);
+        *(void **)&a_realloc = dlsym(h, b->realloc_sym);
+        *(void **)&a_calloc = dlsym(h, b->calloc_sym);
+        *(void **)&a_memalign = dlsym(h, b->memalign_sym);
+        if (!a_malloc || !a_free || !a_realloc || !a_calloc || !a_memalign) {
+                fprintf(stderr, "%s: missing allocator functions\n",
+                        lib ? lib : "libc");
+                return NULL;
+        }
+        return lib ? lib : "libc";
+}
+
+#endif /* __ALLOC_BACKEND_H__ */
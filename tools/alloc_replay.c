@@ -0,0 +1,509 @@
+/*
+ * alloc_replay - replays an allocation trace written with
+ * MALLOC_COUNT_TRACE=file against an allocator, to compare allocators on a
+ * real workload without running the simulation.
+ *
+ *   alloc_replay [-b glibc|ltalloc|scalloc] [-l library] [-n] trace
+ *
+ *   -b  allocator to replay against, default glibc
+ *   -l  its library, default the one of the build next to this tool
+ *   -n  do not touch the allocated pages (by default one byte per page is
+ *       written, as the program would)
+ *
+ * Every traced thread is replayed by a thread of its own, with its calls in
+ * their traced order. A block freed or reallocated by another thread than
+ * the one that allocated it is waited for, so such frees happen on the
+ * other thread as in the traced run. A replay thread is started once the
+ * threads that had finished before it started in the traced run are done.
+ * Addresses are remapped to the blocks the replayed allocator returns;
+ * frees of blocks allocated before the trace started are skipped.
+ *
+ * Prints the wall time, the CPU time of the process, the time spent inside
+ * the allocator's functions and the peak RSS above that before the replay.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "alloctrace.h"
+#include "alloc_backend.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define ticks() __rdtsc()
+#else
+#define ticks() ((uint64_t)now_ns())
+#endif
+
+#define NO_BLOCK        UINT64_MAX      /* block allocated before the trace */
+#define PAGE            4096
+#define RSS_POLL_US     1000
+
+/* a traced call with addresses replaced by block numbers */
+struct op {
+        uint32_t op;            /* enum alloctrace_op */
+        uint64_t block;         /* allocated, or freed / reallocated */
+        uint64_t new_block;     /* realloc: the block it returns */
+        uint64_t size;
+        uint64_t align;
+};
+
+struct thread {
+        struct alloctrace_event *ev;    /* while loading */
+        struct op *ops;
+        size_t n, cap;
+        uint64_t first, last;           /* tsc of first and last call */
+        pthread_t tid;
+        int running;
+        uint64_t alloc_ticks;           /* inside the allocator */
+        uint64_t waits;                 /* for another thread's block */
+};
+
+static struct thread *threads;
+static uint32_t num_threads;
+static void **blocks;                   /* by block number */
+static int touch = 1;
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-b glibc|ltalloc|scalloc] [-l library] "
+                "[-n] trace\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+static void *xrealloc(void *p, size_t len)
+{
+        if (!(p = realloc(p, len))) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+        }
+        return p;
+}
+
+static double now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* reads the trace into threads[].ev */
+static void load_trace(const char *name, struct alloctrace_header *h)
+{
+        struct alloctrace_chunk c;
+        uint64_t events = 0;
+        FILE *in;
+
+        if (!(in = fopen(name, "rb"))) {
+                perror(name);
+                exit(EXIT_FAILURE);
+        }
+        if (fread(h, sizeof(*h), 1, in) != 1 ||
+            memcmp(h->magic, ALLOCTRACE_MAGIC, sizeof(ALLOCTRACE_MAGIC)) ||
+            h->version != ALLOCTRACE_VERSION ||
+            h->header_size != sizeof(*h) ||
+            h->event_size != sizeof(struct alloctrace_event)) {
+                fprintf(stderr, "%s: not an allocation trace\n", name);
+                exit(EXIT_FAILURE);
+        }
+        while (fread(&c, sizeof(c), 1, in) == 1) {
+                struct thread *t;
+                if (c.thread >= num_threads) {
+                        threads = xrealloc(threads, (c.thread + 1) *
+                                           sizeof(*threads));
+                        memset(threads + num_threads, 0,
+                               (c.thread + 1 - num_threads) * sizeof(*threads));
+                        num_threads = c.thread + 1;
+                }
+                t = &threads[c.thread];
+                if (t->n + c.count > t->cap) {
+                        t->cap = (t->n + c.count) * 2;
+                        t->ev = xrealloc(t->ev, t->cap * sizeof(*t->ev));
+                }
+                if (fread(t->ev + t->n, sizeof(*t->ev), c.count, in) !=
+                    c.count) {
+                        fprintf(stderr, "%s: truncated\n", name);
+                        break;
+                }
+                t->n += c.count;
+                events += c.count;
+        }
+        fclose(in);
+        printf("%llu calls of %u threads, traced with %.16s\n",
+               (unsigned long long)events, num_threads, h->backend);
+}
+
+/* address -> block number, linear probing */
+static uint64_t *map_addr, *map_block;
+static size_t map_cap, map_used;
+
+static size_t map_slot(uint64_t addr)
+{
+        size_t i = (addr * 0x9E3779B97F4A7C15ULL) >> 20 & (map_cap - 1);
+        while (map_addr[i] && map_addr[i] != addr)
+                i = (i + 1) & (map_cap - 1);
+        return i;
+}
+
+static void map_put(uint64_t addr, uint64_t block)
+{
+        size_t i;
+
+        if (!addr)              /* the allocation failed */
+                return;
+        if (2 * (map_used + 1) > map_cap) {
+                uint64_t *oa = map_addr, *ob = map_block;
+                size_t j, oc = map_cap;
+                map_cap = oc ? 2 * oc : 1024;
+                map_addr = calloc(map_cap, sizeof(*map_addr));
+                map_block = calloc(map_cap, sizeof(*map_block));
+                if (!map_addr || !map_block) {
+                        perror("calloc");
+                        exit(EXIT_FAILURE);
+                }
+                for (j = 0; j < oc; ++j)
+                        if (oa[j]) {
+                                i = map_slot(oa[j]);
+                                map_addr[i] = oa[j];
+                                map_block[i] = ob[j];
+                        }
+                free(oa);
+                free(ob);
+        }
+        i = map_slot(addr);
+        if (!map_addr[i])
+                ++map_used;
+        map_addr[i] = addr;
+        map_block[i] = block;
+}
+
+/* removes addr; NO_BLOCK if it was not allocated in the trace */
+static uint64_t map_take(uint64_t addr)
+{
+        size_t i, j;
+        uint64_t block;
+
+        if (!map_cap || !addr)
+                return NO_BLOCK;
+        i = map_slot(addr);
+        if (!map_addr[i])
+                return NO_BLOCK;
+        block = map_block[i];
+        map_addr[i] = 0;
+        --map_used;
+        /* move later entries of the run up into the hole */
+        for (j = (i + 1) & (map_cap - 1); map_addr[j];
+             j = (j + 1) & (map_cap - 1)) {
+                size_t k = (map_addr[j] * 0x9E3779B97F4A7C15ULL) >> 20 &
+                           (map_cap - 1);
+                if ((j > i && (k <= i || k > j)) ||
+                    (j < i && (k <= i && k > j))) {
+                        map_addr[i] = map_addr[j];
+                        map_block[i] = map_block[j];
+                        map_addr[j] = 0;
+                        i = j;
+                }
+        }
+        return block;
+}
+
+/* an address event: a call, or the release half of a realloc */
+struct ref {
+        uint64_t tsc;
+        uint32_t thread;
+        uint32_t idx;           /* REF_RELEASE: the release half */
+        uint32_t allocates;     /* sorts releases first at the same tick */
+};
+
+#define REF_RELEASE     0x80000000u
+
+static int ref_cmp(const void *a, const void *b)
+{
+        const struct ref *x = a, *y = b;
+        if (x->tsc != y->tsc)
+                return x->tsc < y->tsc ? -1 : 1;
+        return (int)x->allocates - (int)y->allocates;
+}
+
+/* turns the events into ops: numbers the blocks in the order of the trace,
+ * following the addresses through all threads by time */
+static uint64_t number_blocks(void)
+{
+        struct ref *refs;
+        size_t n = 0, i;
+        uint64_t next = 0;
+        uint32_t t;
+
+        for (t = 0; t < num_threads; ++t)
+                for (i = 0; i < threads[t].n; ++i)
+                        n += (threads[t].ev[i].op == ALLOCTRACE_REALLOC) ? 2 : 1;
+        refs = xrealloc(NULL, n * sizeof(*refs) + 1);
+        n = 0;
+        for (t = 0; t < num_threads; ++t) {
+                struct thread *th = &threads[t];
+                th->ops = xrealloc(NULL, th->n * sizeof(*th->ops) + 1);
+                for (i = 0; i < th->n; ++i) {
+                        const struct alloctrace_event *e = &th->ev[i];
+                        refs[n].tsc = e->tsc;
+                        refs[n].thread = t;
+                        refs[n].idx = i;
+                        refs[n++].allocates = e->op != ALLOCTRACE_FREE;
+                        if (e->op == ALLOCTRACE_REALLOC) {
+                                refs[n].tsc = e->tsc - e->release;
+                                refs[n].thread = t;
+                                refs[n].idx = i | REF_RELEASE;
+                                refs[n++].allocates = 0;
+                        }
+                }
+                if (th->n) {
+                        th->first = th->ev[0].tsc;
+                        th->last = th->ev[th->n - 1].tsc;
+                }
+        }
+        qsort(refs, n, sizeof(*refs), ref_cmp);
+
+        for (i = 0; i < n; ++i) {
+                struct thread *th = &threads[refs[i].thread];
+                uint32_t idx = refs[i].idx & ~REF_RELEASE;
+                const struct alloctrace_event *e = &th->ev[idx];
+                struct op *o = &th->ops[idx];
+
+                if (refs[i].idx & REF_RELEASE) {
+                        o->block = map_take(e->arg);
+                        continue;
+                }
+                o->op = e->op;
+                o->size = e->size;
+                switch (e->op) {
+                case ALLOCTRACE_FREE:
+                        o->block = map_take(e->addr);
+                        break;
+                case ALLOCTRACE_REALLOC:
+                        /* the release half came first */
+                        o->new_block = next;
+                        map_put(e->addr, next++);
+                        break;
+                case ALLOCTRACE_MEMALIGN:
+                        o->align = e->arg;
+                        /* fall through */
+                default:
+                        o->block = next;
+                        map_put(e->addr, next++);
+                }
+        }
+        free(refs);
+        for (t = 0; t < num_threads; ++t) {
+                free(threads[t].ev);
+                threads[t].ev = NULL;
+        }
+        free(map_addr);
+        free(map_block);
+        return next;
+}
+
+/* block b, once its allocating thread has got it */
+static void *wait_block(struct thread *t, uint64_t b)
+{
+        void *p = __atomic_load_n(&blocks[b], __ATOMIC_ACQUIRE);
+
+        if (p)
+                return p;
+        ++t->waits;
+        while (!(p = __atomic_load_n(&blocks[b], __ATOMIC_ACQUIRE)))
+                sched_yield();
+        return p;
+}
+
+static void put_block(uint64_t b, void *p, size_t size)
+{
+        size_t i;
+
+        if (touch && p)
+                for (i = 0; i < size; i += PAGE)
+                        ((volatile char *)p)[i] = 1;
+        __atomic_store_n(&blocks[b], p, __ATOMIC_RELEASE);
+}
+
+static void *replay_thread(void *arg)
+{
+        struct thread *t = arg;
+        uint64_t sum = 0, t0;
+        size_t i;
+
+        for (i = 0; i < t->n; ++i) {
+                const struct op *o = &t->ops[i];
+                void *p, *q;
+
+                switch (o->op) {
+                case ALLOCTRACE_MALLOC:
+                        t0 = ticks();
+                        p = a_malloc(o->size);
+                        sum += ticks() - t0;
+                        put_block(o->block, p, o->size);
+                        break;
+                case ALLOCTRACE_CALLOC:
+                        t0 = ticks();
+                        p = a_calloc(1, o->size);
+                        sum += ticks() - t0;
+                        put_block(o->block, p, o->size);
+                        break;
+                case ALLOCTRACE_MEMALIGN:
+                        t0 = ticks();
+                        p = a_memalign(o->align, o->size);
+                        sum += ticks() - t0;
+                        put_block(o->block, p, o->size);
+                        break;
+                case ALLOCTRACE_REALLOC:
+                        p = (o->block == NO_BLOCK) ? NULL
+                                                   : wait_block(t, o->block);
+                        t0 = ticks();
+                        q = a_realloc(p, o->size);
+                        sum += ticks() - t0;
+                        put_block(o->new_block, q, o->size);
+                        break;
+                case ALLOCTRACE_FREE:
+                        if (o->block == NO_BLOCK)
+                                break;
+                        p = wait_block(t, o->block);
+                        t0 = ticks();
+                        a_free(p);
+                        sum += ticks() - t0;
+                        break;
+                }
+        }
+        t->alloc_ticks = sum;
+        return NULL;
+}
+
+/* peak resident set, sampled while the replay runs */
+static volatile int rss_stop;
+static long rss_peak;
+
+static long rss_now(void)
+{
+        long pages = 0, resident = 0;
+        FILE *f = fopen("/proc/self/statm", "r");
+
+        if (!f)
+                return 0;
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+                resident = 0;
+        fclose(f);
+        return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void *rss_thread(void *arg)
+{
+        (void)arg;
+        while (!rss_stop) {
+                long r = rss_now();
+                if (r > rss_peak)
+                        rss_peak = r;
+                usleep(RSS_POLL_US);
+        }
+        return NULL;
+}
+
+static int first_cmp(const void *a, const void *b)
+{
+        const struct thread *x = *(struct thread *const *)a;
+        const struct thread *y = *(struct thread *const *)b;
+        return x->first < y->first ? -1 : x->first > y->first;
+}
+
+static double cpu_s(void)
+{
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+               ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+        const char *backend = "glibc", *lib = NULL;
+        struct alloctrace_header h;
+        struct thread **order;
+        uint64_t nblocks, alloc_ticks = 0, waits = 0, tick0, tick1;
+        double ns0, ns1, cpu0, cpu1;
+        long rss0;
+        uint32_t i, j;
+        pthread_t rss_tid;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "b:l:n")) != -1) {
+                switch (opt) {
+                case 'b': backend = optarg; break;
+                case 'l': lib = optarg; break;
+                case 'n': touch = 0; break;
+                default: usage(argv[0]);
+                }
+        }
+        if (optind >= argc)
+                usage(argv[0]);
+
+        load_trace(argv[optind], &h);
+        nblocks = number_blocks();
+        blocks = calloc(nblocks + 1, sizeof(*blocks));
+        order = xrealloc(NULL, (num_threads + 1) * sizeof(*order));
+        if (!blocks) {
+                perror("calloc");
+                return EXIT_FAILURE;
+        }
+        for (i = 0; i < num_threads; ++i)
+                order[i] = &threads[i];
+        qsort(order, num_threads, sizeof(*order), first_cmp);
+        if (!(lib = load_alloc_backend(backend, lib)))
+                return EXIT_FAILURE;
+        printf("allocator %s, %s\n", backend, lib);
+
+        rss0 = rss_now();
+        rss_peak = rss0;
+        pthread_create(&rss_tid, NULL, rss_thread, NULL);
+        cpu0 = cpu_s();
+        ns0 = now_ns();
+        tick0 = ticks();
+        for (i = 0; i < num_threads; ++i) {
+                struct thread *t = order[i];
+                if (!t->n)
+                        continue;
+                /* the threads which had finished when this one started */
+                for (j = 0; j < i; ++j)
+                        if (order[j]->running && order[j]->last < t->first) {
+                                pthread_join(order[j]->tid, NULL);
+                                order[j]->running = 0;
+                        }
+                if (pthread_create(&t->tid, NULL, replay_thread, t) != 0) {
+                        perror("pthread_create");
+                        return EXIT_FAILURE;
+                }
+                t->running = 1;
+        }
+        for (i = 0; i < num_threads; ++i)
+                if (order[i]->running)
+                        pthread_join(order[i]->tid, NULL);
+        tick1 = ticks();
+        ns1 = now_ns();
+        cpu1 = cpu_s();
+        rss_stop = 1;
+        pthread_join(rss_tid, NULL);
+
+        for (i = 0; i < num_threads; ++i) {
+                alloc_ticks += threads[i].alloc_ticks;
+                waits += threads[i].waits;
+        }
+        printf("%llu blocks, %llu cross-thread waits\n",
+               (unsigned long long)nblocks, (unsigned long long)waits);
+        printf("wall %.3f s, cpu %.3f s, in allocator %.3f s, "
+               "peak rss +%.1f MiB\n", (ns1 - ns0) / 1e9, cpu1 - cpu0,
+               alloc_ticks * ((ns1 - ns0) / (double)(tick1 - tick0)) / 1e9,
+               (rss_peak - rss0) / 1048576.0);
+        return EXIT_SUCCESS;
+}
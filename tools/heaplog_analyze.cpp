@@ -0,0 +1,926 @@
+/*
+ * heaplog_analyze - statistics of binary heap logs, without going through
+ * CSV. Replaces sort.py, and takes logs of any size: the files are mapped
+ * and scanned in parallel, one piece per thread.
+ *
+ *   heaplog_analyze [-f field] [-j threads] [-o out] [mode] heap.log ...
+ *
+ *   -f  field to analyze, default curr_heap_size
+ *   -j  threads, default one per CPU
+ *   -o  write to out instead of stdout; with several logs each goes to
+ *       <backend>_out (glibc_heaplog.csv, ... as memprofile.gnuplot reads)
+ *
+ * Modes:
+ *   (none)    summary, one line per log: records, seconds, min, max, mean,
+ *             p50, p90, p99 and time of the maximum, and with several logs
+ *             mean, p99 and max relative to the first one, to compare runs
+ *             with different backends
+ *   -w secs   series of windows of secs: start,count,min,max,mean,p50,
+ *             p90,p99
+ *   -p n      the n most prominent peaks of the window maxima (windows of
+ *             -w secs, default a thousandth of the run): time,value,
+ *             prominence
+ *   -d n      about n points for plotting, picked by largest triangle three
+ *             buckets (LTTB): timestamp,value
+ *   -M n      about n points for plotting, the minimum and maximum of each
+ *             of n/2 windows: timestamp,value
+ *   -S out    sort the records by timestamp into the raw heap log out, with
+ *             an external merge sort in runs of -m MiB (default 256)
+ *
+ * Logs are read in any encoding, and a segmented log (heap.log.idx next to
+ * it) as a whole. Percentiles come from a log-linear histogram and are
+ * accurate to about 3%; float fields are bucketed in thousandths.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <float.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include "heaplog.h"
+#include "latency_hist.h"
+
+#define DEFAULT_WINDOWS         1000
+#define TASKS_PER_THREAD        4       /* pieces per thread, for balance */
+#define FLOAT_SCALE             1000    /* histogram units of float fields */
+
+struct log_file {
+        std::string name;
+        const char *map;
+        size_t size;
+        struct heaplog_header h;
+};
+
+struct heap_log {
+        std::string name;
+        std::vector<log_file> files;    /* segments in order */
+        struct heaplog_header h;        /* of the first one */
+        int ts_field, field;
+        double t0, t1;                  /* first and last timestamp */
+};
+
+/* a piece of a file, whole records or blocks */
+struct task {
+        const log_file *f;
+        size_t begin, end;              /* byte offsets */
+};
+
+struct stats {
+        uint64_t count;
+        double sum, sum_t, min, max, min_t, max_t;
+        struct latency_hist hist;
+};
+
+static const char *field_name = "curr_heap_size";
+static unsigned int num_threads;
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-f field] [-j threads] [-o out] "
+                "[-w secs | -p n | -d n | -M n | -S out [-m MiB]] "
+                "heap.log ...\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+static int find_field(const struct heaplog_header *h, const char *name)
+{
+        uint32_t i;
+        for (i = 0; i < h->num_fields; ++i)
+                if (strncmp(h->fields[i].name, name, HEAPLOG_NAME_LEN) == 0)
+                        return i;
+        return -1;
+}
+
+static inline double field_value(const struct heaplog_header *h, int f,
+                                 const char *rec)
+{
+        const struct heaplog_field *fd = &h->fields[f];
+        uint32_t u32;
+        uint64_t u64;
+        float f32;
+        double f64;
+
+        switch (fd->type) {
+        case HEAPLOG_U32:
+                memcpy(&u32, rec + fd->offset, sizeof(u32));
+                return u32;
+        case HEAPLOG_U64:
+                memcpy(&u64, rec + fd->offset, sizeof(u64));
+                return (double)u64;
+        case HEAPLOG_F32:
+                memcpy(&f32, rec + fd->offset, sizeof(f32));
+                return f32;
+        default:
+                memcpy(&f64, rec + fd->offset, sizeof(f64));
+                return f64;
+        }
+}
+
+static void unmap_file(log_file *lf)
+{
+        if (lf->map)
+                munmap((void *)lf->map, lf->size);
+        lf->map = NULL;
+}
+
+/* maps a log file and checks its header, as heaplog_decode's open_log() */
+static int map_file(const char *name, log_file *lf)
+{
+        struct heaplog_header *h = &lf->h;
+        struct stat st;
+        size_t hsize;
+        void *p;
+        int fd;
+
+        if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+                perror(name);
+                if (fd >= 0)
+                        close(fd);
+                return -1;
+        }
+        lf->name = name;
+        lf->map = NULL;
+        lf->size = st.st_size;
+        memset(h, 0, sizeof(*h));
+        if (lf->size < HEAPLOG_V1_HEADER_SIZE) {
+                fprintf(stderr, "%s: not a binary heap log\n", name);
+                close(fd);
+                return -1;
+        }
+        p = mmap(NULL, lf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+                perror(name);
+                return -1;
+        }
+        madvise(p, lf->size, MADV_SEQUENTIAL);
+        lf->map = (const char *)p;
+        memcpy(h, p, HEAPLOG_V1_HEADER_SIZE);
+        if (memcmp(h->magic, HEAPLOG_MAGIC, sizeof(HEAPLOG_MAGIC)) != 0) {
+                fprintf(stderr, "%s: not a binary heap log\n", name);
+                unmap_file(lf);
+                return -1;
+        }
+        hsize = (h->version == 1) ? HEAPLOG_V1_HEADER_SIZE : sizeof(*h);
+        if (h->version > 1 && lf->size >= sizeof(*h))
+                memcpy(h, p, sizeof(*h));
+        if (h->version < 1 || h->version > HEAPLOG_VERSION ||
+            h->header_size != hsize || lf->size < hsize ||
+            h->num_fields > HEAPLOG_MAX_FIELDS || !h->record_size ||
+            h->encoding > HEAPLOG_ENC_BLOCKS ||
+            (h->encoding == HEAPLOG_ENC_BLOCKS &&
+             (h->block_size <= sizeof(struct heaplog_block) ||
+              h->ticks_per_ns <= 0))) {
+                fprintf(stderr, "%s: unsupported heap log version %u\n",
+                        name, h->version);
+                unmap_file(lf);
+                return -1;
+        }
+        return 0;
+}
+
+static size_t unit_size(const struct heaplog_header *h)
+{
+        return h->encoding == HEAPLOG_ENC_BLOCKS ? h->block_size
+                                                 : h->record_size;
+}
+
+/* calls fn(rec) for the records of t in file order */
+template <class F>
+static void scan(const task &t, F fn)
+{
+        const struct heaplog_header *h = &t.f->h;
+        size_t pos;
+
+        if (h->encoding != HEAPLOG_ENC_BLOCKS) {
+                for (pos = t.begin; pos < t.end; pos += h->record_size)
+                        fn(t.f->map + pos);
+                return;
+        }
+        uint32_t max = h->block_size;   /* records per block, at most */
+        std::vector<char> buf((size_t)max * h->record_size);
+        for (pos = t.begin; pos < t.end; pos += h->block_size) {
+                int i, n = heaplog_decode_block(h, t.f->map + pos,
+                                                h->block_size, buf.data(),
+                                                max);
+                for (i = 0; i < n; ++i)
+                        fn(buf.data() + (size_t)i * h->record_size);
+        }
+}
+
+/* splits the log into about n pieces of whole records or blocks */
+static std::vector<task> make_tasks(const heap_log &log, unsigned int n)
+{
+        std::vector<task> tasks;
+        size_t total = 0;
+
+        for (const log_file &f : log.files)
+                total += f.size - f.h.header_size;
+        size_t piece = total / (n ? n : 1) + 1;
+        for (const log_file &f : log.files) {
+                size_t unit = unit_size(&f.h);
+                size_t end = f.h.header_size +
+                             (f.size - f.h.header_size) / unit * unit;
+                size_t step = std::max(unit, piece / unit * unit);
+                for (size_t pos = f.h.header_size; pos < end; pos += step)
+                        tasks.push_back(task{ &f, pos,
+                                              std::min(end, pos + step) });
+        }
+        return tasks;
+}
+
+/* runs fn(task index) for all tasks on num_threads threads */
+template <class F>
+static void parallel_for(size_t n, F fn)
+{
+        std::vector<std::thread> threads;
+        size_t next = 0;
+        unsigned int i;
+
+        for (i = 0; i < num_threads; ++i)
+                threads.emplace_back([&]() {
+                        size_t k;
+                        while ((k = __atomic_fetch_add(&next, 1,
+                                                       __ATOMIC_RELAXED)) < n)
+                                fn(k);
+                });
+        for (std::thread &t : threads)
+                t.join();
+}
+
+static void close_heap_log(heap_log &log)
+{
+        for (log_file &f : log.files)
+                unmap_file(&f);
+        log.files.clear();
+}
+
+/* maps the files of a log and finds its fields */
+static int map_heap_log(const char *name, heap_log &log)
+{
+        char seg[4096];
+        unsigned int i;
+
+        log.name = name;
+        snprintf(seg, sizeof(seg), "%s" HEAPLOG_INDEX_SUFFIX, name);
+        if (access(seg, F_OK) == 0) {
+                for (i = 0; ; ++i) {
+                        snprintf(seg, sizeof(seg), HEAPLOG_SEGMENT_FORMAT,
+                                 name, i);
+                        if (access(seg, F_OK) != 0)
+                                break;
+                        log.files.emplace_back();
+                        if (map_file(seg, &log.files.back()) != 0)
+                                return -1;
+                }
+                if (log.files.empty()) {
+                        fprintf(stderr, "%s: no segments\n", name);
+                        return -1;
+                }
+        } else {
+                log.files.emplace_back();
+                if (map_file(name, &log.files.back()) != 0)
+                        return -1;
+        }
+        log.h = log.files[0].h;
+        for (const log_file &f : log.files)
+                if (f.h.record_size != log.h.record_size ||
+                    f.h.num_fields != log.h.num_fields ||
+                    memcmp(f.h.fields, log.h.fields, sizeof(f.h.fields))) {
+                        fprintf(stderr, "%s: segments differ in layout\n",
+                                f.name.c_str());
+                        return -1;
+                }
+        log.ts_field = find_field(&log.h, HEAPLOG_TIMESTAMP);
+        log.field = find_field(&log.h, field_name);
+        if (log.ts_field < 0 || log.field < 0) {
+                fprintf(stderr, "%s: no field %s\n", name,
+                        log.ts_field < 0 ? HEAPLOG_TIMESTAMP : field_name);
+                return -1;
+        }
+        return 0;
+}
+
+static int open_heap_log(const char *name, heap_log &log)
+{
+        if (map_heap_log(name, log) != 0) {
+                close_heap_log(log);
+                return -1;
+        }
+
+        /* the log is in time order but for stragglers; the span only sets
+         * the default window width */
+        std::vector<task> tasks = make_tasks(log, 1);
+        log.t0 = log.t1 = 0;
+        if (!tasks.empty()) {
+                task first = tasks.front(), last = tasks.back();
+                size_t unit = unit_size(&last.f->h);
+                bool have = false;
+                first.end = std::min(first.end, first.begin + unit);
+                last.begin = last.end - unit;
+                scan(first, [&](const char *rec) {
+                        if (!have)
+                                log.t0 = field_value(&log.h, log.ts_field, rec);
+                        have = true;
+                });
+                scan(last, [&](const char *rec) {
+                        log.t1 = field_value(&log.h, log.ts_field, rec);
+                });
+        }
+        return 0;
+}
+
+static inline uint64_t hist_value(const heap_log &log, double v)
+{
+        uint16_t type = log.h.fields[log.field].type;
+        if (v <= 0)
+                return 0;
+        return (uint64_t)(type == HEAPLOG_F32 || type == HEAPLOG_F64
+                          ? v * FLOAT_SCALE : v);
+}
+
+static inline double hist_unit(const heap_log &log)
+{
+        uint16_t type = log.h.fields[log.field].type;
+        return (type == HEAPLOG_F32 || type == HEAPLOG_F64) ? FLOAT_SCALE : 1;
+}
+
+static void stats_init(stats &s)
+{
+        memset(&s, 0, sizeof(s));
+        s.min = DBL_MAX;
+        s.max = -DBL_MAX;
+}
+
+static inline void stats_add(stats &s, const heap_log &log, double t,
+                             double v)
+{
+        if (!s.count)
+                s.min_t = s.max_t = t;
+        ++s.count;
+        s.sum += v;
+        s.sum_t += t;
+        if (v < s.min) {
+                s.min = v;
+                s.min_t = t;
+        }
+        if (v > s.max) {
+                s.max = v;
+                s.max_t = t;
+        }
+        latency_record(&s.hist, hist_value(log, v));
+}
+
+static void stats_merge(stats &dst, const stats &src)
+{
+        if (!src.count)
+                return;
+        if (!dst.count || src.min < dst.min) {
+                dst.min = src.min;
+                dst.min_t = src.min_t;
+        }
+        if (!dst.count || src.max > dst.max) {
+                dst.max = src.max;
+                dst.max_t = src.max_t;
+        }
+        dst.count += src.count;
+        dst.sum += src.sum;
+        dst.sum_t += src.sum_t;
+        latency_merge(&dst.hist, &src.hist);
+}
+
+static double percentile(const heap_log &log, const stats &s, double q)
+{
+        return latency_percentile(&s.hist, s.count, q) / hist_unit(log);
+}
+
+/*
+ * The parallel pass: statistics of the whole log and, if width > 0, of
+ * windows of width seconds from log.t0. Each thread keeps its own windows;
+ * as the log is in time order a piece touches few of them.
+ */
+static void analyze(const heap_log &log, double width, stats &total,
+                    std::map<int64_t, stats> &windows)
+{
+        std::vector<task> tasks = make_tasks(log, num_threads *
+                                                  TASKS_PER_THREAD);
+        std::vector<stats> totals(tasks.size());
+        std::vector<std::map<int64_t, stats> > part(tasks.size());
+
+        parallel_for(tasks.size(), [&](size_t k) {
+                stats &tot = totals[k];
+                std::map<int64_t, stats> &win = part[k];
+                stats *cur = NULL;
+                int64_t cur_idx = 0;
+
+                stats_init(tot);
+                scan(tasks[k], [&](const char *rec) {
+                        double t = field_value(&log.h, log.ts_field, rec);
+                        double v = field_value(&log.h, log.field, rec);
+                        stats_add(tot, log, t, v);
+                        if (width <= 0)
+                                return;
+                        int64_t idx = (int64_t)floor((t - log.t0) / width);
+                        if (!cur || idx != cur_idx) {
+                                auto it = win.find(idx);
+                                if (it == win.end()) {
+                                        it = win.emplace(idx, stats()).first;
+                                        stats_init(it->second);
+                                }
+                                cur = &it->second;
+                                cur_idx = idx;
+                        }
+                        stats_add(*cur, log, t, v);
+                });
+        });
+
+        stats_init(total);
+        for (size_t k = 0; k < tasks.size(); ++k) {
+                stats_merge(total, totals[k]);
+                for (auto &w : part[k]) {
+                        auto it = windows.find(w.first);
+                        if (it == windows.end()) {
+                                it = windows.emplace(w.first, stats()).first;
+                                stats_init(it->second);
+                        }
+                        stats_merge(it->second, w.second);
+                }
+                part[k].clear();
+        }
+}
+
+static double default_width(const heap_log &log, unsigned int n)
+{
+        double w = (log.t1 - log.t0) / n;
+        return w > 0 ? w : 1;
+}
+
+static void print_series(FILE *out, const heap_log &log, double width)
+{
+        std::map<int64_t, stats> windows;
+        stats total;
+
+        analyze(log, width, total, windows);
+        fprintf(out, "start,count,min,max,mean,p50,p90,p99\n");
+        for (auto &w : windows) {
+                const stats &s = w.second;
+                fprintf(out, "%.6f,%llu,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g\n",
+                        log.t0 + w.first * width,
+                        (unsigned long long)s.count, s.min, s.max,
+                        s.sum / s.count, percentile(log, s, 0.5),
+                        percentile(log, s, 0.9), percentile(log, s, 0.99));
+        }
+}
+
+/* topographic prominence of the local maxima of the window maxima: how far
+ * one has to descend from a peak before reaching a higher one */
+static void print_peaks(FILE *out, const heap_log &log, double width,
+                        unsigned int n)
+{
+        std::map<int64_t, stats> windows;
+        std::vector<const stats *> w;
+        struct peak { double t, value, prominence; };
+        std::vector<peak> peaks;
+        stats total;
+        size_t i, j;
+
+        analyze(log, width, total, windows);
+        for (auto &x : windows)
+                w.push_back(&x.second);
+        for (i = 0; i < w.size(); ++i) {
+                double v = w[i]->max, lmin = v, rmin = v, base;
+                bool left = false, right = false;
+
+                if ((i > 0 && w[i - 1]->max >= v) ||
+                    (i + 1 < w.size() && w[i + 1]->max > v))
+                        continue;
+                for (j = i; j-- > 0; ) {
+                        if ((left = w[j]->max > v))
+                                break;
+                        lmin = std::min(lmin, w[j]->max);
+                }
+                for (j = i + 1; j < w.size(); ++j) {
+                        if ((right = w[j]->max > v))
+                                break;
+                        rmin = std::min(rmin, w[j]->max);
+                }
+                /* the col towards the nearest higher peak, or the lowest
+                 * point of the log for the highest one */
+                if (left && right)
+                        base = std::max(lmin, rmin);
+                else if (left || right)
+                        base = left ? lmin : rmin;
+                else
+                        base = std::min(lmin, rmin);
+                peaks.push_back(peak{ w[i]->max_t, v, v - base });
+        }
+        std::sort(peaks.begin(), peaks.end(), [](const peak &a,
+                                                 const peak &b) {
+                return a.prominence > b.prominence;
+        });
+        fprintf(out, "time,value,prominence\n");
+        for (i = 0; i < peaks.size() && i < n; ++i)
+                fprintf(out, "%.6f,%.17g,%.17g\n", peaks[i].t,
+                        peaks[i].value, peaks[i].prominence);
+}
+
+/* the minimum and maximum of n/2 windows, in time order */
+static void print_minmax(FILE *out, const heap_log &log, unsigned int n)
+{
+        double width = default_width(log, n / 2 ? n / 2 : 1);
+        std::map<int64_t, stats> windows;
+        stats total;
+
+        analyze(log, width, total, windows);
+        fprintf(out, "timestamp,%s\n", field_name);
+        for (auto &w : windows) {
+                const stats &s = w.second;
+                if (s.min_t <= s.max_t) {
+                        fprintf(out, "%.6f,%.17g\n", s.min_t, s.min);
+                        if (s.count > 1)
+                                fprintf(out, "%.6f,%.17g\n", s.max_t, s.max);
+                } else {
+                        fprintf(out, "%.6f,%.17g\n", s.max_t, s.max);
+                        fprintf(out, "%.6f,%.17g\n", s.min_t, s.min);
+                }
+        }
+}
+
+/*
+ * Largest triangle three buckets, with buckets of equal time. The first
+ * pass (parallel) gives every bucket's mean point; the second goes through
+ * the log in order and keeps of each bucket the point that makes the largest
+ * triangle with the point kept of the bucket before and the mean of the one
+ * after. The first and last records are always kept.
+ */
+static void print_lttb(FILE *out, const heap_log &log, unsigned int n)
+{
+        double width = default_width(log, n > 2 ? n - 2 : 1);
+        std::map<int64_t, stats> windows;
+        stats total;
+
+        analyze(log, width, total, windows);
+        fprintf(out, "timestamp,%s\n", field_name);
+        if (!total.count)
+                return;
+
+        std::vector<task> tasks = make_tasks(log, 1);
+        auto cur = windows.begin();
+        double at = 0, av = 0, bt = 0, bv = 0, best = -1, lt = 0, lv = 0;
+        bool first = true;
+
+        for (const task &t : tasks)
+                scan(t, [&](const char *rec) {
+                        double rt = field_value(&log.h, log.ts_field, rec);
+                        double rv = field_value(&log.h, log.field, rec);
+                        int64_t idx = (int64_t)floor((rt - log.t0) / width);
+
+                        lt = rt;
+                        lv = rv;
+                        if (first) {
+                                fprintf(out, "%.6f,%.17g\n", rt, rv);
+                                at = rt;
+                                av = rv;
+                                first = false;
+                                return;
+                        }
+                        /* a late record of an earlier bucket is dropped */
+                        if (idx < cur->first)
+                                return;
+                        while (idx > cur->first) {
+                                if (best >= 0) {
+                                        fprintf(out, "%.6f,%.17g\n", bt, bv);
+                                        at = bt;
+                                        av = bv;
+                                }
+                                best = -1;
+                                ++cur;
+                        }
+                        auto next = std::next(cur);
+                        double ct = next == windows.end() ? log.t1
+                                    : next->second.sum_t / next->second.count;
+                        double cv = next == windows.end() ? total.sum /
+                                    total.count
+                                    : next->second.sum / next->second.count;
+                        double area = fabs((at - ct) * (rv - av) -
+                                           (at - rt) * (cv - av));
+                        if (area > best) {
+                                best = area;
+                                bt = rt;
+                                bv = rv;
+                        }
+                });
+        if (best >= 0 && bt != lt)
+                fprintf(out, "%.6f,%.17g\n", bt, bv);
+        if (total.count > 1)
+                fprintf(out, "%.6f,%.17g\n", lt, lv);
+}
+
+/* records of a sort run, read back for the merge */
+struct run {
+        FILE *f;
+        std::vector<char> rec;
+        double ts;
+};
+
+static int write_all(FILE *f, const char *name, const void *p, size_t len)
+{
+        if (fwrite(p, 1, len, f) != len) {
+                perror(name);
+                return -1;
+        }
+        return 0;
+}
+
+/* sorts a buffer of records by timestamp, stable, into out */
+static void sort_records(const heap_log &log, const char *buf, size_t n,
+                         std::vector<char> &out)
+{
+        std::vector<std::pair<double, uint32_t> > key(n);
+        size_t rs = log.h.record_size, i;
+
+        for (i = 0; i < n; ++i)
+                key[i] = std::make_pair(field_value(&log.h, log.ts_field,
+                                                    buf + i * rs),
+                                        (uint32_t)i);
+        std::sort(key.begin(), key.end());
+        out.resize(n * rs);
+        for (i = 0; i < n; ++i)
+                memcpy(&out[i * rs], buf + (size_t)key[i].second * rs, rs);
+}
+
+/*
+ * External merge sort: runs of mem bytes are sorted in memory and written to
+ * out.run<n>, which are then merged through a heap. A log that fits in mem
+ * is written directly.
+ */
+static int sort_log(const heap_log &log, const char *out_name, size_t mem)
+{
+        size_t rs = log.h.record_size;
+        size_t cap = std::max((size_t)1, mem / 2 / rs), n = 0;
+        std::vector<char> buf(cap * rs), sorted;
+        std::vector<std::string> runs;
+        struct heaplog_header h = log.h;
+        uint64_t records = 0;
+        char name[4096];
+        FILE *out;
+        int ret = 0;
+
+        /* the sorted log is raw */
+        h.version = HEAPLOG_VERSION;
+        h.header_size = sizeof(h);
+        h.encoding = HEAPLOG_ENC_RAW;
+        h.block_size = 0;
+        if (!(out = fopen(out_name, "wb"))) {
+                perror(out_name);
+                return -1;
+        }
+        setvbuf(out, NULL, _IOFBF, 1 << 20);
+        if (write_all(out, out_name, &h, sizeof(h)) != 0) {
+                fclose(out);
+                return -1;
+        }
+
+        auto flush_run = [&]() {
+                FILE *f;
+                sort_records(log, buf.data(), n, sorted);
+                snprintf(name, sizeof(name), "%s.run%zu", out_name,
+                         runs.size());
+                if (!(f = fopen(name, "wb"))) {
+                        perror(name);
+                        ret = -1;
+                } else {
+                        runs.push_back(name);
+                        if (write_all(f, name, sorted.data(), n * rs) != 0)
+                                ret = -1;
+                        fclose(f);
+                }
+                n = 0;
+        };
+        for (const task &t : make_tasks(log, 1))
+                scan(t, [&](const char *rec) {
+                        if (ret != 0)   /* a run could not be written */
+                                return;
+                        memcpy(&buf[n * rs], rec, rs);
+                        ++records;
+                        if (++n == cap)
+                                flush_run();
+                });
+
+        if (ret == 0 && runs.empty()) {
+                sort_records(log, buf.data(), n, sorted);
+                ret = write_all(out, out_name, sorted.data(), n * rs);
+        } else if (ret == 0) {
+                if (n)
+                        flush_run();
+                std::vector<run> r(runs.size());
+                auto later = [&](size_t a, size_t b) {
+                        return r[a].ts > r[b].ts ||
+                               (r[a].ts == r[b].ts && a > b);
+                };
+                std::priority_queue<size_t, std::vector<size_t>,
+                                    decltype(later)> heap(later);
+                auto advance = [&](size_t i) {
+                        if (fread(r[i].rec.data(), rs, 1, r[i].f) != 1)
+                                return false;
+                        r[i].ts = field_value(&log.h, log.ts_field,
+                                              r[i].rec.data());
+                        return true;
+                };
+                size_t per_run = std::max((size_t)4096,
+                                          mem / 2 / runs.size());
+                for (size_t i = 0; i < runs.size() && ret == 0; ++i) {
+                        if (!(r[i].f = fopen(runs[i].c_str(), "rb"))) {
+                                perror(runs[i].c_str());
+                                ret = -1;
+                                break;
+                        }
+                        setvbuf(r[i].f, NULL, _IOFBF, per_run);
+                        r[i].rec.resize(rs);
+                        if (advance(i))
+                                heap.push(i);
+                }
+                while (ret == 0 && !heap.empty()) {
+                        size_t i = heap.top();
+                        heap.pop();
+                        ret = write_all(out, out_name, r[i].rec.data(), rs);
+                        if (advance(i))
+                                heap.push(i);
+                }
+                for (size_t i = 0; i < r.size(); ++i)
+                        if (r[i].f)
+                                fclose(r[i].f);
+        }
+        for (const std::string &s : runs)
+                unlink(s.c_str());
+        if (fclose(out) != 0 && ret == 0) {
+                perror(out_name);
+                ret = -1;
+        }
+        if (ret == 0)
+                fprintf(stderr, "%llu records sorted in %zu runs\n",
+                        (unsigned long long)records,
+                        runs.empty() ? (size_t)1 : runs.size());
+        return ret;
+}
+
+static void print_summary(FILE *out, const std::vector<heap_log> &logs)
+{
+        std::map<int64_t, stats> none;
+        double mean0 = 0, p990 = 0, max0 = 0;
+        size_t i;
+
+        fprintf(out, "backend,records,seconds,min,max,mean,p50,p90,p99,"
+                "max_time%s\n",
+                logs.size() > 1 ? ",mean_ratio,p99_ratio,max_ratio" : "");
+        for (i = 0; i < logs.size(); ++i) {
+                const heap_log &log = logs[i];
+                stats s;
+                analyze(log, 0, s, none);
+                if (!s.count) {
+                        fprintf(stderr, "%s: no records\n", log.name.c_str());
+                        continue;
+                }
+                double mean = s.sum / s.count, p99 = percentile(log, s, 0.99);
+                fprintf(out, "%.16s,%llu,%.6f,%.17g,%.17g,%.17g,%.17g,%.17g,"
+                        "%.17g,%.6f", log.h.backend,
+                        (unsigned long long)s.count, log.t1 - log.t0, s.min,
+                        s.max, mean, percentile(log, s, 0.5),
+                        percentile(log, s, 0.9), p99, s.max_t);
+                if (i == 0) {
+                        mean0 = mean;
+                        p990 = p99;
+                        max0 = s.max;
+                }
+                if (logs.size() > 1)
+                        fprintf(out, ",%.4f,%.4f,%.4f",
+                                mean0 ? mean / mean0 : 0,
+                                p990 ? p99 / p990 : 0,
+                                max0 ? s.max / max0 : 0);
+                fprintf(out, "\n");
+        }
+}
+
+/* out, or <backend>_out with several logs */
+static FILE *open_output(const char *out_name, const std::vector<heap_log> &logs,
+                         size_t i)
+{
+        std::string name;
+        size_t j, same = 0;
+        FILE *f;
+
+        if (!out_name)
+                return stdout;
+        if (logs.size() == 1) {
+                name = out_name;
+        } else {
+                name = std::string(logs[i].h.backend,
+                                   strnlen(logs[i].h.backend,
+                                           HEAPLOG_NAME_LEN));
+                for (j = 0; j < i; ++j)
+                        same += strncmp(logs[j].h.backend, logs[i].h.backend,
+                                        HEAPLOG_NAME_LEN) == 0;
+                if (same)
+                        name += "-" + std::to_string(same + 1);
+                /* the directory of out stays in front */
+                const char *slash = strrchr(out_name, '/');
+                if (slash)
+                        name = std::string(out_name, slash + 1 - out_name) +
+                               name + "_" + (slash + 1);
+                else
+                        name += std::string("_") + out_name;
+        }
+        if (!(f = fopen(name.c_str(), "w"))) {
+                perror(name.c_str());
+                return NULL;
+        }
+        setvbuf(f, NULL, _IOFBF, 1 << 20);
+        return f;
+}
+
+int main(int argc, char **argv)
+{
+        const char *out_name = NULL, *sort_name = NULL;
+        double width = 0;
+        unsigned int peaks = 0, lttb = 0, minmax = 0;
+        size_t mem = 256;
+        int opt, modes = 0, ret = EXIT_SUCCESS;
+        std::vector<heap_log> logs;
+
+        num_threads = std::thread::hardware_concurrency();
+        while ((opt = getopt(argc, argv, "f:j:o:w:p:d:M:S:m:")) != -1) {
+                switch (opt) {
+                case 'f': field_name = optarg; break;
+                case 'j': num_threads = atoi(optarg); break;
+                case 'o': out_name = optarg; break;
+                case 'w': width = atof(optarg); break;
+                case 'p': peaks = atoi(optarg); ++modes; break;
+                case 'd': lttb = atoi(optarg); ++modes; break;
+                case 'M': minmax = atoi(optarg); ++modes; break;
+                case 'S': sort_name = optarg; ++modes; break;
+                case 'm': mem = atol(optarg); break;
+                default: usage(argv[0]);
+                }
+        }
+        if (width > 0 && !peaks)
+                ++modes;
+        if (!num_threads)
+                num_threads = 1;
+        if (optind >= argc || modes > 1 || width < 0 || !mem ||
+            (sort_name && argc - optind != 1))
+                usage(argv[0]);
+
+        logs.resize(argc - optind);
+        for (size_t i = 0; i < logs.size(); ++i)
+                if (open_heap_log(argv[optind + i], logs[i]) != 0)
+                        return EXIT_FAILURE;
+
+        if (sort_name)
+                return sort_log(logs[0], sort_name, mem << 20) == 0
+                       ? EXIT_SUCCESS : EXIT_FAILURE;
+        if (!modes) {
+                /* one summary for all logs */
+                FILE *out = stdout;
+                if (out_name && !(out = fopen(out_name, "w"))) {
+                        perror(out_name);
+                        return EXIT_FAILURE;
+                }
+                print_summary(out, logs);
+                if (out != stdout)
+                        fclose(out);
+                return EXIT_SUCCESS;
+        }
+        for (size_t i = 0; i < logs.size(); ++i) {
+                FILE *out = open_output(out_name, logs, i);
+                if (!out) {
+                        ret = EXIT_FAILURE;
+                        continue;
+                }
+                if (peaks)
+                        print_peaks(out, logs[i], width > 0 ? width :
+                                    default_width(logs[i], DEFAULT_WINDOWS),
+                                    peaks);
+                else if (lttb)
+                        print_lttb(out, logs[i], lttb);
+                else if (minmax)
+                        print_minmax(out, logs[i], minmax);
+                else
+                        print_series(out, logs[i], width);
+                if (out != stdout)
+                        fclose(out);
+        }
+        return ret;
+}
@@ -0,0 +1,263 @@
+/*
+ * heaplog_decode - converts the binary heap.log written by malloc_count into
+ * CSV for memprofile.gnuplot.
+ *
+ *   heaplog_decode [-H] [-f field,field,...] [-t from,to] [-o out.csv]
+ *                  [heap.log]
+ *
+ *   -H  print a header line with the field names
+ *   -f  print only the given fields, in the given order
+ *   -t  print only the records from second from to second to; either may be
+ *       left out ("3000," or ",100")
+ *   -o  write to a file instead of stdout
+ *
+ * Without -f all fields are printed in the order of the log header, which
+ * starts with timestamp and curr_heap_size. Reads raw and compact
+ * (MALLOC_COUNT_LOG_FORMAT=compact) logs, and logs of header version 1.
+ * If heap.log.idx exists (MALLOC_COUNT_LOG_SEGMENT_MB) the segments are read
+ * in turn, and -t starts at the index entry before from instead of at the
+ * beginning.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <unistd.h>
+#include "heaplog.h"
+#include "heaplog_print.h"
+
+#define READ_BATCH      4096    /* records per fread() */
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-H] [-f field,...] [-t from,to] "
+                "[-o out.csv] [heap.log]\n", prog);
+        exit(EXIT_FAILURE);
+}
+
+/* what is printed, shared by all segments */
+static FILE *out;
+static int sel[HEAPLOG_MAX_FIELDS], nsel;
+static double from = -DBL_MAX, to = DBL_MAX;
+
+/* opens a log and reads its header; NULL if it is not one */
+static FILE *open_log(const char *name, struct heaplog_header *h)
+{
+        FILE *in;
+        size_t hsize;
+
+        if (!(in = fopen(name, "rb"))) {
+                perror(name);
+                return NULL;
+        }
+        memset(h, 0, sizeof(*h));
+        if (fread(h, HEAPLOG_V1_HEADER_SIZE, 1, in) != 1 ||
+            memcmp(h->magic, HEAPLOG_MAGIC, sizeof(HEAPLOG_MAGIC)) != 0) {
+                fprintf(stderr, "%s: not a binary heap log\n", name);
+                fclose(in);
+                return NULL;
+        }
+        hsize = (h->version == 1) ? HEAPLOG_V1_HEADER_SIZE : sizeof(*h);
+        if (h->version > 1 &&
+            fread((char *)h + HEAPLOG_V1_HEADER_SIZE,
+                  sizeof(*h) - HEAPLOG_V1_HEADER_SIZE, 1, in) != 1)
+                hsize = 0;
+        if (h->version < 1 || h->version > HEAPLOG_VERSION ||
+            h->header_size != hsize || h->num_fields > HEAPLOG_MAX_FIELDS ||
+            h->encoding > HEAPLOG_ENC_BLOCKS ||
+            (h->encoding == HEAPLOG_ENC_BLOCKS &&
+             (h->block_size <= sizeof(struct heaplog_block) ||
+              h->ticks_per_ns <= 0))) {
+                fprintf(stderr, "%s: unsupported heap log version %u\n",
+                        name, h->version);
+                fclose(in);
+                return NULL;
+        }
+        return in;
+}
+
+/* prints the records of buf within the time range; 1 once past its end */
+static int print_records(const struct heaplog_header *h, int ts_field,
+                         const char *buf, size_t n)
+{
+        size_t i;
+        double ts;
+
+        for (i = 0; i < n; ++i) {
+                const char *rec = buf + i * h->record_size;
+                if (ts_field >= 0) {
+                        memcpy(&ts, rec + h->fields[ts_field].offset,
+                               sizeof(ts));
+                        if (ts < from)
+                                continue;
+                        if (ts > to)
+                                return 1;
+                }
+                print_record(out, h, sel, nsel, rec);
+        }
+        return 0;
+}
+
+/* prints the records of in from the current position; 1 once past the end
+ * of the time range, -1 on error */
+static int decode(FILE *in, const char *name, const struct heaplog_header *h)
+{
+        int ts_field = find_field(h, HEAPLOG_TIMESTAMP);
+        size_t n, max = READ_BATCH;
+        char *buf, *block = NULL;
+        int bad = 0, done = 0;
+
+        if (h->encoding == HEAPLOG_ENC_BLOCKS) {
+                max = h->block_size;    /* records per block, at most */
+                block = malloc(h->block_size);
+        }
+        buf = malloc((size_t)h->record_size * max);
+        if (!buf || (h->encoding == HEAPLOG_ENC_BLOCKS && !block)) {
+                perror("malloc");
+                free(buf);
+                return -1;
+        }
+        if (h->encoding == HEAPLOG_ENC_BLOCKS) {
+                while (!done && fread(block, h->block_size, 1, in) == 1) {
+                        int k = heaplog_decode_block(h, block, h->block_size,
+                                                     buf, max);
+                        if (k < 0) {
+                                ++bad;
+                                continue;
+                        }
+                        done = print_records(h, ts_field, buf, k);
+                }
+        } else {
+                while (!done &&
+                       (n = fread(buf, h->record_size, READ_BATCH, in)) > 0)
+                        done = print_records(h, ts_field, buf, n);
+        }
+        if (bad)
+                fprintf(stderr, "%s: skipped %d damaged blocks\n", name, bad);
+        free(block);
+        free(buf);
+        return done;
+}
+
+static void print_info(const struct heaplog_header *h, int print_header)
+{
+        fprintf(stderr, "backend %.16s, clock %.16s, %u byte records\n",
+                h->backend, h->clock, h->record_size);
+        if (print_header)
+                print_header_line(out, h, sel, nsel);
+}
+
+/* reads the segments of a MALLOC_COUNT_LOG_SEGMENT_MB log, starting at the
+ * last index entry before from */
+static int decode_segments(FILE *idx, const char *in_name,
+                           char *field_list, int print_header)
+{
+        struct heaplog_index_header ih;
+        struct heaplog_index_entry e, start;
+        struct heaplog_header h;
+        char name[4096];
+        uint32_t seg;
+        int first = 1, ret = 0;
+
+        if (fread(&ih, sizeof(ih), 1, idx) != 1 ||
+            memcmp(ih.magic, HEAPLOG_INDEX_MAGIC,
+                   sizeof(HEAPLOG_INDEX_MAGIC)) != 0 ||
+            ih.version != HEAPLOG_INDEX_VERSION || ih.entry_size < sizeof(e)) {
+                fprintf(stderr, "%s%s: not a heap log index\n", in_name,
+                        HEAPLOG_INDEX_SUFFIX);
+                return -1;
+        }
+        memset(&start, 0, sizeof(start));
+        start.offset = sizeof(h);
+        while (fread(&e, sizeof(e), 1, idx) == 1) {
+                if (e.first_time > from)
+                        break;
+                start = e;
+                if (ih.entry_size > sizeof(e))
+                        fseek(idx, ih.entry_size - sizeof(e), SEEK_CUR);
+        }
+
+        for (seg = start.segment; ; ++seg) {
+                FILE *in;
+                snprintf(name, sizeof(name), HEAPLOG_SEGMENT_FORMAT, in_name,
+                         seg);
+                if (access(name, F_OK) != 0)
+                        break;
+                if (!(in = open_log(name, &h)))
+                        return -1;
+                if (first) {
+                        if ((nsel = select_fields(&h, field_list, sel)) < 0) {
+                                fclose(in);
+                                return -1;
+                        }
+                        print_info(&h, print_header);
+                        first = 0;
+                        if (fseek(in, start.offset, SEEK_SET) != 0) {
+                                perror(name);
+                                fclose(in);
+                                return -1;
+                        }
+                }
+                ret = decode(in, name, &h);
+                fclose(in);
+                if (ret)
+                        break;
+        }
+        if (first)
+                fprintf(stderr, "%s: no segments\n", in_name);
+        return (ret < 0 || first) ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+        const char *in_name = "heap.log", *out_name = NULL;
+        char *field_list = NULL, *comma, idx_name[4096];
+        int print_header = 0, opt, ret;
+        struct heaplog_header h;
+        FILE *in, *idx;
+
+        out = stdout;
+        while ((opt = getopt(argc, argv, "Hf:t:o:")) != -1) {
+                switch (opt) {
+                case 'H': print_header = 1; break;
+                case 'f': field_list = optarg; break;
+                case 't':
+                        if (!(comma = strchr(optarg, ',')))
+                                usage(argv[0]);
+                        if (comma != optarg)
+                                from = atof(optarg);
+                        if (comma[1])
+                                to = atof(comma + 1);
+                        break;
+                case 'o': out_name = optarg; break;
+                default: usage(argv[0]);
+                }
+        }
+        if (optind < argc)
+                in_name = argv[optind];
+
+        if (out_name && !(out = fopen(out_name, "w"))) {
+                perror(out_name);
+                return EXIT_FAILURE;
+        }
+        setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+        snprintf(idx_name, sizeof(idx_name), "%s" HEAPLOG_INDEX_SUFFIX,
+                 in_name);
+        if ((idx = fopen(idx_name, "rb")) != NULL) {
+                ret = decode_segments(idx, in_name, field_list, print_header);
+                fclose(idx);
+        } else {
+                if (!(in = open_log(in_name, &h)))
+                        return EXIT_FAILURE;
+                if ((nsel = select_fields(&h, field_list, sel)) < 0)
+                        return EXIT_FAILURE;
+                print_info(&h, print_header);
+                ret = decode(in, in_name, &h);
+                fclose(in);
+        }
+
+        if (out != stdout)
+                fclose(out);
+        return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
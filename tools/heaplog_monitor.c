@@ -0,0 +1,202 @@
+/*
+ * heaplog_monitor - follows the heap log of a running program which logs to
+ * shared memory (MALLOC_COUNT_LOG_SHM=name). The segment is mapped read only,
+ * so any number of monitors can follow one run without slowing it down; a
+ * monitor which falls more than the ring capacity behind loses records and
+ * reports them.
+ *
+ *   heaplog_monitor [-H] [-a] [-f field,...] [-s secs] name
+ *
+ *   -H  print a header line with the field names
+ *   -a  start at the oldest record still in the ring, not at the newest
+ *   -f  print only the given fields, in the given order
+ *   -s  instead of records print a summary every secs seconds: records per
+ *       second, heap size, records lost by the program and by the monitor
+ *
+ * Waits for the segment to appear and exits once the program has finished
+ * and every record has been read.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "heaplog.h"
+#include "heaplog_print.h"
+
+#define READ_BATCH      4096    /* records per copy out of the ring */
+#define POLL_US         10000   /* sleep while there is nothing new */
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s [-H] [-a] [-f field,...] [-s secs] name\n",
+                prog);
+        exit(EXIT_FAILURE);
+}
+
+/* maps the segment once the program has created and initialized it */
+static const struct heaplog_shm *attach(const char *path)
+{
+        const struct heaplog_shm *shm;
+        struct stat st;
+        void *p;
+        int fd;
+
+        for (;;) {
+                fd = shm_open(path, O_RDONLY, 0);
+                if (fd >= 0 && fstat(fd, &st) == 0 &&
+                    (size_t)st.st_size > sizeof(*shm))
+                        break;
+                if (fd >= 0)
+                        close(fd);
+                usleep(100000);
+        }
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+        shm = (const struct heaplog_shm *)p;
+        while (memcmp(shm->magic, HEAPLOG_SHM_MAGIC,
+                      sizeof(HEAPLOG_SHM_MAGIC)) != 0)
+                usleep(1000);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (shm->version != HEAPLOG_SHM_VERSION ||
+            shm->log.version != HEAPLOG_VERSION ||
+            shm->log.num_fields > HEAPLOG_MAX_FIELDS ||
+            shm->header_size + shm->capacity * shm->log.record_size >
+            (uint64_t)st.st_size) {
+                fprintf(stderr, "%s: unsupported heap log segment\n", path);
+                exit(EXIT_FAILURE);
+        }
+        return shm;
+}
+
+static double now_s(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+        char *field_list = NULL;
+        int print_header = 0, oldest = 0, opt;
+        double interval = 0, next_summary;
+        int sel[HEAPLOG_MAX_FIELDS], nsel;
+        int heap_field, lost_field;
+        const struct heaplog_shm *shm;
+        const struct heaplog_header *h;
+        const char *records;
+        char path[256], *buf;
+        uint64_t pos, cap, end, begin;
+        unsigned long long nrecs = 0, lost = 0, missed = 0, last_nrecs = 0;
+        uint32_t heap = 0, u32;
+
+        while ((opt = getopt(argc, argv, "Haf:s:")) != -1) {
+                switch (opt) {
+                case 'H': print_header = 1; break;
+                case 'a': oldest = 1; break;
+                case 'f': field_list = optarg; break;
+                case 's': interval = atof(optarg); break;
+                default: usage(argv[0]);
+                }
+        }
+        if (optind >= argc)
+                usage(argv[0]);
+        snprintf(path, sizeof(path), "%s%s", argv[optind][0] == '/' ? "" : "/",
+                 argv[optind]);
+
+        shm = attach(path);
+        h = &shm->log;
+        cap = shm->capacity;
+        records = (const char *)shm + shm->header_size;
+        if ((nsel = select_fields(h, field_list, sel)) < 0)
+                return EXIT_FAILURE;
+        heap_field = find_field(h, "curr_heap_size");
+        lost_field = find_field(h, "lost");
+        fprintf(stderr, "backend %.16s, clock %.16s, %llu records of %u "
+                "bytes\n", h->backend, h->clock, (unsigned long long)cap,
+                h->record_size);
+        if (print_header && !interval)
+                print_header_line(stdout, h, sel, nsel);
+
+        buf = malloc((size_t)h->record_size * READ_BATCH);
+        if (!buf) {
+                perror("malloc");
+                return EXIT_FAILURE;
+        }
+        end = __atomic_load_n(&shm->write_end, __ATOMIC_ACQUIRE);
+        pos = end;
+        if (oldest)
+                pos = end > cap ? end - cap : 0;
+        missed = oldest ? pos : 0;      /* no longer in the ring */
+        next_summary = now_s() + interval;
+
+        for (;;) {
+                uint64_t n, i, skip;
+
+                end = __atomic_load_n(&shm->write_end, __ATOMIC_ACQUIRE);
+                if (interval && now_s() >= next_summary) {
+                        printf("%.0f records/s, heap %u, lost %llu, "
+                               "missed %llu\n", (nrecs - last_nrecs) /
+                               interval, heap, lost, missed);
+                        fflush(stdout);
+                        last_nrecs = nrecs;
+                        next_summary += interval;
+                }
+                if (end == pos) {
+                        if (__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE) &&
+                            __atomic_load_n(&shm->write_end,
+                                            __ATOMIC_ACQUIRE) == pos)
+                                break;
+                        fflush(stdout);
+                        usleep(POLL_US);
+                        continue;
+                }
+                if (end - pos > cap) {
+                        missed += end - pos - cap;
+                        pos = end - cap;
+                }
+                n = end - pos < READ_BATCH ? end - pos : READ_BATCH;
+                for (i = 0; i < n; ++i)
+                        memcpy(buf + i * h->record_size,
+                               records + ((pos + i) & (cap - 1)) *
+                               h->record_size, h->record_size);
+
+                /* drop what the program overwrote while it was copied */
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                begin = __atomic_load_n(&shm->write_begin, __ATOMIC_RELAXED);
+                skip = (begin > cap && begin - cap > pos) ? begin - cap - pos
+                                                          : 0;
+                if (skip > n)
+                        skip = n;
+                missed += skip;
+
+                for (i = skip; i < n; ++i) {
+                        const char *rec = buf + i * h->record_size;
+                        if (lost_field >= 0) {
+                                memcpy(&u32, rec + h->fields[lost_field].offset,
+                                       sizeof(u32));
+                                lost += u32;
+                        }
+                        if (heap_field >= 0)
+                                memcpy(&heap, rec +
+                                       h->fields[heap_field].offset,
+                                       sizeof(heap));
+                        if (!interval)
+                                print_record(stdout, h, sel, nsel, rec);
+                }
+                nrecs += n - skip;
+                pos += n;
+        }
+        fprintf(stderr, "%llu records, %llu lost by the program, %llu missed "
+                "by the monitor\n", nrecs, lost, missed);
+        free(buf);
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+/*
+ * heaplog_print.h - field lookup and CSV output shared by the heap log tools.
+ */
+#ifndef __HEAPLOG_PRINT_H__
+#define __HEAPLOG_PRINT_H__
+#include <stdio.h>
+#include <string.h>
+#include "heaplog.h"
+
+static int find_field(const struct heaplog_header *h, const char *name)
+{
+        uint32_t i;
+        for (i = 0; i < h->num_fields; ++i)
+                if (strncmp(h->fields[i].name, name, HEAPLOG_NAME_LEN) == 0)
+                        return i;
+        return -1;
+}
+
+/* Fills sel with the indices of the comma separated fields in list, or of
+ * all fields if list is NULL. Returns their number, -1 for an unknown name. */
+static int select_fields(const struct heaplog_header *h, char *list, int *sel)
+{
+        int k, nsel = 0;
+
+        if (!list) {
+                for (k = 0; k < (int)h->num_fields; ++k)
+                        sel[nsel++] = k;
+                return nsel;
+        }
+        for (list = strtok(list, ","); list && nsel < HEAPLOG_MAX_FIELDS;
+             list = strtok(NULL, ",")) {
+                if ((k = find_field(h, list)) < 0) {
+                        fprintf(stderr, "unknown field %s\n", list);
+                        return -1;
+                }
+                sel[nsel++] = k;
+        }
+        return nsel;
+}
+
+static void print_value(FILE *out, const struct heaplog_field *f,
+                        const char *rec)
+{
+        const char *p = rec + f->offset;
+        uint32_t u32;
+        uint64_t u64;
+        float f32;
+        double f64;
+
+        switch (f->type) {
+        case HEAPLOG_U32:
+                memcpy(&u32, p, sizeof(u32));
+                fprintf(out, "%u", u32);
+                break;
+        case HEAPLOG_U64:
+                memcpy(&u64, p, sizeof(u64));
+                fprintf(out, "%llu", (unsigned long long)u64);
+                break;
+        case HEAPLOG_F32:
+                memcpy(&f32, p, sizeof(f32));
+                fprintf(out, "%.9g", f32);
+                break;
+        case HEAPLOG_F64:
+                memcpy(&f64, p, sizeof(f64));
+                fprintf(out, "%.9f", f64);
+                break;
+        default:
+                fputc('?', out);
+        }
+}
+
+static void print_header_line(FILE *out, const struct heaplog_header *h,
+                              const int *sel, int nsel)
+{
+        int k;
+        for (k = 0; k < nsel; ++k)
+                fprintf(out, "%s%.16s", k ? "," : "", h->fields[sel[k]].name);
+        fputc('\n', out);
+}
+
+static void print_record(FILE *out, const struct heaplog_header *h,
+                         const int *sel, int nsel, const char *rec)
+{
+        int k;
+        for (k = 0; k < nsel; ++k) {
+                if (k) fputc(',', out);
+                print_value(out, &h->fields[sel[k]], rec);
+        }
+        fputc('\n', out);
+}
+
+#endif /* __HEAPLOG_PRINT_H__ */